@@ -1,7 +1,10 @@
 #include <benchmark/benchmark.h>
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <thread>
 #include <vector>
 
 #include "common/scoped_timer.h"
@@ -16,6 +19,8 @@ using Value = uint64_t;
 class BPlusTreeBenchmark : public benchmark::Fixture {
  public:
   void SetUp(const benchmark::State &state) final {
+    // 同一个benchmark的不同参数共用一个fixture对象，每次都要重新生成key，否则key会不断累积
+    keys_.clear();
     for (int i = 10000000; i < num_keys_ + 10000000; i++) {
       keys_.push_back(std::to_string(i) + std::to_string(i + 1) + std::to_string(i + 2));
     }
@@ -30,6 +35,28 @@ class BPlusTreeBenchmark : public benchmark::Fixture {
   std::vector<std::string> keys_;
 };
 
+// 输出从before开始的OLC统计信息，需要编译时打开BPLUSTREE_STATS
+static void ReportOLCStats(benchmark::State &state, const pidan::OLCStats &before) {
+  if (!pidan::OLCStatsCollector::ENABLED) {
+    return;
+  }
+  pidan::OLCStats stats = pidan::BPlusTree<Key, Value>::Stats() - before;
+  state.counters["read_lock_restarts"] = stats.read_lock_restarts;
+  state.counters["upgrade_restarts"] = stats.upgrade_restarts;
+  state.counters["root_changed_restarts"] = stats.root_changed_restarts;
+  state.counters["split_restarts"] = stats.split_restarts;
+  state.counters["spins"] = stats.spins;
+  state.counters["yields"] = stats.yields;
+  state.counters["sleeps"] = stats.sleeps;
+  state.counters["epoch_joins"] = stats.epoch_joins;
+  state.counters["epoch_leaves"] = stats.epoch_leaves;
+  for (int level = 0; level < pidan::BPLUSTREE_MAX_HEIGHT; level++) {
+    if (stats.splits[level] > 0) {
+      state.counters["splits_level" + std::to_string(level)] = stats.splits[level];
+    }
+  }
+}
+
 BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeLookup)(benchmark::State &state) {
   pidan::BPlusTree<Key, Value> tree;
   Value temp_val;
@@ -38,22 +65,85 @@ BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeLookup)(benchmark::State &state)
     tree.InsertUnique(k, 0, &temp_val);
   }
 
+  pidan::OLCStats before = tree.Stats();
   for (auto _ : state) {
     for (auto &i : keys_) {
       tree.Lookup(i, &temp_val);
     }
   }
+  ReportOLCStats(state, before);
+}
+
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeMultiLookup)(benchmark::State &state) {
+  pidan::BPlusTree<Key, Value> tree;
+  Value temp_val;
+
+  for (auto &k : keys_) {
+    tree.InsertUnique(k, 0, &temp_val);
+  }
+
+  std::vector<Key> keys(keys_.begin(), keys_.end());
+  std::vector<Value> values(keys.size());
+  std::unique_ptr<bool[]> found(new bool[keys.size()]);
+  for (auto _ : state) {
+    tree.MultiLookup(keys.data(), keys.size(), values.data(), found.get());
+  }
 }
 
 BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeInsert)(benchmark::State &state) {
   pidan::BPlusTree<Key, Value> tree;
   Value temp_val;
 
+  pidan::OLCStats before = tree.Stats();
   for (auto _ : state) {
     for (auto &k : keys_) {
       tree.InsertUnique(k, 0, &temp_val);
     }
   }
+  state.counters["restarts"] = tree.InsertRestartNum();
+  state.counters["resumes"] = tree.InsertResumeNum();
+  ReportOLCStats(state, before);
+}
+
+// 按key递增的顺序逐个插入，插入都集中在最右的叶子节点上
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeSequentialInsert)(benchmark::State &state) {
+  std::vector<std::string> keys = keys_;
+  std::sort(keys.begin(), keys.end());
+  Value temp_val;
+
+  for (auto _ : state) {
+    pidan::BPlusTree<Key, Value> tree;
+    for (auto &k : keys) {
+      tree.InsertUnique(k, 0, &temp_val);
+    }
+  }
+}
+
+// 和逐个插入的BPlusTreeInsert对比，输入需要事先排好序
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeBulkLoad)(benchmark::State &state) {
+  std::vector<std::pair<std::string, Value>> data;
+  for (auto &k : keys_) {
+    data.emplace_back(k, 0);
+  }
+  std::sort(data.begin(), data.end());
+
+  for (auto _ : state) {
+    pidan::BPlusTree<Key, Value> tree;
+    tree.BulkLoad(data.begin(), data.end());
+  }
+}
+
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeParallelBulkLoad)(benchmark::State &state) {
+  std::vector<std::pair<std::string, Value>> data;
+  for (auto &k : keys_) {
+    data.emplace_back(k, 0);
+  }
+  std::sort(data.begin(), data.end());
+
+  for (auto _ : state) {
+    pidan::BPlusTree<Key, Value> tree;
+    tree.ParallelBulkLoad(data.begin(), data.end(), 8);
+  }
 }
 
 BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeLookupMultiThread)(benchmark::State &state) {
@@ -81,9 +171,11 @@ BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeLookupMultiThread)(benchmark::St
               << " keys use time (ms) : " << static_cast<double>(elapsed_ms) << '\n';
   };
 
+  pidan::OLCStats before = tree.Stats();
   for (auto _ : state) {
     pidan::ThreadPoolRunWorkloadUntilFinish(&tp, task);
   }
+  ReportOLCStats(state, before);
 }
 
 BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeInsertMultiThread)(benchmark::State &state) {
@@ -107,13 +199,147 @@ BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeInsertMultiThread)(benchmark::St
               << " keys use time (ms) : " << static_cast<double>(elapsed_ms) << '\n';
   };
 
+  pidan::OLCStats before = tree.Stats();
+  for (auto _ : state) {
+    pidan::ThreadPoolRunWorkloadUntilFinish(&tp, task);
+  }
+  state.counters["restarts"] = tree.InsertRestartNum();
+  state.counters["resumes"] = tree.InsertResumeNum();
+  ReportOLCStats(state, before);
+}
+
+// 所有线程交错插入递增的整数key，写操作集中在最右边的叶子节点上。
+// 线程数是CPU核数的state.range(0)倍，用来观察线程数超过核数时等待节点解锁的开销。
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeHotInsertOversubscribed)(benchmark::State &state) {
+  int thread_num = std::max(1U, std::thread::hardware_concurrency()) * state.range(0);
+  pidan::ThreadPool tp(thread_num);
+
+  pidan::OLCStats before = pidan::BPlusTree<uint64_t, Value>::Stats();
   for (auto _ : state) {
+    pidan::BPlusTree<uint64_t, Value> tree;
+    auto task = [&](int thread_id) {
+      Value val;
+      for (uint64_t i = thread_id; i < num_keys_; i += thread_num) {
+        tree.InsertUnique(i, 0, &val);
+      }
+    };
     pidan::ThreadPoolRunWorkloadUntilFinish(&tp, task);
   }
+  state.counters["threads"] = thread_num;
+  ReportOLCStats(state, before);
+}
+
+// 整数key使用定长的KeyMap，和字符串key对比查找与插入的性能
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeIntegerLookup)(benchmark::State &state) {
+  pidan::BPlusTree<uint64_t, Value> tree;
+  Value temp_val;
+
+  std::vector<uint64_t> keys;
+  for (auto &k : keys_) {
+    keys.push_back(std::stoull(k.substr(0, 8)));
+  }
+  for (auto k : keys) {
+    tree.InsertUnique(k, 0, &temp_val);
+  }
+
+  for (auto _ : state) {
+    for (auto k : keys) {
+      tree.Lookup(k, &temp_val);
+    }
+  }
+}
+
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeIntegerInsert)(benchmark::State &state) {
+  pidan::BPlusTree<uint64_t, Value> tree;
+  Value temp_val;
+
+  std::vector<uint64_t> keys;
+  for (auto &k : keys_) {
+    keys.push_back(std::stoull(k.substr(0, 8)));
+  }
+  for (auto _ : state) {
+    for (auto k : keys) {
+      tree.InsertUnique(k, 0, &temp_val);
+    }
+  }
+}
+
+// 叶子节点大小为LEAF_SIZE时依次插入、查找和遍历所有key，三个阶段的耗时分别记录在counters中
+template <uint32_t LEAF_SIZE>
+static void RunNodeSizeSweep(benchmark::State &state, const std::vector<std::string> &keys) {
+  uint64_t insert_ms = 0, lookup_ms = 0, scan_ms = 0;
+  for (auto _ : state) {
+    pidan::BPlusTree<Key, Value, LEAF_SIZE> tree;
+    Value temp_val;
+    {
+      pidan::ScopedTimer<std::chrono::milliseconds> timer(&insert_ms);
+      for (auto &k : keys) {
+        tree.InsertUnique(k, 0, &temp_val);
+      }
+    }
+    {
+      pidan::ScopedTimer<std::chrono::milliseconds> timer(&lookup_ms);
+      for (auto &k : keys) {
+        tree.Lookup(k, &temp_val);
+      }
+    }
+    {
+      pidan::ScopedTimer<std::chrono::milliseconds> timer(&scan_ms);
+      typename pidan::BPlusTree<Key, Value, LEAF_SIZE>::Iterator iter(&tree);
+      uint64_t sum = 0;
+      for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
+        sum += iter.Value();
+      }
+      benchmark::DoNotOptimize(sum);
+    }
+  }
+  state.counters["insert_ms"] = insert_ms;
+  state.counters["lookup_ms"] = lookup_ms;
+  state.counters["scan_ms"] = scan_ms;
+}
+
+// 参数是叶子节点的大小，内部节点使用默认大小
+BENCHMARK_DEFINE_F(BPlusTreeBenchmark, BPlusTreeNodeSizeSweep)(benchmark::State &state) {
+  switch (state.range(0)) {
+    case 256:
+      RunNodeSizeSweep<256>(state, keys_);
+      break;
+    case 1 << 10:
+      RunNodeSizeSweep<1 << 10>(state, keys_);
+      break;
+    case 4 << 10:
+      RunNodeSizeSweep<4 << 10>(state, keys_);
+      break;
+    case 16 << 10:
+      RunNodeSizeSweep<16 << 10>(state, keys_);
+      break;
+    case 64 << 10:
+      RunNodeSizeSweep<64 << 10>(state, keys_);
+      break;
+    default:
+      state.SkipWithError("unsupported node size");
+  }
 }
 
-// BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeLookup)->Unit(benchmark::kMillisecond);
-// BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeInsert)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeLookup)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeMultiLookup)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeInsert)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeSequentialInsert)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeBulkLoad)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeParallelBulkLoad)->Unit(benchmark::kMillisecond);
 // BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeLookupMultiThread)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeIntegerLookup)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeIntegerInsert)->Unit(benchmark::kMillisecond);
 BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeInsertMultiThread)->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeHotInsertOversubscribed)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16)
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_REGISTER_F(BPlusTreeBenchmark, BPlusTreeNodeSizeSweep)
+    ->RangeMultiplier(4)
+    ->Range(256, 64 << 10)
+    ->Iterations(1)
+    ->Unit(benchmark::kMillisecond);
 BENCHMARK_MAIN();
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "common/thread_registry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <stdexcept>
+
+namespace pidan {
+
+namespace {
+
+// used_ids[index]为true表示id为index的线程仍然存在
+std::atomic<bool> used_ids[MAX_ACCESS_THREAD];
+
+// 线程退出时的回调，只有几个模块会注册
+constexpr int MAX_EXIT_HOOK = 4;
+std::atomic<ThreadRegistry::ExitHook> exit_hooks[MAX_EXIT_HOOK];
+std::atomic<int> exit_hook_num{0};
+
+}  // namespace
+
+bool ThreadRegistry::AddExitHook(ExitHook hook) {
+  int i = exit_hook_num.fetch_add(1);
+  assert(i < MAX_EXIT_HOOK);
+  exit_hooks[i].store(hook);
+  return true;
+}
+
+ThreadRegistry::LocalID::LocalID() {
+  for (int i = 0; i < MAX_ACCESS_THREAD; i++) {
+    bool expected = false;
+    if (used_ids[i].compare_exchange_strong(expected, true)) {
+      id = i;
+      return;
+    }
+  }
+  throw std::runtime_error("no enough threads id to assign ");
+}
+
+ThreadRegistry::LocalID::~LocalID() {
+  int num = std::min(exit_hook_num.load(), MAX_EXIT_HOOK);
+  for (int i = 0; i < num; i++) {
+    // 注册还没有完成时回调可能还是nullptr
+    ExitHook hook = exit_hooks[i].load();
+    if (hook != nullptr) {
+      hook(id);
+    }
+  }
+  used_ids[id].store(false);
+}
+
+}  // namespace pidan
@@ -3,23 +3,45 @@
 namespace pidan {
 
 Status DBImpl::Put(const Slice &key, const Slice &value) {
-  Transaction *txn = txn_manager_.BeginWriteTransaction();
-  DataHeader *dh = new DataHeader(txn);
-  DataHeader *old_dh = nullptr;
+  for (;;) {
+    Transaction *txn = txn_manager_.BeginWriteTransaction();
+    DataHeader *dh = nullptr;
 
-  auto result = index_.InsertUnique(key, dh, &old_dh);
-  if (!result) {
-    delete dh;
-    if (!old_dh->Put(txn, value)) {
-      txn_manager_.Abort(txn);
-      return Status::FAIL_BY_ACTIVE_TXN;
+    // 只有key不存在的时候才会创建新的DataHeader，更新已有的key不需要分配内存。
+    auto exist = index_.CreateIfNotExist(key, &dh, [txn] { return new DataHeader(txn); });
+    if (exist) {
+      if (!dh->Put(txn, value)) {
+        // 事务结束之后dh可能被GC线程释放，要在Abort之前检查
+        bool deleted = dh->IsDeleted();
+        txn_manager_.Abort(txn);
+        if (deleted) {
+          // GC线程正在把这个key从索引中删除，重试直到创建新的DataHeader
+          continue;
+        }
+        return Status::FAIL_BY_ACTIVE_TXN;
+      }
+    } else {
+      auto result = dh->Put(txn, value);
+      assert(result);
+      (void)result;
     }
-  } else {
-    result = dh->Put(txn, value);
-    assert(result);
+    txn_manager_.Commit(txn);
+    return Status::SUCCESS;
+  }
+}
+
+Status DBImpl::Delete(const Slice &key) {
+  Transaction *txn = txn_manager_.BeginWriteTransaction();
+  DataHeader *dh = nullptr;
+  bool not_found = true;
+  if (index_.Lookup(key, &dh) && !dh->Delete(txn, key, &not_found)) {
+    // 已经被GC线程标记删除的key对所有事务都不存在
+    bool deleted = dh->IsDeleted();
+    txn_manager_.Abort(txn);
+    return deleted ? Status::KEY_NOT_EXIST : Status::FAIL_BY_ACTIVE_TXN;
   }
   txn_manager_.Commit(txn);
-  return Status::SUCCESS;
+  return not_found ? Status::KEY_NOT_EXIST : Status::SUCCESS;
 }
 
 Status DBImpl::Get(const Slice &key, std::string *val) {
@@ -30,7 +52,9 @@ Status DBImpl::Get(const Slice &key, std::string *val) {
     return Status::KEY_NOT_EXIST;
   }
   bool not_found;
-  if (!dh->Select(&txn, val, &not_found)) {
+  bool success = dh->Select(&txn, val, &not_found);
+  txn_manager_.Commit(&txn);
+  if (!success) {
     return Status::FAIL_BY_ACTIVE_TXN;
   }
   if (not_found) {
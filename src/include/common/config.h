@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
 namespace pidan {
@@ -21,21 +22,73 @@ static constexpr int32_t BPLUSTREE_MERGE_THRESHOLD = 20;
 // 内存block大小，为1MB。
 static constexpr int32_t BLOCK_SIZE = 1 << 20;
 
-// B+树索引中内部节点的大小
+// B+树索引中内部节点的默认大小
 static constexpr uint32_t BPLUSTREE_INNERNODE_SIZE = 4096;
 
-// B+树索引中叶子节点的大小
+// B+树索引中叶子节点的默认大小
 static constexpr uint32_t BPLUSTREE_LEAFNODE_SIZE = 4096;
 
+// B+树批量构建时节点的默认填充率，预留一部分空间给之后的插入，避免刚构建完就大量分裂。
+static constexpr double BPLUSTREE_BULKLOAD_FILL_FACTOR = 0.75;
+
+// B+树节点大小的范围，节点的大小必须是2的幂
+static constexpr uint32_t BPLUSTREE_MIN_NODE_SIZE = 256;
+static constexpr uint32_t BPLUSTREE_MAX_NODE_SIZE = 64 << 10;
+
+// B+树节点内存池每次向系统申请的内存大小
+static constexpr size_t BPLUSTREE_NODE_POOL_CHUNK_SIZE = 2 << 20;
+
+// B+树节点内存池中线程本地空闲链表和全局链表之间每次交换的slot的总字节数
+static constexpr size_t BPLUSTREE_NODE_POOL_BATCH_BYTES = 256 << 10;
+
+// huge page的大小
+static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// B+树的最大高度
+static constexpr int BPLUSTREE_MAX_HEIGHT = 32;
+
+// B+树批量查找时，一组同时下降的key的数量
+static constexpr int BPLUSTREE_MULTI_LOOKUP_BATCH = 16;
+
+// B+树批量查找时，每个节点预取的cache line数量，覆盖节点头部和index部分的开头
+static constexpr int BPLUSTREE_PREFETCH_LINES = 8;
+
+// B+树等待节点解锁时，每一轮自旋中_mm_pause次数的上限，每一轮的次数从1开始指数增长到这个上限
+static constexpr uint32_t BPLUSTREE_SPIN_MAX_PAUSE = 128;
+
+// B+树等待节点解锁时，_mm_pause的总次数超过这个值之后改为让出CPU
+static constexpr uint32_t BPLUSTREE_SPIN_LIMIT = 4096;
+
+// B+树等待节点解锁时，让出CPU的次数超过这个值之后在futex上睡眠，直到持有写锁的线程释放锁
+static constexpr uint32_t BPLUSTREE_YIELD_LIMIT = 16;
+
 // B+树中两个epoch之间的间隔时间，单位毫秒
 static constexpr uint32_t BPLUSTREE_EPOCH_INTERVAL = 100;
 
 // 最多有多少个线程来访问数据库
-static constexpr int MAX_ACCESS_THREAD = 32;
+static constexpr int MAX_ACCESS_THREAD = 64;
 
-// B+树中每个线程最多持有的GarbageNode数量
+// B+树中每个线程攒够多少个被删除的节点之后，作为一批交给GC线程
 static constexpr int BPLUS_TREE_MAX_GARBAGENODE_NUM_PER_THREAD = 128;
 
+// MVCC的GC线程两次回收之间的间隔时间，单位毫秒
+static constexpr uint32_t GC_INTERVAL = 10;
+
+// DataHeader中内联保存的最新已提交版本的最大长度，DataHeader正好占用一个cache line
+static constexpr uint32_t DATA_HEADER_INLINE_SIZE = 32;
+
+// 事务中不需要动态分配内存就能记录的锁和UndoRecord的数量，超过之后锁的集合改用哈希表查找
+static constexpr uint32_t TRANSACTION_INLINE_SET_SIZE = 8;
+
+// 事务和UndoRecord内存池中最大的slot，更大的UndoRecord直接用operator new分配
+static constexpr size_t TRANSACTION_POOL_MAX_SLOT_SIZE = 8 << 10;
+
+// 事务和UndoRecord内存池每次向系统申请的内存大小
+static constexpr size_t TRANSACTION_POOL_CHUNK_SIZE = 2 << 20;
+
+// 事务和UndoRecord内存池中线程本地空闲链表和全局链表之间每次交换的slot的总字节数
+static constexpr size_t TRANSACTION_POOL_BATCH_BYTES = 64 << 10;
+
 // CPU中cache line大小
 static constexpr int CACHE_LINE_SIZE = 64;
 
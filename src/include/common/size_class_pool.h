@@ -0,0 +1,182 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "common/config.h"
+#include "common/macros.h"
+
+namespace pidan {
+
+// 按size class管理定长slot的内存池，SizeClasses描述有哪些size class：
+//   NUM_SIZE_CLASS                 size class的数量
+//   MAX_SLOT_SIZE                  最大的slot大小，超过这个大小的对象直接用operator new分配
+//   CHUNK_SIZE                     每次向系统申请的大块内存的大小
+//   BATCH_BYTES                    本地链表和全局链表之间每次交换的slot的总字节数
+//   SizeClass(size)                能放下size字节的最小的size class
+//   SlotSizeOf(size_class)         size class对应的slot大小，必须是指针大小的倍数
+// 内存池从按huge page对齐的大块内存中切分出slot，并建议内核用huge page来映射这些大块内存，减少TLB miss。
+// 每个线程对每个size class有自己的空闲链表，分配和释放时不需要同步。本地链表为空时从全局链表中取一批slot，
+// 本地链表过长时还回去一批，所以GC线程回收的slot最终会回到分配它们的线程手中。
+// 内存池中的内存只有在进程退出时才会还给操作系统。
+template <typename SizeClasses>
+class SizeClassPool {
+ public:
+  DISALLOW_COPY_AND_MOVE(SizeClassPool);
+
+  // 内存池永远不会析构，线程退出时线程本地的空闲链表要还给它，主线程的thread_local对象可能晚于静态对象析构。
+  static SizeClassPool *Instance() {
+    static SizeClassPool *pool = new SizeClassPool();
+    return pool;
+  }
+
+  // 分配一个能放下size字节的slot
+  void *Allocate(size_t size) {
+    if (size > SizeClasses::MAX_SLOT_SIZE) {
+      return ::operator new(size);
+    }
+    int size_class = SizeClasses::SizeClass(size);
+    LocalCache *cache = &LocalCaches::Get()->caches[size_class];
+    if (cache->head == nullptr) {
+      Refill(size_class, cache);
+    }
+    FreeSlot *slot = cache->head;
+    cache->head = slot->next;
+    cache->size--;
+    return slot;
+  }
+
+  // 释放一个由Allocate(size)分配的slot。调用者要保证已经没有其他线程会访问这个slot。
+  void Free(void *ptr, size_t size) {
+    if (size > SizeClasses::MAX_SLOT_SIZE) {
+      ::operator delete(ptr);
+      return;
+    }
+    int size_class = SizeClasses::SizeClass(size);
+    LocalCache *cache = &LocalCaches::Get()->caches[size_class];
+    auto *slot = static_cast<FreeSlot *>(ptr);
+    slot->next = cache->head;
+    cache->head = slot;
+    if (++cache->size >= 2 * BatchSize(size_class)) {
+      Flush(size_class, cache, BatchSize(size_class));
+    }
+  }
+
+  // size字节的对象实际占用的slot大小
+  static constexpr size_t SlotSize(size_t size) {
+    return size > SizeClasses::MAX_SLOT_SIZE ? size : SizeClasses::SlotSizeOf(SizeClasses::SizeClass(size));
+  }
+
+ private:
+  static constexpr int NUM_SIZE_CLASS = SizeClasses::NUM_SIZE_CLASS;
+  static constexpr size_t CHUNK_SIZE = SizeClasses::CHUNK_SIZE;
+
+  struct FreeSlot {
+    FreeSlot *next;
+  };
+
+  struct LocalCache {
+    FreeSlot *head{nullptr};
+    size_t size{0};
+  };
+
+  // 线程本地的空闲链表，线程退出时把剩余的slot全部还给全局链表
+  struct LocalCaches {
+    LocalCache caches[NUM_SIZE_CLASS];
+
+    ~LocalCaches() {
+      for (int i = 0; i < NUM_SIZE_CLASS; i++) {
+        SizeClassPool::Instance()->Flush(i, &caches[i], caches[i].size);
+      }
+    }
+
+    static LocalCaches *Get() {
+      thread_local LocalCaches local_caches;
+      return &local_caches;
+    }
+  };
+
+  // 每个size class的全局链表以及正在切分的大块内存
+  struct SizeClassState {
+    std::vector<std::pair<FreeSlot *, size_t>> batches;  // 每一项是一个空闲链表以及它的长度
+    char *chunk{nullptr};
+    size_t chunk_offset{CHUNK_SIZE};  // 当前大块内存中下一个slot的位置
+  };
+
+  SizeClassPool() = default;
+
+  // 本地链表和全局链表之间每次交换的slot数量
+  static constexpr size_t BatchSize(int size_class) {
+    return std::max<size_t>(1, SizeClasses::BATCH_BYTES / SizeClasses::SlotSizeOf(size_class));
+  }
+
+  // 从全局链表中取一批slot，全局链表为空时从大块内存中切分。slot大小不能整除CHUNK_SIZE时，大块内存末尾放不下
+  // 一个slot的部分不再使用。
+  void Refill(int size_class, LocalCache *cache) {
+    std::lock_guard<std::mutex> guard(latch_);
+    SizeClassState &state = states_[size_class];
+    if (!state.batches.empty()) {
+      std::tie(cache->head, cache->size) = state.batches.back();
+      state.batches.pop_back();
+      return;
+    }
+    size_t slot_size = SizeClasses::SlotSizeOf(size_class);
+    for (size_t i = 0; i < BatchSize(size_class); i++) {
+      if (state.chunk_offset + slot_size > CHUNK_SIZE) {
+        state.chunk = AllocateChunk();
+        state.chunk_offset = 0;
+      }
+      auto *slot = reinterpret_cast<FreeSlot *>(state.chunk + state.chunk_offset);
+      state.chunk_offset += slot_size;
+      slot->next = cache->head;
+      cache->head = slot;
+      cache->size++;
+    }
+  }
+
+  // 将本地链表头部的num个slot作为一批还给全局链表
+  void Flush(int size_class, LocalCache *cache, size_t num) {
+    if (num == 0) {
+      return;
+    }
+    FreeSlot *head = cache->head, *tail = head;
+    for (size_t i = 1; i < num; i++) {
+      tail = tail->next;
+    }
+    cache->head = tail->next;
+    cache->size -= num;
+    tail->next = nullptr;
+    std::lock_guard<std::mutex> guard(latch_);
+    states_[size_class].batches.emplace_back(head, num);
+  }
+
+  // 调用者必须持有latch_
+  char *AllocateChunk() {
+    void *chunk = std::aligned_alloc(HUGE_PAGE_SIZE, CHUNK_SIZE);
+    if (chunk == nullptr) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    // 只是一个建议，内核没有开启透明大页时会被忽略
+    madvise(chunk, CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+    return static_cast<char *>(chunk);
+  }
+
+  static_assert(CHUNK_SIZE % HUGE_PAGE_SIZE == 0);
+  static_assert(SizeClasses::SlotSizeOf(NUM_SIZE_CLASS - 1) == SizeClasses::MAX_SLOT_SIZE &&
+                SizeClasses::MAX_SLOT_SIZE <= CHUNK_SIZE);
+
+  std::mutex latch_;
+  SizeClassState states_[NUM_SIZE_CLASS];  // 被latch_保护
+};
+
+}  // namespace pidan
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "common/macros.h"
+
+namespace pidan {
+
+// 前N个元素保存在对象内部的vector，元素数量不超过N时不需要动态分配内存。只支持在尾部追加元素，
+// 元素必须是可以直接按字节复制的类型。
+template <typename T, uint32_t N>
+class SmallVector {
+  static_assert(std::is_trivially_copyable_v<T> && N > 0);
+
+ public:
+  DISALLOW_COPY_AND_MOVE(SmallVector);
+
+  SmallVector() = default;
+
+  ~SmallVector() {
+    if (data_ != inline_data_) {
+      delete[] data_;
+    }
+  }
+
+  void push_back(const T &value) {
+    if (size_ == capacity_) {
+      Grow();
+    }
+    data_[size_++] = value;
+  }
+
+  T &operator[](uint32_t i) {
+    assert(i < size_);
+    return data_[i];
+  }
+
+  const T &operator[](uint32_t i) const {
+    assert(i < size_);
+    return data_[i];
+  }
+
+  uint32_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  T *begin() { return data_; }
+  T *end() { return data_ + size_; }
+  const T *begin() const { return data_; }
+  const T *end() const { return data_ + size_; }
+
+ private:
+  void Grow() {
+    T *data = new T[capacity_ * 2];
+    std::memcpy(data, data_, sizeof(T) * size_);
+    if (data_ != inline_data_) {
+      delete[] data_;
+    }
+    data_ = data;
+    capacity_ *= 2;
+  }
+
+  T *data_{inline_data_};
+  uint32_t size_{0};
+  uint32_t capacity_{N};
+  T inline_data_[N];
+};
+
+}  // namespace pidan
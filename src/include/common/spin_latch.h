@@ -1,6 +1,8 @@
 #pragma once
 #include <tbb/spin_mutex.h>
 
+#include "common/macros.h"
+
 namespace pidan {
     
 class SpinLatch {
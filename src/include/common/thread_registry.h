@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common/config.h"
+#include "common/macros.h"
+
+namespace pidan {
+
+// 为每个访问数据库的线程分配一个[0, MAX_ACCESS_THREAD)范围内的id，线程退出后id会回收给之后创建的线程。
+// 需要按线程保存状态的模块可以用这个id去索引大小为MAX_ACCESS_THREAD的数组，每个线程只访问属于自己的元素。
+class ThreadRegistry {
+ public:
+  ThreadRegistry() = delete;
+
+  // 返回当前线程的id，线程第一次调用时才分配。同时存在的线程超过MAX_ACCESS_THREAD个时抛出std::runtime_error。
+  static int ThreadID() {
+    thread_local LocalID local_id;
+    return local_id.id;
+  }
+
+  // 线程退出时的回调，参数是退出线程的id
+  using ExitHook = void (*)(int id);
+
+  // 注册一个线程退出时的回调，在id回收之前调用，模块可以在其中重置这个id对应的状态。
+  // 通常在静态初始化时调用，返回值只是为了方便用来初始化静态变量。
+  static bool AddExitHook(ExitHook hook);
+
+ private:
+  // 线程本地的id，构造时分配，线程退出时析构并回收
+  struct LocalID {
+    DISALLOW_COPY_AND_MOVE(LocalID);
+    LocalID();
+    ~LocalID();
+    int id;
+  };
+};
+
+}  // namespace pidan
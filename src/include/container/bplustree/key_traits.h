@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace pidan {
+
+// B+树通过KeyTraits来操作key，不同的key类型会选择不同的KeyMap实现。
+// 默认的key是变长的字节串，支持size()、data()、compare()，并具有签名为KeyType(const char *data, size_t size)的构造函数。
+template <typename KeyType, typename Enable = void>
+struct KeyTraits {
+  static constexpr bool FIXED_SIZE = false;
+
+  // 持有内存的key，用于保存分裂key这类需要离开节点单独存在的key
+  using OwnedKey = std::string;
+
+  static KeyType View(const OwnedKey &key) { return KeyType(key.data(), key.size()); }
+
+  static size_t Size(const KeyType &key) { return key.size(); }
+
+  static int Compare(const KeyType &a, const KeyType &b) { return a.compare(b); }
+
+  // 将key追加到buf中，之后可以用Decode读出来
+  static void Append(const KeyType &key, std::string *buf) { buf->append(key.data(), key.size()); }
+
+  static KeyType Decode(const char *data, size_t size) { return KeyType(data, size); }
+};
+
+// 定长的整数key，按值比较，KeyMap中用一个有序的数组保存。
+template <typename KeyType>
+struct KeyTraits<KeyType, std::enable_if_t<std::is_integral_v<KeyType>>> {
+  static constexpr bool FIXED_SIZE = true;
+
+  using OwnedKey = KeyType;
+
+  static KeyType View(const OwnedKey &key) { return key; }
+
+  static size_t Size([[maybe_unused]] const KeyType &key) { return sizeof(KeyType); }
+
+  static int Compare(const KeyType &a, const KeyType &b) { return (a > b) - (a < b); }
+
+  static void Append(const KeyType &key, std::string *buf) {
+    buf->append(reinterpret_cast<const char *>(&key), sizeof(KeyType));
+  }
+
+  static KeyType Decode(const char *data, [[maybe_unused]] size_t size) {
+    KeyType key;
+    std::memcpy(&key, data, sizeof(KeyType));
+    return key;
+  }
+};
+
+}  // namespace pidan
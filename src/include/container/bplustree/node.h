@@ -1,17 +1,31 @@
 #pragma once
 
 #include <immintrin.h>
-
+#include <sched.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <climits>
 #include <cstddef>
 #include <cstring>
 #include <functional>
+#include <string>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "common/config.h"
 #include "common/macros.h"
 #include "common/type.h"
+#include "container/bplustree/key_traits.h"
+#include "container/bplustree/node_pool.h"
+#include "container/bplustree/olc_stats.h"
 
 namespace pidan {
 /**
@@ -25,27 +39,34 @@ namespace pidan {
  *    free space start      free space end
  *
  *
- * 其中，InnerNode的HEADER部分布局如下，其中最后存储每个key的offset和size的叫做index部分
+ * 其中，InnerNode的HEADER部分布局如下，其中最后存储每个key的offset、size和head的叫做index部分
  * --------------------------------------------------------------------------------------------------------------------
  * level(2) | size(2) | free space start(2) | free space end(2) | version(8) | first child(8) | key1_offset(2) |
- * key1_size(2)| ... |
+ * key1_size(2) | key1_head(4) | ... |
  * --------------------------------------------------------------------------------------------------------------------
  *
  * LeafNode的HEADER布局，和InnerNode一样，最后是index部分：
  * ----------------------------------------------------------------------------------------------------------------
  * level(2) | size(2) | free space start(2) | free space end(2) | version(8) | prev(8) | next(8) | key1_offset(2) |
- * key1_size(2)| ... |
+ * key1_size(2) | key1_head(4) | ... |
  * ----------------------------------------------------------------------------------------------------------------
  *
  * DATA部分的布局，虽然内部节点和叶子节点的value类型不同，但都是定长的，布局的方法相同，从后向前增长。
- * --------------------------------------------------
- * | ... FREE SPACE ... | key2 | val2 | key1 | val1 |
- * --------------------------------------------------
+ * DATA部分的最后保存节点的两个fence key，节点中所有的key k都满足lower fence < k <= upper fence。
+ * --------------------------------------------------------------------------------
+ * | ... FREE SPACE ... | suffix2 | val2 | suffix1 | val1 | lower fence | upper fence |
+ * --------------------------------------------------------------------------------
+ *
+ * 两个fence key的公共前缀同时也是节点中所有key的公共前缀，所以每个key只保存去掉公共前缀之后的后缀，
+ * index部分记录的是后缀的offset和size，查找时也只需要比较后缀。最左边和最右边的节点没有对应一侧的fence key，
+ * 也就没有公共前缀。
+ *
+ * index部分中的head是后缀开头4个字节按大端序组成的整数，二分查找时先比较head，大部分情况下不需要访问data部分。
  */
 
 // Node节点中实现了Optimistic Coupling Locking，具体参考论文：The art of practical synchronization
 // 模板类型KeyType是一个字节串，支持类似std::string的持size()和data()操作，
-// 并具有签名为KeyType(const char *data, size_t size)的构造函数。
+// 并具有签名为KeyType(const char *data, size_t size)的构造函数；也可以是定长的整数，具体参考KeyTraits。
 // Node是一个抽象类，只有protected的构造函数，不可以直接创建Node类型对象。
 // template <typename KeyType>
 class Node {
@@ -55,6 +76,12 @@ class Node {
 #endif  // NDEBUG
   bool IsLeaf() const { return level_ == 0; }
 
+  // 所有节点都从NodePool中分配，每个节点占用一个和节点大小对应的slot。
+  // 释放时需要知道节点的大小，所以只能通过具体的节点类型来delete。
+  static void *operator new(size_t size) { return NodePool::Instance()->Allocate(size); }
+
+  static void operator delete(void *ptr, size_t size) { NodePool::Instance()->Free(ptr, size); }
+
   // 为节点加读锁，加锁成功返回true,并且返回当前节点的版本号。
   // 如果加锁失败，返回false。
   bool ReadLockOrRestart(uint64_t *version) const {
@@ -90,13 +117,30 @@ class Node {
         return false;
       }
     } while (!UpgradeToWriteLockOrRestart(version));
+    return true;
+  }
+
+  // 不等待地加写锁：只读取一次版本号，节点已经加锁或者被删除时直接返回false，否则只尝试一次CAS。
+  // 用于已经持有其他节点的写锁、不能按从左向右的顺序加锁的情况，等待可能会死锁。
+  bool TryWriteLock() {
+    uint64_t version = version_.load();
+    if ((version & 2) == 2 || IsObsolete(version)) {
+      return false;
+    }
+    return version_.compare_exchange_strong(version, SetLockedBit(version));
   }
 
   // 释放写锁
-  void WriteUnlock() { version_.fetch_add(2); }
+  void WriteUnlock() {
+    version_.fetch_add(2);
+    WakeWaiters();
+  }
 
   // 释放写锁并将节点标记为删除
-  void WriteUnlockObsolete() { version_.fetch_add(3); }
+  void WriteUnlockObsolete() {
+    version_.fetch_add(3);
+    WakeWaiters();
+  }
 
   // 返回节点中保存key的数量
   // size_t size() const { return size_; }
@@ -104,16 +148,91 @@ class Node {
   uint16_t level() const { return level_; }
 
  private:
-  // spin lock，等待node节点解锁。
+  // contention_的上限，冲突最激烈时仍然至少自旋一轮
+  static constexpr uint8_t MAX_CONTENTION = __builtin_ctz(BPLUSTREE_SPIN_LIMIT / BPLUSTREE_SPIN_MAX_PAUSE);
+
+  // 等待node节点解锁。没有冲突时只有一次load，需要等待时才进入WaitForUnlock。
   uint64_t AwaitNodeUnlocked() const {
     uint64_t version = version_.load();
-    while ((version & 2) == 2) {
-      _mm_pause();
+    if ((version & 2) == 0) {
+      return version;
+    }
+    return WaitForUnlock(version);
+  }
+
+  // 带退避的等待，分为三个阶段：
+  // 1. 自旋，每一轮_mm_pause的次数从1开始指数增长，减少对节点所在cache line的争抢；
+  // 2. 自旋的总次数超过上限之后让出CPU，线程数多于CPU核数时持有写锁的线程很可能已经被换出；
+  // 3. 让出CPU的次数也超过上限之后在futex上睡眠，由释放写锁的线程唤醒。
+  // contention_记录节点上最近的冲突程度，每次等待超出自旋阶段时加一，在自旋阶段等到锁时减一。
+  // 冲突越激烈的节点自旋的上限越小，更早地让出CPU。
+  uint64_t WaitForUnlock(uint64_t version) const {
+    uint8_t contention = contention_.load(std::memory_order_relaxed);
+    uint32_t spin_limit = BPLUSTREE_SPIN_LIMIT >> contention;
+    uint32_t pause = 1, spins = 0;
+    while (spins < spin_limit) {
+      for (uint32_t i = 0; i < pause; i++) {
+        _mm_pause();
+      }
+      spins += pause;
       version = version_.load();
+      if ((version & 2) == 0) {
+        BPLUSTREE_STATS_ADD(SPIN, spins);
+        if (contention > 0) {
+          contention_.store(contention - 1, std::memory_order_relaxed);
+        }
+        return version;
+      }
+      pause = std::min(pause * 2, BPLUSTREE_SPIN_MAX_PAUSE);
+    }
+    BPLUSTREE_STATS_ADD(SPIN, spins);
+    if (contention < MAX_CONTENTION) {
+      contention_.store(contention + 1, std::memory_order_relaxed);
+    }
+
+    for (uint32_t yields = 0; (version & 2) == 2; version = version_.load()) {
+      if (yields < BPLUSTREE_YIELD_LIMIT) {
+        sched_yield();
+        yields++;
+        BPLUSTREE_STATS_ADD(YIELD, 1);
+      } else {
+        FutexWait(version);
+        BPLUSTREE_STATS_ADD(SLEEP, 1);
+      }
     }
     return version;
   }
 
+  // 在version_的低32位上睡眠，直到version_发生变化。
+  // 先增加waiters_再检查version_，释放写锁时先修改version_再检查waiters_，两边都是顺序一致的原子操作，
+  // 所以要么等待者看到锁已经释放，要么释放者看到有等待者，不会丢失唤醒。
+  void FutexWait(uint64_t version) const {
+#ifdef __linux__
+    waiters_.fetch_add(1);
+    if (version_.load() == version) {
+      syscall(SYS_futex, VersionWord(), FUTEX_WAIT_PRIVATE, static_cast<uint32_t>(version), nullptr, nullptr, 0);
+    }
+    waiters_.fetch_sub(1);
+#else
+    sched_yield();
+#endif
+  }
+
+  // 唤醒所有在futex上等待这个节点的线程，没有等待者时只多一次load。
+  void WakeWaiters() {
+#ifdef __linux__
+    if (waiters_.load() > 0) {
+      syscall(SYS_futex, VersionWord(), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+#endif
+  }
+
+  // version_的低32位，每次加锁和解锁都会改变这部分，用作futex的地址。
+  uint32_t *VersionWord() const {
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && sizeof(version_) == sizeof(uint64_t));
+    return reinterpret_cast<uint32_t *>(const_cast<std::atomic<uint64_t> *>(&version_));
+  }
+
   // 检查借点是否被标记为删除
   bool IsObsolete(uint64_t version) const { return (version & 1) == 1; }
 
@@ -123,25 +242,67 @@ class Node {
  protected:
   Node(uint16_t level) : level_(level), version_(0b100) {}
   uint16_t level_;  // 节点所在的level，叶子节点是0, 向上递增。
-  uint16_t padding_;
-  std::atomic<uint64_t> version_;  // 用来作为OLC锁的版本号，具体作用可以参阅论文。
+  mutable std::atomic<uint8_t> contention_{0};  // 节点最近的冲突程度，决定等待时自旋的上限
+  uint8_t padding_;
+  mutable std::atomic<uint32_t> waiters_{0};  // 在futex上等待这个节点解锁的线程数
+  std::atomic<uint64_t> version_;             // 用来作为OLC锁的版本号，具体作用可以参阅论文。
 };
 
-template <typename KeyType, typename ValueType, uint32_t SIZE>
+static_assert(sizeof(Node) == 16);
+
+// KeyMap中空间使用情况的统计，用于BPlusTree::Inspect
+struct KeyMapSpace {
+  uint32_t size;              // key的数量
+  uint32_t used;              // 已经使用的空间，和UsedSpace()相同
+  uint32_t live;              // 其中有效的key、value、index以及fence key实际占用的空间，其余的是空洞
+  uint32_t key_bytes;         // 所有key的完整长度之和
+  uint32_t stored_key_bytes;  // 去掉公共前缀之后实际保存的key的长度之和
+  uint32_t min_key_size;      // 没有key时为UINT32_MAX
+  uint32_t max_key_size;
+};
+
+// KeyMap中除了data部分以外的成员占用的空间上限，节点用它来计算data部分的大小，使整个节点正好放进一个slot。
+static constexpr uint32_t KEY_MAP_HEADER_SIZE = 16;
+
+// 变长key的KeyMap，定长key的实现见下面的特化版本。SIZE是data部分的大小。
+// data部分中的偏移量都用uint16_t保存，最大的64KB节点去掉header之后也放得下。
+template <typename KeyType, typename ValueType, uint32_t SIZE, bool FIXED_SIZE = KeyTraits<KeyType>::FIXED_SIZE>
 class KeyMap {
  public:
-  KeyMap() : free_space_start_(0), free_space_end_(SIZE), size_(0) {}
+  KeyMap()
+      : free_space_start_(0),
+        free_space_end_(SIZE),
+        size_(0),
+        prefix_size_(0),
+        lower_fence_size_(0),
+        upper_fence_size_(0),
+        fence_flags_(0) {}
 
   // 在keymap中找到第一个不小于key的下标。下标的最小值为0，最大值为Size()的返回值。
   uint16_t FindLower(const KeyType &key) const {
     if (size_ == 0) {
       return 0;
     }
-    uint16_t lo = 0, hi = size_;
+    // 先比较公共前缀，之后的二分查找只需要比较后缀。正常情况下key一定落在fence key的范围内，前缀一定相同，
+    // 但是乐观读的时候可能会读到正在修改的节点，这里依然要返回一个合法的下标。
+    if (prefix_size_ > 0) {
+      int result = ComparePrefix(key);
+      if (result < 0) {
+        return 0;
+      }
+      if (result > 0) {
+        return size_;
+      }
+    }
+    KeyType suffix(key.data() + prefix_size_, key.size() - prefix_size_);
+    // 先在index部分中用后缀的head做无分支的二分查找，head相同的范围内再比较完整的后缀。
+    uint32_t head = MakeHead(suffix.data(), suffix.size());
+    uint16_t lo = HeadBound<false>(head);
+    uint16_t hi = HeadBound<true>(head);
 
     while (lo < hi) {
       uint16_t mid = (lo + hi) >> 1;
-      int result = KeyAt(mid).compare(key);
+      int result = SuffixAt(mid).compare(suffix);
       if (result == 0) {
         return mid;
       }
@@ -154,64 +315,511 @@ class KeyMap {
     return lo;
   }
 
-  KeyType KeyAt(uint16_t index) const {
-    assert(index < size_);
+  // 返回下标为index的完整key。key由公共前缀和后缀拼接而成，所以返回的key持有自己的内存。
+  std::string KeyAt(uint16_t index) const {
+    KeyType suffix = SuffixAt(index);
+    std::string key;
+    key.reserve(prefix_size_ + suffix.size());
+    key.append(PrefixData(), prefix_size_);
+    key.append(suffix.data(), suffix.size());
+    return key;
+  }
+
+  // 所有key的公共前缀
+  KeyType Prefix() const { return KeyType(PrefixData(), prefix_size_); }
+
+  // 下标为index的key去掉公共前缀之后的部分，不持有内存。
+  KeyType SuffixAt(uint16_t index) const {
     uint16_t key_offset, key_size;
     ReadIndex(index, &key_offset, &key_size);
     return KeyType(reinterpret_cast<const char *>(&data_[key_offset]), key_size);
   }
 
+  // 下标为index的key是否和key相等，不需要拼接完整的key。
+  bool KeyEquals(uint16_t index, const KeyType &key) const {
+    KeyType suffix = SuffixAt(index);
+    return key.size() == prefix_size_ + suffix.size() && std::memcmp(key.data(), PrefixData(), prefix_size_) == 0 &&
+           std::memcmp(key.data() + prefix_size_, suffix.data(), suffix.size()) == 0;
+  }
+
   ValueType ValueAt(uint16_t index) const {
-    assert(index < size_);
     uint16_t key_offset, key_size;
     ReadIndex(index, &key_offset, &key_size);
     return *reinterpret_cast<const ValueType *>(&data_[key_offset + key_size]);
   }
 
-  std::pair<KeyType, ValueType> KeyValueAt(uint16_t index) const {
+  std::pair<std::string, ValueType> KeyValueAt(uint16_t index) const { return {KeyAt(index), ValueAt(index)}; }
+
+  // 将下标为index的完整key追加到buf中
+  void AppendKeyTo(uint16_t index, std::string *buf) const {
+    KeyType suffix = SuffixAt(index);
+    buf->append(PrefixData(), prefix_size_);
+    buf->append(suffix.data(), suffix.size());
+  }
+
+  bool HasLowerFence() const { return (fence_flags_ & LOWER_FENCE) != 0; }
+
+  bool HasUpperFence() const { return (fence_flags_ & UPPER_FENCE) != 0; }
+
+  // 节点中所有key都大于lower fence key，没有lower fence时表示负无穷。
+  KeyType LowerFence() const {
+    return KeyType(reinterpret_cast<const char *>(&data_[FenceStart()]), lower_fence_size_);
+  }
+
+  // 节点中所有key都不大于upper fence key，没有upper fence时表示正无穷。
+  KeyType UpperFence() const {
+    return KeyType(reinterpret_cast<const char *>(&data_[SIZE - upper_fence_size_]), upper_fence_size_);
+  }
+
+  // 清空keymap并设置新的fence key，nullptr表示这一侧没有边界。节点中的key k都满足lower < k <= upper，
+  // 所以两个fence key的公共前缀也就是所有key的公共前缀，只需要保存一次。lower和upper不能指向当前keymap内部。
+  void Reset(const KeyType *lower, const KeyType *upper) {
+    lower_fence_size_ = lower == nullptr ? 0 : lower->size();
+    upper_fence_size_ = upper == nullptr ? 0 : upper->size();
+    assert(lower_fence_size_ + upper_fence_size_ <= SIZE);
+    fence_flags_ = (lower == nullptr ? 0 : LOWER_FENCE) | (upper == nullptr ? 0 : UPPER_FENCE);
+    if (lower != nullptr) {
+      std::memcpy(&data_[FenceStart()], lower->data(), lower_fence_size_);
+    }
+    if (upper != nullptr) {
+      std::memcpy(&data_[SIZE - upper_fence_size_], upper->data(), upper_fence_size_);
+    }
+    prefix_size_ = lower != nullptr && upper != nullptr
+                       ? CommonPrefixSize(lower->data(), lower->size(), upper->data(), upper->size())
+                       : 0;
+    free_space_start_ = 0;
+    free_space_end_ = FenceStart();
+    size_ = 0;
+  }
+
+  // 在下标为index的位置插入key和value，key必须落在fence key的范围内。
+  void InsertKeyValue(uint16_t index, const KeyType &key, const ValueType &val) {
+    assert(key.size() >= prefix_size_ && std::memcmp(key.data(), PrefixData(), prefix_size_) == 0);
+    InsertEntry(index, key.data() + prefix_size_, key.size() - prefix_size_, nullptr, 0, val);
+  }
+
+  // 将src中下标为[begin, end)的数据追加到当前keymap的末尾，按当前keymap的公共前缀重新编码后缀，
+  // 不需要拼接出完整的key。
+  void AppendFrom(const KeyMap &src, uint16_t begin, uint16_t end) {
+    for (uint16_t i = begin; i < end; i++) {
+      KeyType suffix = src.SuffixAt(i);
+      if (prefix_size_ >= src.prefix_size_) {
+        // 前缀变长了，截掉后缀的开头部分即可
+        uint16_t skip = prefix_size_ - src.prefix_size_;
+        assert(suffix.size() >= skip);
+        InsertEntry(size_, suffix.data() + skip, suffix.size() - skip, nullptr, 0, src.ValueAt(i));
+      } else {
+        // 前缀变短了，src前缀多出来的部分要补到后缀前面
+        InsertEntry(size_, src.PrefixData() + prefix_size_, src.prefix_size_ - prefix_size_, suffix.data(),
+                    suffix.size(), src.ValueAt(i));
+      }
+    }
+  }
+
+  // 检查下标为index的key和value是否完整地落在data区域内。
+  // 乐观读的时候节点可能正在被其他线程修改，读到的offset和size可能是错误的，拷贝数据之前要先检查，以免越界访问。
+  bool Readable(uint16_t index) const {
+    uint32_t index_offset = static_cast<uint32_t>(index) * SIZE_SLOT;
+    if (index_offset + SIZE_SLOT > SIZE || prefix_size_ > SIZE - FenceStart()) {
+      return false;
+    }
+    uint32_t key_offset = *reinterpret_cast<const uint16_t *>(&data_[index_offset]);
+    uint32_t key_size = *reinterpret_cast<const uint16_t *>(&data_[index_offset + SIZE_OFFSET]);
+    return key_offset + key_size + SIZE_VALUE <= SIZE;
+  }
+
+  // 删除下标为index的key和value，同时压缩data部分，不留下空洞。
+  void Erase(uint16_t index) {
     assert(index < size_);
     uint16_t key_offset, key_size;
     ReadIndex(index, &key_offset, &key_size);
+    uint16_t entry_size = key_size + SIZE_VALUE;
+
+    // data部分从后向前增长，被删除数据之前的数据整体向后移动entry_size
+    std::memmove(&data_[free_space_end_ + entry_size], &data_[free_space_end_], key_offset - free_space_end_);
+    free_space_end_ += entry_size;
+
+    // 删除index部分中的key offset和key size
+    uint16_t index_offset = index * SIZE_SLOT;
+    std::memmove(&data_[index_offset], &data_[index_offset + SIZE_SLOT],
+                 free_space_start_ - index_offset - SIZE_SLOT);
+    free_space_start_ -= SIZE_SLOT;
+    size_--;
 
-    ValueType val = *reinterpret_cast<const ValueType *>(&data_[key_offset + key_size]);
-    KeyType key(reinterpret_cast<const char *>(&data_[key_offset]), key_size);
-    return std::make_pair(key, val);
+    // 修正被移动过的数据的offset
+    for (uint16_t i = 0; i < size_; i++) {
+      auto *offset = reinterpret_cast<uint16_t *>(&data_[i * SIZE_SLOT]);
+      if (*offset < key_offset) {
+        *offset += entry_size;
+      }
+    }
   }
 
-  // 在下标为index的位置插入key和value
-  void InsertKeyValue(uint16_t index, const KeyType &key, const ValueType &val) {
-    assert(index <= size_);
+  // 已经使用的空间，包括index部分、data部分以及fence key
+  uint32_t UsedSpace() const { return free_space_start_ + (SIZE - free_space_end_); }
 
-    // 插入key和value
-    free_space_end_ -= key.size() + SIZE_VALUE;
-    std::memcpy(&data_[free_space_end_], key.data(), key.size());
+  // 统计空间的使用情况。乐观读时如果读到的index越界就返回false，调用者需要验证版本号之后重试。
+  bool CollectSpace(KeyMapSpace *space) const {
+    uint16_t size = size_;
+    *space = {size, UsedSpace(), 0, 0, 0, UINT32_MAX, 0};
+    for (uint16_t i = 0; i < size; i++) {
+      if (!Readable(i)) {
+        return false;
+      }
+      uint16_t key_offset, key_size;
+      ReadIndex(i, &key_offset, &key_size);
+      space->stored_key_bytes += key_size;
+      space->min_key_size = std::min<uint32_t>(space->min_key_size, prefix_size_ + key_size);
+      space->max_key_size = std::max<uint32_t>(space->max_key_size, prefix_size_ + key_size);
+    }
+    space->key_bytes = space->stored_key_bytes + size * prefix_size_;
+    space->live = space->stored_key_bytes + size * (SIZE_SLOT + SIZE_VALUE) + lower_fence_size_ + upper_fence_size_;
+    return true;
+  }
 
-    std::memcpy(&data_[free_space_end_ + key.size()], &val, SIZE_VALUE);
+  // 一对大小为key_size的key和定长的value所占用的空间
+  static constexpr uint32_t EntrySpace(size_t key_size) { return key_size + SIZE_VALUE + SIZE_SLOT; }
 
-    // 在index部分插入key offset和key size
-    uint16_t index_offset = index * (SIZE_OFFSET + SIZE_SIZE);
-    std::copy_backward(&data_[index_offset], &data_[free_space_start_],
-                       &data_[free_space_start_ + SIZE_OFFSET + SIZE_SIZE]);
-    *reinterpret_cast<uint16_t *>(&data_[index_offset]) = free_space_end_;
-    *reinterpret_cast<uint16_t *>(&data_[index_offset + SIZE_OFFSET]) = static_cast<uint16_t>(key.size());
+  static constexpr uint32_t Capacity() { return SIZE; }
 
-    free_space_start_ += SIZE_OFFSET + SIZE_SIZE;
-    assert(free_space_start_ <= free_space_end_);
-    size_++;
+  // 一个大小为key_size的fence key所占用的空间
+  static constexpr uint32_t FenceSpace(size_t key_size) { return key_size; }
+
+  // 可以保存的key的最大长度。分裂后的节点除了两个fence key以外还要能再放下几个最长的key，
+  // 所以较小的节点会进一步限制key的长度。
+  static constexpr size_t MaxKeySize() {
+    return std::min<size_t>(MAX_KEY_SIZE, (SIZE - 4 * (SIZE_SLOT + SIZE_VALUE)) / 6);
   }
 
   // 检查是否还有足够的空间可以插入大小为key_size的key以及一个定长的value
-  bool EnoughSpace(size_t key_size) { return FreeSpaceRemaining() >= key_size + SIZE_VALUE + SIZE_OFFSET + SIZE_SIZE; }
+  bool EnoughSpace(size_t key_size) { return FreeSpaceRemaining() >= key_size + SIZE_VALUE + SIZE_SLOT; }
 
   uint16_t size() const { return size_; }
 
-  void Split(KeyMap *new_key_map) {
+  // 将右半边数据分裂到new_key_map中，返回能够区分左右两边的最短分裂key。
+  // 分裂key同时作为左边的upper fence和右边的lower fence，两边的公共前缀只会变长。
+  std::string Split(KeyMap *new_key_map) {
+    assert(new_key_map->size_ == 0);
+    assert(new_key_map->free_space_start_ == 0);
+    uint16_t split_index = FindSplitIndex();
+    std::string split_key = ShortestSeparator(KeyAt(split_index), KeyAt(split_index + 1));
+    SplitAt(split_index + 1, split_index + 1, KeyType(split_key.data(), split_key.size()), new_key_map);
+    return split_key;
+  }
+
+  // 顺序插入时的分裂：所有数据都留在当前keymap中，new_key_map为空，调用者之后把key插入到new_key_map中，
+  // 这样左边的节点是满的，不会一直停留在一半的填充率。调用者要保证key大于当前所有的key。
+  // 分裂key会成为当前keymap新的upper fence，空间不够放下它时返回false，两个keymap都不变。
+  bool SplitForAppend(const KeyType &key, KeyMap *new_key_map, std::string *split_key) {
+    assert(new_key_map->size_ == 0);
+    assert(size_ >= 1);
+    std::string separator = ShortestSeparator(KeyAt(size_ - 1), std::string(key.data(), key.size()));
+    if (separator.size() > static_cast<size_t>(FreeSpaceRemaining() + upper_fence_size_)) {
+      return false;
+    }
+    SplitAt(size_, size_, KeyType(separator.data(), separator.size()), new_key_map);
+    *split_key = std::move(separator);
+    return true;
+  }
+
+  // 将一个keymap中右半边数据分裂到另一个keymap中，并产生分裂key。分裂key以及对应的value不保留在两边的keymap中。
+  // 内部节点的key是孩子节点之间的边界，分裂key必须原样上移，不能截断。
+  std::pair<std::string, ValueType> SplitWithKey(KeyMap *new_key_map) {
     assert(new_key_map->size_ == 0);
     assert(new_key_map->free_space_start_ == 0);
+    uint16_t split_index = FindSplitIndex();
+    auto result = KeyValueAt(split_index);
+    SplitAt(split_index, split_index + 1, KeyType(result.first.data(), result.first.size()), new_key_map);
+    return result;
+  }
+
+  // 将right中的数据合并到当前keymap的末尾，合并后的fence key是当前的lower fence和right的upper fence。
+  // middle_key不为nullptr时，先在两部分数据之间插入middle_key和middle_val。调用者要先用MergedSpace检查空间。
+  void Merge(const KeyMap &right, const KeyType *middle_key, const ValueType *middle_val) {
+    auto temp_key_map = *this;
+    KeyType lower = temp_key_map.LowerFence(), upper = right.UpperFence();
+    Reset(temp_key_map.HasLowerFence() ? &lower : nullptr, right.HasUpperFence() ? &upper : nullptr);
+    AppendFrom(temp_key_map, 0, temp_key_map.size_);
+    if (middle_key != nullptr) {
+      InsertKeyValue(size_, *middle_key, *middle_val);
+    }
+    AppendFrom(right, 0, right.size_);
+  }
+
+  // left和right合并之后占用的空间。合并后公共前缀可能变短，每个后缀都要变长。
+  static uint32_t MergedSpace(const KeyMap &left, const KeyMap &right, const KeyType *middle_key) {
+    size_t prefix_size = 0;
+    if (left.HasLowerFence() && right.HasUpperFence()) {
+      KeyType lower = left.LowerFence(), upper = right.UpperFence();
+      prefix_size = CommonPrefixSize(lower.data(), lower.size(), upper.data(), upper.size());
+    }
+    uint32_t space = left.lower_fence_size_ + right.upper_fence_size_ + left.EntriesSpace(prefix_size) +
+                     right.EntriesSpace(prefix_size);
+    if (middle_key != nullptr) {
+      space += EntrySpace(middle_key->size() - prefix_size);
+    }
+    return space;
+  }
+
+  // 在left和right之间重新分配数据，使两边占用的空间尽量接近，新的分隔key保存在split_key中。
+  // middle_key为nullptr时用于叶子节点，分隔key是能区分左右两边的最短key；否则用于内部节点，middle_key和*middle_val是
+  // 父节点中原来的分隔key以及右边节点的first child，它们一起参与轮转，新的分隔key会从两边移出，
+  // 对应的value通过middle_val返回。找不到两边都能放下的分配方式时返回false，两个keymap都不会改变。
+  static bool Redistribute(KeyMap *left, KeyMap *right, const KeyType *middle_key, ValueType *middle_val,
+                           std::string *split_key) {
+    std::vector<std::pair<std::string, ValueType>> entries;
+    entries.reserve(left->size_ + right->size_ + 1);
+    for (uint16_t i = 0; i < left->size_; i++) {
+      entries.push_back(left->KeyValueAt(i));
+    }
+    if (middle_key != nullptr) {
+      entries.emplace_back(std::string(middle_key->data(), middle_key->size()), *middle_val);
+    }
+    for (uint16_t i = 0; i < right->size_; i++) {
+      entries.push_back(right->KeyValueAt(i));
+    }
+    bool has_lower = left->HasLowerFence(), has_upper = right->HasUpperFence();
+    KeyType lower_fence = left->LowerFence(), upper_fence = right->UpperFence();
+    std::string lower(lower_fence.data(), lower_fence.size()), upper(upper_fence.data(), upper_fence.size());
+
+    size_t n = entries.size();
+    std::vector<uint32_t> key_bytes(n + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+      key_bytes[i + 1] = key_bytes[i] + entries[i].first.size();
+    }
+    // 分隔key的下标为m，叶子节点左边是[0, m]，内部节点左边是[0, m)，右边都是[m + 1, n)
+    size_t best = n;
+    uint32_t best_diff = UINT32_MAX;
+    std::vector<std::string> separators(n);
+    for (size_t m = middle_key == nullptr ? 0 : 1; m + 1 < n; m++) {
+      separators[m] =
+          middle_key == nullptr ? ShortestSeparator(entries[m].first, entries[m + 1].first) : entries[m].first;
+      const std::string &sep = separators[m];
+      size_t left_prefix = has_lower ? CommonPrefixSize(lower.data(), lower.size(), sep.data(), sep.size()) : 0;
+      size_t right_prefix = has_upper ? CommonPrefixSize(sep.data(), sep.size(), upper.data(), upper.size()) : 0;
+      size_t left_end = middle_key == nullptr ? m + 1 : m;
+      size_t right_num = n - m - 1;
+      uint32_t left_space = lower.size() + sep.size() + key_bytes[left_end] - left_end * left_prefix +
+                            left_end * EntrySpace(0);
+      uint32_t right_space = sep.size() + upper.size() + key_bytes[n] - key_bytes[m + 1] -
+                             right_num * right_prefix + right_num * EntrySpace(0);
+      if (left_space > SIZE || right_space > SIZE) {
+        continue;
+      }
+      uint32_t diff = left_space > right_space ? left_space - right_space : right_space - left_space;
+      if (diff < best_diff) {
+        best = m;
+        best_diff = diff;
+      }
+    }
+    if (best == n) {
+      return false;
+    }
+
+    KeyType lower_key(lower.data(), lower.size()), upper_key(upper.data(), upper.size());
+    KeyType sep(separators[best].data(), separators[best].size());
+    left->Reset(has_lower ? &lower_key : nullptr, &sep);
+    for (size_t i = 0; i < (middle_key == nullptr ? best + 1 : best); i++) {
+      left->InsertKeyValue(left->size_, KeyType(entries[i].first.data(), entries[i].first.size()), entries[i].second);
+    }
+    right->Reset(&sep, has_upper ? &upper_key : nullptr);
+    for (size_t i = best + 1; i < n; i++) {
+      right->InsertKeyValue(right->size_, KeyType(entries[i].first.data(), entries[i].first.size()),
+                            entries[i].second);
+    }
+    if (middle_key != nullptr) {
+      *middle_val = entries[best].second;
+    }
+    *split_key = std::move(separators[best]);
+    return true;
+  }
+
+  // 返回满足left <= sep < right的最短key sep，调用者要保证left < right。
+  // 叶子节点分裂时用它作为分隔key，父节点中的key更短，内部节点可以容纳更多的孩子。
+  static std::string ShortestSeparator(const std::string &left, const std::string &right) {
+    assert(left < right);
+    size_t prefix_size = CommonPrefixSize(left.data(), left.size(), right.data(), right.size());
+    // right的前prefix_size + 1个字节一定大于left，只要它比right短，就一定小于right
+    if (prefix_size + 1 < right.size()) {
+      return right.substr(0, prefix_size + 1);
+    }
+    return left;
+  }
+
+  // 两个字节串的公共前缀长度
+  static size_t CommonPrefixSize(const char *a, size_t a_size, const char *b, size_t b_size) {
+    size_t n = std::min(a_size, b_size), i = 0;
+    while (i < n && a[i] == b[i]) {
+      i++;
+    }
+    return i;
+  }
+
+ private:
+  static constexpr uint8_t LOWER_FENCE = 1;
+  static constexpr uint8_t UPPER_FENCE = 2;
+
+  // fence key保存在data部分的最后，lower fence在前，upper fence在后。
+  uint16_t FenceStart() const { return SIZE - lower_fence_size_ - upper_fence_size_; }
+
+  // 公共前缀就是lower fence的开头部分
+  const char *PrefixData() const { return reinterpret_cast<const char *>(&data_[FenceStart()]); }
+
+  // key和公共前缀比较，key以公共前缀开头时返回0
+  int ComparePrefix(const KeyType &key) const {
+    size_t n = std::min<size_t>(key.size(), prefix_size_);
+    int result = std::memcmp(key.data(), PrefixData(), n);
+    if (result != 0) {
+      return result;
+    }
+    return key.size() < prefix_size_ ? -1 : 0;
+  }
+
+  // 分裂的公共部分：[0, left_end)留在当前keymap中，[right_begin, size_)移动到空的new_key_map中，
+  // split作为左边的upper fence和右边的lower fence。split不能指向当前keymap内部。
+  // 右边的数据直接从当前keymap拷贝过去。左边的数据原地保留，fence key变化时整体移动；只有当被移走的数据在左边的
+  // 数据中间留下了空洞，或者公共前缀变长需要截断后缀时，才借助临时缓冲区重新紧凑地排列。
+  void SplitAt(uint16_t left_end, uint16_t right_begin, const KeyType &split, KeyMap *new_key_map) {
+    KeyType upper = UpperFence();
+    new_key_map->Reset(&split, HasUpperFence() ? &upper : nullptr);
+    uint16_t right_num = size_ - right_begin;
+    new_key_map->free_space_end_ = PackEntries(*this, right_begin, size_, new_key_map->prefix_size_ - prefix_size_,
+                                               new_key_map->data_, new_key_map->FenceStart());
+    new_key_map->free_space_start_ = right_num * SIZE_SLOT;
+    new_key_map->size_ = right_num;
+
+    uint16_t old_fence_start = FenceStart();
+    uint16_t new_fence_start = SIZE - lower_fence_size_ - split.size();
+    uint16_t new_prefix_size =
+        HasLowerFence() ? CommonPrefixSize(PrefixData(), lower_fence_size_, split.data(), split.size()) : 0;
+    uint16_t skip = new_prefix_size - prefix_size_;
+    uint32_t left_bytes = 0;
+    uint16_t min_offset = old_fence_start;
+    for (uint16_t i = 0; i < left_end; i++) {
+      uint16_t key_offset, key_size;
+      ReadIndex(i, &key_offset, &key_size);
+      left_bytes += key_size + SIZE_VALUE;
+      min_offset = std::min(min_offset, key_offset);
+    }
+
+    if (skip == 0 && left_bytes == static_cast<uint32_t>(old_fence_start - min_offset)) {
+      // 左边的数据是连续的，和lower fence一起移动到新的位置即可，移动的顺序要保证不会覆盖还没有移动的部分
+      int delta = static_cast<int>(new_fence_start) - old_fence_start;
+      if (delta > 0) {
+        std::memmove(&data_[new_fence_start], &data_[old_fence_start], lower_fence_size_);
+        std::memmove(&data_[min_offset + delta], &data_[min_offset], left_bytes);
+      } else {
+        std::memmove(&data_[min_offset + delta], &data_[min_offset], left_bytes);
+        std::memmove(&data_[new_fence_start], &data_[old_fence_start], lower_fence_size_);
+      }
+      for (uint16_t i = 0; i < left_end; i++) {
+        *reinterpret_cast<uint16_t *>(&data_[i * SIZE_SLOT]) += delta;
+      }
+      free_space_end_ = min_offset + delta;
+    } else {
+      std::byte buf[SIZE];
+      free_space_end_ = PackEntries(*this, 0, left_end, skip, buf, new_fence_start);
+      std::memmove(&data_[new_fence_start], &data_[old_fence_start], lower_fence_size_);
+      std::memcpy(&data_[free_space_end_], &buf[free_space_end_], new_fence_start - free_space_end_);
+      std::memcpy(&data_[0], &buf[0], left_end * SIZE_SLOT);
+    }
+    std::memcpy(&data_[SIZE - split.size()], split.data(), split.size());
+    upper_fence_size_ = split.size();
+    fence_flags_ |= UPPER_FENCE;
+    prefix_size_ = new_prefix_size;
+    free_space_start_ = left_end * SIZE_SLOT;
+    size_ = left_end;
+  }
+
+  // 将src中下标为[begin, end)的后缀去掉开头的skip个字节，连同value按下标顺序紧凑地写到dst中以data_end结尾的区域，
+  // index写到dst的开头，返回数据区域的起始位置。
+  // 这些数据在src中是连续的并且不需要截断时，整块数据和index各只需要一次memcpy，之后再统一修正offset。
+  static uint16_t PackEntries(const KeyMap &src, uint16_t begin, uint16_t end, uint16_t skip, std::byte *dst,
+                              uint16_t data_end) {
+    uint32_t bytes = 0;
+    uint16_t min_offset = SIZE, max_end = 0;
+    for (uint16_t i = begin; i < end; i++) {
+      uint16_t key_offset, key_size;
+      src.ReadIndex(i, &key_offset, &key_size);
+      bytes += key_size + SIZE_VALUE;
+      min_offset = std::min(min_offset, key_offset);
+      max_end = std::max<uint16_t>(max_end, key_offset + key_size + SIZE_VALUE);
+    }
+    if (begin == end) {
+      return data_end;
+    }
+
+    uint16_t start = data_end - (bytes - (end - begin) * skip);
+    if (skip == 0 && bytes == static_cast<uint32_t>(max_end - min_offset)) {
+      std::memcpy(&dst[start], &src.data_[min_offset], bytes);
+      std::memcpy(&dst[0], &src.data_[begin * SIZE_SLOT], (end - begin) * SIZE_SLOT);
+      int delta = static_cast<int>(start) - min_offset;
+      for (uint16_t i = 0; i < end - begin; i++) {
+        *reinterpret_cast<uint16_t *>(&dst[i * SIZE_SLOT]) += delta;
+      }
+      return start;
+    }
+
+    uint16_t pos = data_end;
+    for (uint16_t i = begin; i < end; i++) {
+      uint16_t key_offset, key_size;
+      src.ReadIndex(i, &key_offset, &key_size);
+      uint16_t suffix_size = key_size - skip;
+      // value紧跟在后缀之后，一起拷贝
+      pos -= suffix_size + SIZE_VALUE;
+      std::memcpy(&dst[pos], &src.data_[key_offset + skip], suffix_size + SIZE_VALUE);
+      uint16_t index_offset = (i - begin) * SIZE_SLOT;
+      *reinterpret_cast<uint16_t *>(&dst[index_offset]) = pos;
+      *reinterpret_cast<uint16_t *>(&dst[index_offset + SIZE_OFFSET]) = suffix_size;
+      *reinterpret_cast<uint32_t *>(&dst[index_offset + SIZE_OFFSET + SIZE_SIZE]) =
+          skip == 0 ? src.HeadAt(i) : MakeHead(reinterpret_cast<const char *>(&dst[pos]), suffix_size);
+    }
+    assert(pos == start);
+    return start;
+  }
+
+  // 后缀开头的SIZE_HEAD个字节按大端序组成的整数，不足的部分补0。两个后缀的head不相等时，head的大小关系
+  // 就是后缀的大小关系，只有head相等时才需要比较完整的后缀。
+  static uint32_t MakeHead(const char *data, size_t size) {
+    if (size >= SIZE_HEAD) {
+      uint32_t head;
+      std::memcpy(&head, data, SIZE_HEAD);
+      return __builtin_bswap32(head);
+    }
+    uint32_t head = 0;
+    for (size_t i = 0; i < SIZE_HEAD; i++) {
+      head = (head << 8) | (i < size ? static_cast<uint8_t>(data[i]) : 0);
+    }
+    return head;
+  }
+
+  uint32_t HeadAt(uint16_t index) const {
+    return *reinterpret_cast<const uint32_t *>(&data_[index * SIZE_SLOT + SIZE_OFFSET + SIZE_SIZE]);
+  }
+
+  // 无分支的二分查找，UPPER为false时返回第一个head不小于head的下标，否则返回第一个head大于head的下标。
+  // 循环中只有一个可以编译成cmov的条件赋值，不会因为分支预测失败而停顿。
+  template <bool UPPER>
+  uint16_t HeadBound(uint32_t head) const {
+    uint16_t n = size_, lo = 0;
+    if (n == 0) {
+      return 0;
+    }
+    while (n > 1) {
+      uint16_t half = n / 2;
+      uint32_t probe = HeadAt(lo + half - 1);
+      lo = (UPPER ? probe <= head : probe < head) ? lo + half : lo;
+      n -= half;
+    }
+    uint32_t probe = HeadAt(lo);
+    return (UPPER ? probe <= head : probe < head) ? lo + 1 : lo;
+  }
+
+  // 找到分裂点，使左边[0, split_index]的数据大约占一半的空间
+  uint16_t FindSplitIndex() const {
     assert(size_ >= 2);
-    uint16_t split_space_threshold = (SIZE - free_space_end_) / 2;
+    uint16_t split_space_threshold = (FenceStart() - free_space_end_) / 2;
     uint16_t split_key_offset, split_key_size, left_data_size = 0, split_index = 0;
-    // 分裂步骤1： 先从索引中定位到要分裂的点
     for (; split_index < size_; split_index++) {
       ReadIndex(split_index, &split_key_offset, &split_key_size);
       left_data_size += split_key_size + sizeof(ValueType);
@@ -219,108 +827,290 @@ class KeyMap {
         break;
       }
     }
-
     // 如果触发了断言就证明这里的分裂实在没什么意义。。。
     assert(split_index < size_ - 1);
-    // 分裂步骤2：将整个keymap拷贝到另一个新的keymap中。清空当前的keymap
-    auto temp_key_map = *this;
-    assert(temp_key_map.size_ == size_);
-    clear();
-    // 分裂步骤3：遍历新keymap，将key逐个插入到当前keymap和分裂keymap中
-    for (uint16_t i = 0; i <= split_index; i++) {
-      auto kv = temp_key_map.KeyValueAt(i);
-      InsertKeyValue(i, kv.first, kv.second);
-    }
-
-    for (uint16_t i = split_index + 1; i < temp_key_map.size_; i++) {
-      auto kv = temp_key_map.KeyValueAt(i);
-      new_key_map->InsertKeyValue(i - (split_index + 1), kv.first, kv.second);
-    }
+    return split_index;
   }
 
-  // 将一个keymap中右半边数据分裂到另一个keymap中，并产生分裂key
-  std::pair<KeyType, ValueType> SplitWithKey(KeyMap *new_key_map) {
-    Split(new_key_map);
-    auto result = KeyValueAt(size_ - 1);
-    free_space_start_ -= SIZE_OFFSET + SIZE_SIZE;
-    free_space_end_ += result.first.size() + SIZE_VALUE;
-    size_--;
-    return result;
-
-    //   for (uint16_t i = split_index + 1; split_index < size_; i++) {
-    //     uint16_t offset, key_size ReadIndex(&key_offset, &key_size);
-    //     new_key_map->InsertKeyValue()
-    //   }
-
-    // uint16_t left_index_size = (split_index + 1) * (SIZE_OFFSET + SIZE_SIZE);
-    // uint16_t new_index_size = free_space_start_ - left_index_size;
-    // uint16_t new_data_size = SIZE - free_space_end_ - left_data_size;
-    // std::memcpy(new_key_map->data_, &data_[left_index_size], new_index_size);
-
-    // // 拷贝key value data
-    // for (uint16_t i = split_index + 1; i < size_; i++) {
-    //   uint16_t ReadIndex(i, );
-    //   std::memcpy(&new_key_map->data_[new_key_map->free_space_end_], );
-    // }
+  // 用长度为prefix_size的公共前缀重新编码之后，index部分和data部分占用的空间。prefix_size不能超过当前的前缀长度。
+  uint32_t EntriesSpace(size_t prefix_size) const {
+    assert(prefix_size <= prefix_size_);
+    return free_space_start_ + (FenceStart() - free_space_end_) + size_ * (prefix_size_ - prefix_size);
+  }
 
-    // new_key_map->free_space_start_ = new_index_size;
+  // 在下标为index的位置插入一个由part1和part2拼接而成的后缀以及value
+  void InsertEntry(uint16_t index, const char *part1, size_t size1, const char *part2, size_t size2,
+                   const ValueType &val) {
+    assert(index <= size_);
+    size_t suffix_size = size1 + size2;
 
-    // new_key_map->free_space_end_ -= new_data_size;
-    // std::memcpy(&new_key_map->data_[new_key_map->free_space_end_], &data_[free_space_end_], new_data_size);
-    // new_key_map->size_ = size_ - split_index - 1;
-    // size_ = split_index + 1;
-    // free_space_start_ = left_index_size;
-    // free_space_end_ += new_data_size;
+    // 插入后缀和value
+    free_space_end_ -= suffix_size + SIZE_VALUE;
+    std::memcpy(&data_[free_space_end_], part1, size1);
+    if (size2 > 0) {
+      std::memcpy(&data_[free_space_end_ + size1], part2, size2);
+    }
+    std::memcpy(&data_[free_space_end_ + suffix_size], &val, SIZE_VALUE);
 
-    // // 内存copy完成之后要统一修改new_key_map中所有key的offset
-    // for (uint16_t new_index = 0; new_index < new_key_map->size_; new_index++) {
-    //   *reinterpret_cast<uint16_t *>(&new_key_map->data_[new_index * (SIZE_OFFSET + SIZE_SIZE)]) += left_data_size;
-    // }
-  }
+    // 在index部分插入key offset和key size
+    uint16_t index_offset = index * SIZE_SLOT;
+    std::copy_backward(&data_[index_offset], &data_[free_space_start_], &data_[free_space_start_ + SIZE_SLOT]);
+    *reinterpret_cast<uint16_t *>(&data_[index_offset]) = free_space_end_;
+    *reinterpret_cast<uint16_t *>(&data_[index_offset + SIZE_OFFSET]) = static_cast<uint16_t>(suffix_size);
+    *reinterpret_cast<uint32_t *>(&data_[index_offset + SIZE_OFFSET + SIZE_SIZE]) =
+        MakeHead(reinterpret_cast<const char *>(&data_[free_space_end_]), suffix_size);
 
- private:
-  void clear() {
-    free_space_start_ = 0;
-    free_space_end_ = SIZE;
-    size_ = 0;
+    free_space_start_ += SIZE_SLOT;
+    assert(free_space_start_ <= free_space_end_);
+    size_++;
   }
 
+  // 乐观读的时候size_可能正在被其他线程修改，读到的下标之后会通过版本号验证，所以这里只检查下标没有超出data区域。
   void ReadIndex(uint16_t index, uint16_t *key_offset, uint16_t *key_size) const {
-    assert(index < size_);
-    uint16_t index_offset = index * (SIZE_OFFSET + SIZE_SIZE);
+    assert(static_cast<uint32_t>(index) * SIZE_SLOT < SIZE);
+    uint16_t index_offset = index * SIZE_SLOT;
     *key_offset = *reinterpret_cast<const uint16_t *>(&data_[index_offset]);
     *key_size = *reinterpret_cast<const uint16_t *>(&data_[index_offset + SIZE_OFFSET]);
   }
 
-  uint16_t KeySizeAt(uint16_t index) const {
-    assert(index < size_);
-    uint16_t index_offset = index * (SIZE_OFFSET + SIZE_SIZE);
-    return *reinterpret_cast<const uint16_t *>(&data_[index_offset + SIZE_OFFSET]);
-  }
-
   uint16_t FreeSpaceRemaining() { return free_space_end_ - free_space_start_; }
 
   static constexpr uint16_t SIZE_OFFSET = 2;
   static constexpr uint16_t SIZE_SIZE = 2;
+  static constexpr uint16_t SIZE_HEAD = 4;
+  static constexpr uint16_t SIZE_SLOT = SIZE_OFFSET + SIZE_SIZE + SIZE_HEAD;
   static constexpr uint16_t SIZE_VALUE = sizeof(ValueType);
   uint16_t free_space_start_;  // header的结束位置，也是freespace的起始位置，这里只是为了方便计算free
                                // space大小，没有其他作用。
   uint16_t free_space_end_;  // free space的结束位置，从这里进行插入
   uint16_t size_;
+  uint16_t prefix_size_;       // 所有key的公共前缀长度，前缀本身不单独保存，就是lower fence的开头部分
+  uint16_t lower_fence_size_;
+  uint16_t upper_fence_size_;
+  uint8_t fence_flags_;  // 标记lower fence和upper fence是否存在
   std::byte data_[SIZE];
+
+  static_assert(SIZE < UINT16_MAX, "offsets in KeyMap are 16 bits");
 };
 
-template <typename KeyType>
+// 定长key的KeyMap。key和value分别保存在两个有序的数组中，没有index部分，也不需要前缀压缩，
+// 查找时只需要访问key数组，一个cache line可以放下8个uint64_t的key。
+template <typename KeyType, typename ValueType, uint32_t SIZE>
+class KeyMap<KeyType, ValueType, SIZE, true> {
+ public:
+  KeyMap() : size_(0) {}
+
+  // 在keymap中找到第一个不小于key的下标。下标的最小值为0，最大值为Size()的返回值。
+  uint16_t FindLower(const KeyType &key) const {
+    // 乐观读的时候size_可能是正在修改中的值，不能越过数组的边界
+    uint16_t lo = 0, n = std::min<uint16_t>(size_, CAPACITY);
+    // 先用无分支的二分查找把范围缩小到一个很小的窗口，再在窗口内统计小于key的个数
+    while (n > SEARCH_WINDOW) {
+      uint16_t half = n / 2;
+      lo = keys_[lo + half - 1] < key ? lo + half : lo;
+      n -= half;
+    }
+    return lo + CountLess(&keys_[lo], n, key);
+  }
+
+  KeyType KeyAt(uint16_t index) const { return keys_[index]; }
+
+  bool KeyEquals(uint16_t index, const KeyType &key) const { return keys_[index] == key; }
+
+  ValueType ValueAt(uint16_t index) const { return values_[index]; }
+
+  std::pair<KeyType, ValueType> KeyValueAt(uint16_t index) const { return {keys_[index], values_[index]}; }
+
+  void AppendKeyTo(uint16_t index, std::string *buf) const { KeyTraits<KeyType>::Append(keys_[index], buf); }
+
+  void InsertKeyValue(uint16_t index, const KeyType &key, const ValueType &val) {
+    assert(index <= size_ && size_ < CAPACITY);
+    std::copy_backward(&keys_[index], &keys_[size_], &keys_[size_ + 1]);
+    std::copy_backward(&values_[index], &values_[size_], &values_[size_ + 1]);
+    keys_[index] = key;
+    values_[index] = val;
+    size_++;
+  }
+
+  bool Readable(uint16_t index) const { return index < CAPACITY; }
+
+  void Erase(uint16_t index) {
+    assert(index < size_);
+    std::copy(&keys_[index + 1], &keys_[size_], &keys_[index]);
+    std::copy(&values_[index + 1], &values_[size_], &values_[index]);
+    size_--;
+  }
+
+  uint32_t UsedSpace() const { return size_ * EntrySpace(sizeof(KeyType)); }
+
+  // 统计空间的使用情况，定长key的数组中不会有空洞，也没有前缀压缩。
+  bool CollectSpace(KeyMapSpace *space) const {
+    uint32_t size = size_;
+    if (size > CAPACITY) {
+      return false;
+    }
+    uint32_t used = size * EntrySpace(sizeof(KeyType));
+    uint32_t key_bytes = size * sizeof(KeyType);
+    uint32_t key_size = sizeof(KeyType);
+    *space = {size, used, used, key_bytes, key_bytes, size == 0 ? UINT32_MAX : key_size, size == 0 ? 0 : key_size};
+    return true;
+  }
+
+  static constexpr uint32_t EntrySpace([[maybe_unused]] size_t key_size) { return sizeof(KeyType) + sizeof(ValueType); }
+
+  static constexpr uint32_t Capacity() { return CAPACITY * EntrySpace(sizeof(KeyType)); }
+
+  // 定长key不保存fence key
+  static constexpr uint32_t FenceSpace([[maybe_unused]] size_t key_size) { return 0; }
+
+  static constexpr size_t MaxKeySize() { return sizeof(KeyType); }
+
+  // 清空keymap，定长key不需要fence key，参数只是为了和变长key的版本保持一致。
+  void Reset([[maybe_unused]] const KeyType *lower, [[maybe_unused]] const KeyType *upper) { size_ = 0; }
+
+  bool EnoughSpace([[maybe_unused]] size_t key_size) { return size_ < CAPACITY; }
+
+  uint16_t size() const { return size_; }
+
+  // 将右半边数据分裂到new_key_map中，返回分裂key，也就是左半边最后一个key。
+  KeyType Split(KeyMap *new_key_map) {
+    assert(new_key_map->size_ == 0);
+    assert(size_ >= 2);
+    uint16_t split_index = (size_ - 1) / 2;
+    new_key_map->Assign(*this, split_index + 1, size_);
+    size_ = split_index + 1;
+    return keys_[split_index];
+  }
+
+  // 顺序插入时的分裂，参数的含义和变长key的版本相同。定长key没有fence key，总是可以这样分裂。
+  bool SplitForAppend([[maybe_unused]] const KeyType &key, [[maybe_unused]] KeyMap *new_key_map, KeyType *split_key) {
+    assert(new_key_map->size_ == 0);
+    assert(size_ >= 1 && keys_[size_ - 1] < key);
+    *split_key = keys_[size_ - 1];
+    return true;
+  }
+
+  // 将右半边数据分裂到new_key_map中，并产生分裂key。分裂key以及对应的value不保留在两边的keymap中。
+  std::pair<KeyType, ValueType> SplitWithKey(KeyMap *new_key_map) {
+    assert(new_key_map->size_ == 0);
+    assert(size_ >= 3);
+    uint16_t split_index = size_ / 2;
+    new_key_map->Assign(*this, split_index + 1, size_);
+    size_ = split_index;
+    return {keys_[split_index], values_[split_index]};
+  }
+
+  // 将right中的数据合并到当前keymap的末尾，middle_key不为nullptr时，先在两部分数据之间插入middle_key和middle_val。
+  void Merge(const KeyMap &right, const KeyType *middle_key, const ValueType *middle_val) {
+    if (middle_key != nullptr) {
+      InsertKeyValue(size_, *middle_key, *middle_val);
+    }
+    assert(size_ + right.size_ <= CAPACITY);
+    std::copy(&right.keys_[0], &right.keys_[right.size_], &keys_[size_]);
+    std::copy(&right.values_[0], &right.values_[right.size_], &values_[size_]);
+    size_ += right.size_;
+  }
+
+  static uint32_t MergedSpace(const KeyMap &left, const KeyMap &right, const KeyType *middle_key) {
+    return left.UsedSpace() + right.UsedSpace() + (middle_key == nullptr ? 0 : EntrySpace(sizeof(KeyType)));
+  }
+
+  // 在left和right之间平分数据，参数的含义和变长key的版本相同。定长key总是可以平分，数据太少时返回false。
+  static bool Redistribute(KeyMap *left, KeyMap *right, const KeyType *middle_key, ValueType *middle_val,
+                           KeyType *split_key) {
+    uint16_t n = left->size_ + right->size_ + (middle_key == nullptr ? 0 : 1);
+    if (n < 3) {
+      return false;
+    }
+    uint16_t middle_num = middle_key == nullptr ? 0 : 1;
+    KeyMap left_temp = *left, right_temp = *right;
+    // 把left、middle、right看成一个连续的序列
+    auto key_at = [&](uint16_t i) {
+      if (i < left_temp.size_) {
+        return left_temp.keys_[i];
+      }
+      return i - left_temp.size_ < middle_num ? *middle_key : right_temp.keys_[i - left_temp.size_ - middle_num];
+    };
+    auto value_at = [&](uint16_t i) {
+      if (i < left_temp.size_) {
+        return left_temp.values_[i];
+      }
+      return i - left_temp.size_ < middle_num ? *middle_val : right_temp.values_[i - left_temp.size_ - middle_num];
+    };
+    uint16_t m = middle_key == nullptr ? (n - 1) / 2 : n / 2;
+    uint16_t left_end = middle_key == nullptr ? m + 1 : m;
+
+    left->size_ = 0;
+    for (uint16_t i = 0; i < left_end; i++) {
+      left->InsertKeyValue(left->size_, key_at(i), value_at(i));
+    }
+    right->size_ = 0;
+    for (uint16_t i = m + 1; i < n; i++) {
+      right->InsertKeyValue(right->size_, key_at(i), value_at(i));
+    }
+    *split_key = key_at(m);
+    if (middle_key != nullptr) {
+      *middle_val = value_at(m);
+    }
+    return true;
+  }
+
+ private:
+  static constexpr uint16_t CAPACITY = SIZE / (sizeof(KeyType) + sizeof(ValueType));
+  static constexpr uint16_t SEARCH_WINDOW = 16;
+  static_assert(CAPACITY >= 4, "node is too small");
+
+  // 用src中下标为[begin, end)的数据替换当前keymap的内容
+  void Assign(const KeyMap &src, uint16_t begin, uint16_t end) {
+    std::copy(&src.keys_[begin], &src.keys_[end], &keys_[0]);
+    std::copy(&src.values_[begin], &src.values_[end], &values_[0]);
+    size_ = end - begin;
+  }
+
+  // 统计有序数组keys的前n个元素中小于key的个数。有AVX2时每次比较4个64位整数，否则用可以被自动向量化的循环。
+  static uint16_t CountLess(const KeyType *keys, uint16_t n, KeyType key) {
+    uint16_t count = 0, i = 0;
+#ifdef __AVX2__
+    if constexpr (sizeof(KeyType) == 8) {
+      // AVX2只有有符号64位整数的比较，无符号整数要先翻转最高位
+      const __m256i flip = _mm256_set1_epi64x(std::is_signed_v<KeyType> ? 0 : INT64_MIN);
+      const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(key)), flip);
+      for (; i + 4 <= n; i += 4) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&keys[i]));
+        __m256i less = _mm256_cmpgt_epi64(target, _mm256_xor_si256(block, flip));
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+      }
+    }
+#endif
+    for (; i < n; i++) {
+      count += keys[i] < key;
+    }
+    return count;
+  }
+
+  KeyType keys_[CAPACITY];
+  ValueType values_[CAPACITY];
+  uint16_t size_;
+};
+
+// SIZE是整个节点占用的空间，也就是节点在NodePool中的slot大小，必须是2的幂。
+template <typename KeyType, uint32_t SIZE = BPLUSTREE_INNERNODE_SIZE>
 class InnerNode : public Node {
  public:
+  using OwnedKey = typename KeyTraits<KeyType>::OwnedKey;
+
   InnerNode(uint16_t level, Node *left_child, Node *right_child, const KeyType &key)
       : Node(level), first_child_(left_child) {
     key_map_.InsertKeyValue(0, key, right_child);
   }
 
   // 根据key来找到对应的child node指针
-  Node *FindChild(const KeyType &key) const {
-    uint16_t index = key_map_.FindLower(key);
+  Node *FindChild(const KeyType &key) const { return ChildAt(FindChildIndex(key)); }
+
+  // 根据key来找到对应的child node在节点中的下标，下标的范围是[0, size()]
+  uint16_t FindChildIndex(const KeyType &key) const { return key_map_.FindLower(key); }
+
+  Node *ChildAt(uint16_t index) const {
     if (index == 0) {
       return first_child_;
     }
@@ -328,9 +1118,48 @@ class InnerNode : public Node {
     return key_map_.ValueAt(index - 1);
   }
 
+  OwnedKey KeyAt(uint16_t index) const { return key_map_.KeyAt(index); }
+
+  // 删除下标为index的key以及它右边的child指针
+  void RemoveKeyAt(uint16_t index) { key_map_.Erase(index); }
+
+  // 将下标为index的key替换为新的key，child指针不变。调用者要保证有足够的空间。
+  void ReplaceKeyAt(uint16_t index, const KeyType &key) {
+    Node *child = key_map_.ValueAt(index);
+    key_map_.Erase(index);
+    assert(key_map_.EnoughSpace(KeyTraits<KeyType>::Size(key)));
+    key_map_.InsertKeyValue(index, key, child);
+  }
+
+  // 节点的填充率是否已经低于合并的阈值
+  bool NeedMerge() const { return key_map_.UsedSpace() * 100 < KeyMapType::Capacity() * BPLUSTREE_MERGE_THRESHOLD; }
+
+  // 以split_key为分隔，是否可以将右边的兄弟节点合并进来。合并后的填充率不能超过分裂的阈值。
+  bool CanMerge(const KeyType &split_key, const InnerNode *right) const {
+    uint32_t merged_space = KeyMapType::MergedSpace(key_map_, right->key_map_, &split_key);
+    return merged_space * 100 <= KeyMapType::Capacity() * BPLUSTREE_SPLIT_THREASHOLD;
+  }
+
+  // 将右边的兄弟节点合并到当前节点，split_key是父节点中两个节点之间的分隔key。
+  void Merge(const KeyType &split_key, const InnerNode *right) {
+    key_map_.Merge(right->key_map_, &split_key, &right->first_child_);
+  }
+
+  // 通过父节点中的分隔key在当前节点和右边兄弟节点之间轮转数据，使两个节点的填充率尽量接近。
+  // split_key传入父节点中原来的分隔key，返回新的分隔key。空间不足以完成轮转时返回false，两个节点都不变。
+  bool Balance(OwnedKey *split_key, InnerNode *right) {
+    KeyType middle = KeyTraits<KeyType>::View(*split_key);
+    Node *child = right->first_child_;
+    if (!KeyMapType::Redistribute(&key_map_, &right->key_map_, &middle, &child, split_key)) {
+      return false;
+    }
+    right->first_child_ = child;
+    return true;
+  }
+
   // 向节点中插入一个key,成功返回true,没有足够空间则返回false。
   bool Insert(const KeyType &key, Node *child) {
-    if (!key_map_.EnoughSpace(key.size())) {
+    if (!key_map_.EnoughSpace(KeyTraits<KeyType>::Size(key))) {
       return false;
     }
     uint16_t index = key_map_.FindLower(key);
@@ -341,12 +1170,11 @@ class InnerNode : public Node {
   size_t size() const { return key_map_.size(); }
 
   // 将当前节点直接向右分裂，不插入新的key。用于插入时提前分裂。
-  // 需要注意split_key并不持有内存，需要注意它的生命周期，调用者必须加合适的锁。
-  InnerNode *Split(KeyType *split_key) {
-    auto sibling = new InnerNode<KeyType>(level_);
+  InnerNode *Split(OwnedKey *split_key) {
+    auto sibling = new InnerNode(level_);
     auto kv = key_map_.SplitWithKey(&sibling->key_map_);
     assert(sibling->key_map_.size() > 0);
-    *split_key = kv.first;
+    *split_key = std::move(kv.first);
     sibling->first_child_ = kv.second;
 
     return sibling;
@@ -356,17 +1184,22 @@ class InnerNode : public Node {
   bool EnoughSpaceFor(size_t key_size) { return key_map_.EnoughSpace(key_size); }
 
  private:
-  template <typename T1, typename T2>
+  template <typename T1, typename T2, uint32_t S1, uint32_t S2>
   friend class BPlusTree;
+  using KeyMapType = KeyMap<KeyType, Node *, SIZE - sizeof(Node) - POINTER_SIZE - KEY_MAP_HEADER_SIZE>;
+  static_assert(sizeof(KeyMapType) <= SIZE - sizeof(Node) - POINTER_SIZE);
   InnerNode(uint16_t level) : Node(level), first_child_(nullptr) {}
   // InnerNode中，child指针数目比key多一个，所以用一个额外的指针保存指向最左边孩子节点的指针。
   Node *first_child_;
-  KeyMap<KeyType, Node *, BPLUSTREE_INNERNODE_SIZE - sizeof(Node) - POINTER_SIZE> key_map_;
+  KeyMapType key_map_;
 };
 
-template <typename KeyType, typename ValueType>
+// SIZE的含义和InnerNode相同
+template <typename KeyType, typename ValueType, uint32_t SIZE = BPLUSTREE_LEAFNODE_SIZE>
 class LeafNode : public Node {
  public:
+  using OwnedKey = typename KeyTraits<KeyType>::OwnedKey;
+
   LeafNode() : Node(0), prev_(nullptr), next_(nullptr) {}
 
   // 查找key所对应的val，如果不存在就返回false
@@ -375,9 +1208,8 @@ class LeafNode : public Node {
     if (index >= key_map_.size()) {
       return false;
     }
-    auto kv = key_map_.KeyValueAt(index);
-    if (kv.first == key) {
-      *val = kv.second;
+    if (key_map_.KeyEquals(index, key)) {
+      *val = key_map_.ValueAt(index);
       return true;
     }
     return false;
@@ -385,13 +1217,13 @@ class LeafNode : public Node {
 
   // 插入key value，如果key已经存在，则插入失败。
   bool InsertUnique(const KeyType &key, const ValueType &val, bool *not_enough_space) {
-    if (!key_map_.EnoughSpace(key.size())) {
+    if (!key_map_.EnoughSpace(KeyTraits<KeyType>::Size(key))) {
       *not_enough_space = true;
       return false;
     }
 
     uint16_t index = key_map_.FindLower(key);
-    if (index < key_map_.size() && key_map_.KeyAt(index) == key) {
+    if (index < key_map_.size() && key_map_.KeyEquals(index, key)) {
       *not_enough_space = false;
       return false;
     }
@@ -400,16 +1232,32 @@ class LeafNode : public Node {
   }
 
   void Insert(const KeyType &key, const ValueType &val) {
-    assert(key_map_.EnoughSpace(key.size()));
+    assert(key_map_.EnoughSpace(KeyTraits<KeyType>::Size(key)));
     assert(!Exists(key));
     uint16_t index = key_map_.FindLower(key);
     key_map_.InsertKeyValue(index, key, val);
   }
 
+  // key是否大于节点中所有的key。节点为空时返回false。
+  bool IsAppend(const KeyType &key) const { return key_map_.size() > 0 && key_map_.FindLower(key) == key_map_.size(); }
+
+  // 把大于节点中所有key的key插入到节点的末尾，不需要再查找插入的位置
+  void Append(const KeyType &key, const ValueType &val) {
+    assert(key_map_.EnoughSpace(KeyTraits<KeyType>::Size(key)));
+    assert(IsAppend(key));
+    key_map_.InsertKeyValue(key_map_.size(), key, val);
+  }
+
   // 将当前节点向右分裂，返回分裂后的新节点
   LeafNode *Split() {
-    auto sibling = new LeafNode<KeyType, ValueType>();
-    key_map_.Split(&sibling->key_map_);
+    OwnedKey split_key;
+    return Split(&split_key);
+  }
+
+  // 将当前节点向右分裂，返回分裂后的新节点和分裂key
+  LeafNode *Split(OwnedKey *split_key) {
+    auto sibling = new LeafNode();
+    *split_key = key_map_.Split(&sibling->key_map_);
     sibling->prev_ = this;
     sibling->next_ = next_;
     if (next_ != nullptr) {
@@ -419,16 +1267,68 @@ class LeafNode : public Node {
     return sibling;
   }
 
-  // 将当前节点向右分裂，返回分裂后的新节点和分裂key
-  // 需要注意split_key并不持有内存，需要注意它的生命周期，调用者必须加合适的锁。
-  LeafNode *Split(KeyType *split_key) {
-    auto sibling = Split();
-    *split_key = key_map_.KeyAt(key_map_.size() - 1);
+  // 顺序插入时的分裂，key大于节点中所有的key。当前节点保留所有的数据，key应该插入到返回的新节点中。
+  // 当前节点没有足够的空间保存新的upper fence时返回nullptr，节点不变。
+  LeafNode *SplitForAppend(const KeyType &key, OwnedKey *split_key) {
+    auto sibling = new LeafNode();
+    if (!key_map_.SplitForAppend(key, &sibling->key_map_, split_key)) {
+      delete sibling;
+      return nullptr;
+    }
+    sibling->prev_ = this;
+    sibling->next_ = next_;
+    if (next_ != nullptr) {
+      next_->prev_ = sibling;
+    }
+    next_ = sibling;
     return sibling;
   }
 
   size_t size() const { return key_map_.size(); }
 
+  // 返回能够区分left和right的分隔key，和叶子节点分裂时产生的分隔key相同。调用者要保证left < right。
+  static OwnedKey Separator(const KeyType &left, const KeyType &right) {
+    if constexpr (KeyTraits<KeyType>::FIXED_SIZE) {
+      return left;
+    } else {
+      return KeyMapType::ShortestSeparator(OwnedKey(left.data(), left.size()), OwnedKey(right.data(), right.size()));
+    }
+  }
+
+  // 删除key，如果key不存在则返回false。
+  bool Remove(const KeyType &key) {
+    uint16_t index = key_map_.FindLower(key);
+    if (index >= key_map_.size() || !key_map_.KeyEquals(index, key)) {
+      return false;
+    }
+    key_map_.Erase(index);
+    return true;
+  }
+
+  // 节点的填充率是否已经低于合并的阈值
+  bool NeedMerge() const { return key_map_.UsedSpace() * 100 < KEY_MAP_SIZE * BPLUSTREE_MERGE_THRESHOLD; }
+
+  // 是否可以将右边的兄弟节点合并进来。合并后的填充率不能超过分裂的阈值。
+  bool CanMerge(const LeafNode *right) const {
+    return KeyMapType::MergedSpace(key_map_, right->key_map_, nullptr) * 100 <=
+           KEY_MAP_SIZE * BPLUSTREE_SPLIT_THREASHOLD;
+  }
+
+  // 将右边的兄弟节点合并到当前节点。调用者必须对right->next_加写锁，因为要修改它的prev_指针。
+  void Merge(LeafNode *right) {
+    key_map_.Merge(right->key_map_, nullptr, nullptr);
+    next_ = right->next_;
+    if (next_ != nullptr) {
+      next_->prev_ = this;
+    }
+  }
+
+  // 在当前节点和右边兄弟节点之间移动数据，使两个节点的填充率尽量接近，split_key返回新的分隔key。
+  // 空间不足以完成移动时返回false，两个节点都不变。
+  bool Balance(LeafNode *right, OwnedKey *split_key) {
+    return KeyMapType::Redistribute(&key_map_, &right->key_map_, nullptr, nullptr, split_key);
+  }
+
   // 检查key是否存在于节点当中
   // 如果存在，则将
   bool Exists(const KeyType &key, ValueType *val) {
@@ -436,11 +1336,10 @@ class LeafNode : public Node {
     if (index >= key_map_.size()) {
       return false;
     }
-    auto kv = key_map_.KeyValueAt(index);
-    if (kv.first != key) {
+    if (!key_map_.KeyEquals(index, key)) {
       return false;
     }
-    *val = kv.second;
+    *val = key_map_.ValueAt(index);
     return true;
   }
 
@@ -449,21 +1348,22 @@ class LeafNode : public Node {
     if (index >= key_map_.size()) {
       return false;
     }
-    auto k = key_map_.KeyAt(index);
-    return k == key;
+    return key_map_.KeyEquals(index, key);
   }
 
   // 是否有足够的空间来插入大小为key_size的key
   bool EnoughSpaceFor(size_t key_size) { return key_map_.EnoughSpace(key_size); }
 
  private:
-  template <typename T1, typename T2>
+  template <typename T1, typename T2, uint32_t S1, uint32_t S2>
   friend class BPlusTree;
 
-  static constexpr uint32_t KEY_MAP_SIZE = BPLUSTREE_LEAFNODE_SIZE - POINTER_SIZE * 2;
+  static constexpr uint32_t KEY_MAP_SIZE = SIZE - sizeof(Node) - POINTER_SIZE * 2 - KEY_MAP_HEADER_SIZE;
+  using KeyMapType = KeyMap<KeyType, ValueType, KEY_MAP_SIZE>;
+  static_assert(sizeof(KeyMapType) <= KEY_MAP_SIZE + KEY_MAP_HEADER_SIZE);
   LeafNode *prev_;
   LeafNode *next_;
-  KeyMap<KeyType, ValueType, KEY_MAP_SIZE> key_map_;
+  KeyMapType key_map_;
 };
 
 }  // namespace pidan
\ No newline at end of file
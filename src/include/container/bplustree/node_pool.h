@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+
+#include "common/config.h"
+#include "common/size_class_pool.h"
+
+namespace pidan {
+
+// B+树节点的size class。节点的大小是2的幂，从BPLUSTREE_MIN_NODE_SIZE到BPLUSTREE_MAX_NODE_SIZE，每一种大小对应
+// 一个size class。大块内存按huge page对齐，所以slot按自己的大小对齐。
+struct NodeSizeClasses {
+  static constexpr int NUM_SIZE_CLASS = __builtin_ctz(BPLUSTREE_MAX_NODE_SIZE / BPLUSTREE_MIN_NODE_SIZE) + 1;
+  static constexpr size_t MAX_SLOT_SIZE = BPLUSTREE_MAX_NODE_SIZE;
+  static constexpr size_t CHUNK_SIZE = BPLUSTREE_NODE_POOL_CHUNK_SIZE;
+  static constexpr size_t BATCH_BYTES = BPLUSTREE_NODE_POOL_BATCH_BYTES;
+
+  static constexpr int SizeClass(size_t size) {
+    int size_class = 0;
+    while (SlotSizeOf(size_class) < size) {
+      size_class++;
+    }
+    assert(size_class < NUM_SIZE_CLASS);
+    return size_class;
+  }
+
+  static constexpr size_t SlotSizeOf(int size_class) {
+    return static_cast<size_t>(BPLUSTREE_MIN_NODE_SIZE) << size_class;
+  }
+
+  static_assert(HUGE_PAGE_SIZE % BPLUSTREE_MAX_NODE_SIZE == 0);
+  static_assert((BPLUSTREE_MIN_NODE_SIZE & (BPLUSTREE_MIN_NODE_SIZE - 1)) == 0 &&
+                (BPLUSTREE_MAX_NODE_SIZE & (BPLUSTREE_MAX_NODE_SIZE - 1)) == 0);
+};
+
+// B+树节点的内存池，进程中所有的B+树共享同一个内存池。
+using NodePool = SizeClassPool<NodeSizeClasses>;
+
+}  // namespace pidan
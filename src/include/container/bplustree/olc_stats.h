@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "common/config.h"
+#include "common/thread_registry.h"
+
+namespace pidan {
+
+// B+树OLC的统计信息，用来分析多线程下的冲突。只有编译时定义了BPLUSTREE_STATS才会收集，否则计数的宏什么也不做。
+// 计数器按线程分开保存，每个线程只修改自己的slot，进程中所有的B+树共享同一组计数器。
+enum class OLCCounter : int {
+  READ_LOCK_RESTART = 0,  // 加读锁或者验证版本号失败导致的重启
+  UPGRADE_RESTART,        // 读锁升级为写锁失败导致的重启
+  ROOT_CHANGED_RESTART,   // 根节点已经被替换导致的重启
+  SPLIT_RESTART,          // 提前分裂或者调整内部节点之后的重启
+  SPIN,                   // 等待节点解锁时_mm_pause的次数
+  YIELD,                  // 等待节点解锁时让出CPU的次数
+  SLEEP,                  // 等待节点解锁时在futex上睡眠的次数
+  EPOCH_JOIN,             // 加入epoch的次数
+  EPOCH_LEAVE,            // 离开epoch的次数
+  SPLIT,                  // 节点分裂的次数，按被分裂节点的level分别计数，必须放在最后
+};
+
+// 所有线程计数器的总和
+struct OLCStats {
+  uint64_t read_lock_restarts{0};
+  uint64_t upgrade_restarts{0};
+  uint64_t root_changed_restarts{0};
+  uint64_t split_restarts{0};
+  uint64_t spins{0};
+  uint64_t yields{0};
+  uint64_t sleeps{0};
+  uint64_t epoch_joins{0};
+  uint64_t epoch_leaves{0};
+  uint64_t splits[BPLUSTREE_MAX_HEIGHT]{};  // 下标是被分裂节点的level
+
+  uint64_t Restarts() const { return read_lock_restarts + upgrade_restarts + root_changed_restarts + split_restarts; }
+
+  // 两次快照之间的差值
+  OLCStats operator-(const OLCStats &other) const {
+    OLCStats result;
+    result.read_lock_restarts = read_lock_restarts - other.read_lock_restarts;
+    result.upgrade_restarts = upgrade_restarts - other.upgrade_restarts;
+    result.root_changed_restarts = root_changed_restarts - other.root_changed_restarts;
+    result.split_restarts = split_restarts - other.split_restarts;
+    result.spins = spins - other.spins;
+    result.yields = yields - other.yields;
+    result.sleeps = sleeps - other.sleeps;
+    result.epoch_joins = epoch_joins - other.epoch_joins;
+    result.epoch_leaves = epoch_leaves - other.epoch_leaves;
+    for (int i = 0; i < BPLUSTREE_MAX_HEIGHT; i++) {
+      result.splits[i] = splits[i] - other.splits[i];
+    }
+    return result;
+  }
+};
+
+class OLCStatsCollector {
+ public:
+#ifdef BPLUSTREE_STATS
+  static constexpr bool ENABLED = true;
+#else
+  static constexpr bool ENABLED = false;
+#endif
+
+  OLCStatsCollector() = delete;
+
+  // 只会被当前线程修改，不需要原子的加法
+  static void Add(OLCCounter counter, uint64_t n, int level = 0) {
+    std::atomic<uint64_t> &slot = slots_[ThreadRegistry::ThreadID()].counters[static_cast<int>(counter) + level];
+    slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  // 汇总所有线程的计数器。其他线程可能正在修改计数器，所以结果只是一个近似的快照。
+  static OLCStats Collect() {
+    OLCStats stats;
+    for (const auto &local : slots_) {
+      auto get = [&local](OLCCounter counter, int level = 0) {
+        return local.counters[static_cast<int>(counter) + level].load(std::memory_order_relaxed);
+      };
+      stats.read_lock_restarts += get(OLCCounter::READ_LOCK_RESTART);
+      stats.upgrade_restarts += get(OLCCounter::UPGRADE_RESTART);
+      stats.root_changed_restarts += get(OLCCounter::ROOT_CHANGED_RESTART);
+      stats.split_restarts += get(OLCCounter::SPLIT_RESTART);
+      stats.spins += get(OLCCounter::SPIN);
+      stats.yields += get(OLCCounter::YIELD);
+      stats.sleeps += get(OLCCounter::SLEEP);
+      stats.epoch_joins += get(OLCCounter::EPOCH_JOIN);
+      stats.epoch_leaves += get(OLCCounter::EPOCH_LEAVE);
+      for (int i = 0; i < BPLUSTREE_MAX_HEIGHT; i++) {
+        stats.splits[i] += get(OLCCounter::SPLIT, i);
+      }
+    }
+    return stats;
+  }
+
+ private:
+  static constexpr int NUM_COUNTERS = static_cast<int>(OLCCounter::SPLIT) + BPLUSTREE_MAX_HEIGHT;
+
+  struct alignas(CACHE_LINE_SIZE) LocalCounters {
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+  };
+
+  // 静态存储的对象会被初始化为0
+  static inline LocalCounters slots_[MAX_ACCESS_THREAD];
+};
+
+#ifdef BPLUSTREE_STATS
+#define BPLUSTREE_STATS_ADD(counter, n) ::pidan::OLCStatsCollector::Add(::pidan::OLCCounter::counter, n)
+#define BPLUSTREE_STATS_SPLIT(level) ::pidan::OLCStatsCollector::Add(::pidan::OLCCounter::SPLIT, 1, level)
+#else
+#define BPLUSTREE_STATS_ADD(counter, n) ((void)(n))
+#define BPLUSTREE_STATS_SPLIT(level) ((void)(level))
+#endif
+
+}  // namespace pidan
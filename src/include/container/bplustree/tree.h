@@ -1,182 +1,467 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <fstream>
 #include <functional>
+#include <iterator>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
+#include "common/config.h"
 #include "common/macros.h"
+#include "common/thread_pool.h"
+#include "common/thread_registry.h"
 #include "common/type.h"
 #include "container/bplustree/node.h"
 
 namespace pidan {
 
-// 一个垃圾节点，等待被GC的回收
-struct GarbageNode {
-  Node *node{nullptr};
-  GarbageNode *next{nullptr};
-};
-
-// 一个EpochNode存储了一个Epoch周期中待回收的垃圾数据
-struct EpochNode {
-  // 当前Epoch中活跃的线程数
-  std::atomic<uint64_t> active_thread_count{0};
-  // 当前Epoch中待回收的垃圾节点链表
-  std::atomic<GarbageNode *> garbage_list{nullptr};
-  // 下一个EpochNode
-  EpochNode *next{nullptr};
+// 一批等待被GC回收的垃圾节点
+struct GarbageBatch {
+  // 最后一个节点加入时的全局epoch，不小于这一批中任何一个节点被删除时的epoch
+  uint64_t epoch{0};
+  uint32_t size{0};
+  Node *nodes[BPLUS_TREE_MAX_GARBAGENODE_NUM_PER_THREAD];
+  uint32_t node_sizes[BPLUS_TREE_MAX_GARBAGENODE_NUM_PER_THREAD];  // 节点的大小，释放时要还给对应大小的slot
+  GarbageBatch *next{nullptr};
 };
 
+// 基于epoch的内存回收。GC线程定期推进全局epoch，每个线程加入epoch时把当时的全局epoch记录在自己的slot中。
+// 每个slot独占一个cache line，加入和离开epoch只会修改当前线程自己的slot，多个线程之间不会争用同一个cache line。
+// 节点被删除时记录当时的全局epoch，之后加入的线程已经不可能访问到它，所以当所有活跃线程的epoch都大于这个值时，
+// 就可以安全地回收这个节点。
+// 被删除的节点先放进当前线程slot中的一批垃圾节点里，一批满了之后才交给GC线程，GC线程每一轮也会把各个slot中
+// 没有满的一批取走，所以被删除的节点最多在slot中停留一个epoch的时间。
 class EpochManager {
  public:
   DISALLOW_COPY_AND_MOVE(EpochManager);
 
-  EpochManager() : head_epoch_(new EpochNode()), current_epoch_(head_epoch_){};
+  EpochManager() = default;
 
-  ~EpochManager() { Stop(); }
+  // 析构时已经没有线程会访问被删除的节点，所有还没有回收的节点都直接释放
+  ~EpochManager() {
+    Stop();
+    for (auto &local : local_epochs_) {
+      FreeBatches(local.garbage.exchange(nullptr));
+    }
+    FreeBatches(garbage_list_.exchange(nullptr));
+    FreeBatches(pending_garbage_);
+    pending_garbage_ = nullptr;
+  }
 
   // 启动一个线程，不断地去更新epoch
   void Start() {
-    terminate_.store(false);
+    terminate_ = false;
     thread_ = new std::thread([this] {
+      std::unique_lock<std::mutex> lock(terminate_latch_);
       while (!terminate_) {
         this->PerformGC();
         this->CreateNewEpoch();
-        std::this_thread::sleep_for(std::chrono::milliseconds(BPLUSTREE_EPOCH_INTERVAL));
+        terminate_cv_.wait_for(lock, std::chrono::milliseconds(BPLUSTREE_EPOCH_INTERVAL), [this] { return terminate_; });
       }
     });
   }
 
+  // 停止GC线程，可以重复调用
   void Stop() {
-    terminate_.store(true);
+    {
+      std::lock_guard<std::mutex> guard(terminate_latch_);
+      terminate_ = true;
+    }
+    terminate_cv_.notify_all();
     if (thread_ != nullptr) {
       thread_->join();
       delete thread_;
+      thread_ = nullptr;
+    }
+  }
+
+  // 当前线程加入epoch。同一个线程可以嵌套加入，只有最外层的加入会记录epoch，LeaveEpoch必须在同一个线程中调用。
+  void JoinEpoch() {
+    BPLUSTREE_STATS_ADD(EPOCH_JOIN, 1);
+    LocalEpoch &local = local_epochs_[ThreadRegistry::ThreadID()];
+    if (local.depth++ == 0) {
+      local.epoch.store(global_epoch_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      // 之后对节点的读取不能被重排到slot的写入之前，否则GC线程扫描时可能看不到这个线程
+      std::atomic_thread_fence(std::memory_order_seq_cst);
     }
   }
 
-  EpochNode *JoinEpoch() {
-    // 我们必须保证join的Epoch和leave的Epoch是同一个
-    EpochNode *epoch = current_epoch_;
-    current_epoch_->active_thread_count.fetch_add(1);
-    return current_epoch_;
+  void LeaveEpoch() {
+    BPLUSTREE_STATS_ADD(EPOCH_LEAVE, 1);
+    LocalEpoch &local = local_epochs_[ThreadRegistry::ThreadID()];
+    if (--local.depth == 0) {
+      local.epoch.store(INACTIVE_EPOCH, std::memory_order_release);
+    }
   }
 
-  void LeaveEpoch(EpochNode *epoch) { epoch->active_thread_count.fetch_sub(1); }
+  // 增加一个大小为size的待回收的Node，放进当前线程的slot中，一批满了之后再交给GC线程
+  void AddGarbageNode(Node *node, uint32_t size) {
+    LocalEpoch &local = local_epochs_[ThreadRegistry::ThreadID()];
+    // 先从slot中取回这一批，GC线程可能已经把它取走了
+    GarbageBatch *batch = local.garbage.exchange(nullptr, std::memory_order_acquire);
+    if (batch == nullptr) {
+      batch = new GarbageBatch();
+    }
+    batch->nodes[batch->size] = node;
+    batch->node_sizes[batch->size++] = size;
+    batch->epoch = global_epoch_.load();
+    local.retired_bytes.store(local.retired_bytes.load(std::memory_order_relaxed) + NodePool::SlotSize(size),
+                              std::memory_order_relaxed);
 
-  // 增加一个待回收的Node,会在其他线程调用
-  void AddGarbageNode(Node *node) {
-    // 这里要copy一份current_epoch_的复制，因为GC线程可能会调用CreateNewEpoch
-    EpochNode *epoch = current_epoch_;
-    auto *garbage = new GarbageNode();
-    garbage->node = node;
-    garbage->next = epoch->garbage_list.load();
+    if (batch->size < BPLUS_TREE_MAX_GARBAGENODE_NUM_PER_THREAD) {
+      local.garbage.store(batch, std::memory_order_release);
+      return;
+    }
+    batch->next = garbage_list_.load();
     for (;;) {
-      auto result = epoch->garbage_list.compare_exchange_strong(garbage->next, garbage);
+      auto result = garbage_list_.compare_exchange_strong(batch->next, batch);
       if (result) {
         break;
       }
-      // 如果CAS失败，那么garbage->next会更新为epoch->garbage_list的新值，则继续重试就好了。
+      // 如果CAS失败，那么batch->next会更新为garbage_list_的新值，则继续重试就好了。
     }
   }
 
+  // 回收所有已经没有线程可以访问的垃圾节点，只会在GC线程中调用
   void PerformGC() {
-    for (;;) {
-      if (head_epoch_ == current_epoch_) {
-        // 我们至少要保留一个epoch
-        return;
-      }
-      // 从head开始遍历epoch node链表
-      if (head_epoch_->active_thread_count.load() > 0) {
-        return;
+    // 先收集已经满了的批次以及各个slot中没有满的批次，转移到GC线程私有的链表中
+    AppendToPending(garbage_list_.exchange(nullptr));
+    for (auto &local : local_epochs_) {
+      if (local.garbage.load(std::memory_order_relaxed) != nullptr) {
+        AppendToPending(local.garbage.exchange(nullptr, std::memory_order_acquire));
       }
+    }
 
-      // 已经没有线程在这个epoch上了，可以直接释放它所有的garbage节点。
-      while (head_epoch_->garbage_list != nullptr) {
-        GarbageNode *garbage_node = head_epoch_->garbage_list.load();
-        delete garbage_node->node;
-        head_epoch_->garbage_list = head_epoch_->garbage_list.load()->next;
-        delete garbage_node;
-#ifndef NDEBUG
-        garbage_node_del_num_.fetch_add(1);
-#endif
+    uint64_t min_epoch = MinActiveEpoch();
+    GarbageBatch **prev = &pending_garbage_;
+    while (*prev != nullptr) {
+      GarbageBatch *batch = *prev;
+      if (batch->epoch >= min_epoch) {
+        prev = &batch->next;
+        continue;
       }
-      EpochNode *epoch = head_epoch_;
-      head_epoch_ = head_epoch_->next;
-      delete epoch;
-#ifndef NDEBUG
-      epoch_del_num_.fetch_add(1);
-#endif
+      *prev = batch->next;
+      batch->next = nullptr;
+      FreeBatches(batch);
+    }
+  }
+
+  uint32_t GarbageNodeDelNum() const { return freed_num_.load(); }
+
+  // 被删除的节点在内存池中占用的总字节数
+  uint64_t RetiredBytes() const {
+    uint64_t retired_bytes = 0;
+    for (const auto &local : local_epochs_) {
+      retired_bytes += local.retired_bytes.load(std::memory_order_relaxed);
     }
+    return retired_bytes;
   }
 
-#ifndef NDEBUG
-  uint32_t GarbageNodeDelNum() {
-    return garbage_node_del_num_.load();
-  } 
-#endif
+  // 已经回收的节点在内存池中占用的总字节数
+  uint64_t FreedBytes() const { return freed_bytes_.load(); }
 
-  void CreateNewEpoch() {
-    auto *new_epoch = new EpochNode();
-    current_epoch_->next = new_epoch;
-    current_epoch_ = new_epoch;
+  // 已经被删除但还没有回收的节点占用的字节数
+  uint64_t PendingBytes() const {
+    uint64_t freed = FreedBytes();
+    uint64_t retired = RetiredBytes();
+    return retired > freed ? retired - freed : 0;
   }
 
+  void CreateNewEpoch() { global_epoch_.fetch_add(1); }
+
  private:
-  // Epoch链表的头结点，不需要atomic因为只有GC线程会修改和读取它
-  EpochNode *head_epoch_;
-  // 当前Epoch所在的节点，不需要atomic因为只有GC线程会修改，业务线程虽然会读取，但是读到旧数据也没关系
-  EpochNode *current_epoch_;
-  std::atomic<bool> terminate_{true};
+  static constexpr uint64_t INACTIVE_EPOCH = 0;
+
+  // 每个线程的epoch，独占一个cache line
+  struct alignas(CACHE_LINE_SIZE) LocalEpoch {
+    // 线程加入时的全局epoch，INACTIVE_EPOCH表示线程当前不在epoch中
+    std::atomic<uint64_t> epoch{INACTIVE_EPOCH};
+    // 嵌套加入的层数，只会被所属的线程访问
+    uint32_t depth{0};
+    // 还没有满的一批垃圾节点，所属的线程和GC线程都通过exchange取得它的所有权
+    std::atomic<GarbageBatch *> garbage{nullptr};
+    // 这个slot中删除过的节点占用的字节数，只会被所属的线程修改
+    std::atomic<uint64_t> retired_bytes{0};
+  };
+
+  // 所有活跃线程中最小的epoch，没有活跃线程时返回当前的全局epoch
+  uint64_t MinActiveEpoch() const {
+    uint64_t result = global_epoch_.load();
+    for (const auto &local : local_epochs_) {
+      uint64_t epoch = local.epoch.load();
+      if (epoch != INACTIVE_EPOCH && epoch < result) {
+        result = epoch;
+      }
+    }
+    return result;
+  }
+
+  void AppendToPending(GarbageBatch *list) {
+    while (list != nullptr) {
+      GarbageBatch *next = list->next;
+      list->next = pending_garbage_;
+      pending_garbage_ = list;
+      list = next;
+    }
+  }
+
+  // 释放链表中的所有批次以及其中的节点
+  void FreeBatches(GarbageBatch *list) {
+    while (list != nullptr) {
+      GarbageBatch *next = list->next;
+      uint64_t freed_bytes = 0;
+      for (uint32_t i = 0; i < list->size; i++) {
+        // Node没有虚析构函数，并且所有节点都是平凡析构的，所以这里直接把内存还给内存池，不能通过Node *调用delete
+        NodePool::Instance()->Free(list->nodes[i], list->node_sizes[i]);
+        freed_bytes += NodePool::SlotSize(list->node_sizes[i]);
+      }
+      freed_num_.store(freed_num_.load(std::memory_order_relaxed) + list->size);
+      freed_bytes_.store(freed_bytes_.load(std::memory_order_relaxed) + freed_bytes);
+      delete list;
+      list = next;
+    }
+  }
+
+  LocalEpoch local_epochs_[MAX_ACCESS_THREAD];
+  std::atomic<uint64_t> global_epoch_{INACTIVE_EPOCH + 1};
+  // 已经满了的批次，会被多个线程并发地插入
+  std::atomic<GarbageBatch *> garbage_list_{nullptr};
+  // 还不能回收的批次，只有GC线程会访问
+  GarbageBatch *pending_garbage_{nullptr};
+  // 已经回收的节点数量，只有GC线程会修改
+  std::atomic<uint64_t> freed_num_{0};
+  std::atomic<uint64_t> freed_bytes_{0};
+  std::mutex terminate_latch_;
+  std::condition_variable terminate_cv_;
+  bool terminate_{true};  // 被terminate_latch_保护
   std::thread *thread_{nullptr};
-#ifndef NDEBUG
-  std::atomic<uint32_t> garbage_node_del_num_{0};  // 删除的垃圾节点的数量
-  std::atomic<uint32_t> epoch_del_num_{0};         // 删除的epoch节点的数量
-#endif
+};
+
+// BPlusTree::Inspect中每一层节点的统计信息
+struct LevelStats {
+  uint64_t node_count{0};
+  uint64_t key_count{0};
+  uint64_t used_bytes{0};        // KeyMap中已经使用的空间，包括index、data以及fence key
+  uint64_t capacity_bytes{0};    // KeyMap的总容量
+  uint64_t fragmented_bytes{0};  // 已经使用的空间中不属于任何key的空洞
+  uint64_t memory_bytes{0};      // 节点实际占用的内存，也就是NodePool中slot的大小
+  double min_fill_factor{1.0};
+
+  double FillFactor() const { return capacity_bytes == 0 ? 0 : static_cast<double>(used_bytes) / capacity_bytes; }
+};
+
+// BPlusTree::Inspect的结果
+struct TreeStats {
+  uint16_t height{0};
+  LevelStats levels[BPLUSTREE_MAX_HEIGHT];  // 下标是节点的level，叶子节点是0
+  uint64_t key_bytes{0};                    // 叶子节点中所有key的完整长度之和
+  uint64_t stored_key_bytes{0};             // 叶子节点中去掉公共前缀之后实际保存的key的长度之和
+  uint32_t min_key_size{UINT32_MAX};  // 没有key时为UINT32_MAX
+  uint32_t max_key_size{0};
+
+  uint64_t KeyCount() const { return levels[0].key_count; }
+
+  double AvgKeySize() const { return KeyCount() == 0 ? 0 : static_cast<double>(key_bytes) / KeyCount(); }
+
+  uint64_t NodeCount() const { return Sum(&LevelStats::node_count); }
+
+  uint64_t FragmentedBytes() const { return Sum(&LevelStats::fragmented_bytes); }
+
+  uint64_t MemoryBytes() const { return Sum(&LevelStats::memory_bytes); }
+
+  // 所有节点总的填充率
+  double FillFactor() const {
+    uint64_t capacity = Sum(&LevelStats::capacity_bytes);
+    return capacity == 0 ? 0 : static_cast<double>(Sum(&LevelStats::used_bytes)) / capacity;
+  }
+
+ private:
+  uint64_t Sum(uint64_t LevelStats::*field) const {
+    uint64_t sum = 0;
+    for (int i = 0; i < height; i++) {
+      sum += levels[i].*field;
+    }
+    return sum;
+  }
 };
 
 // 支持变长key，定长value，非重复key的线程安全B+树。
-template <typename KeyType, typename ValueType>
+// LEAF_SIZE和INNER_SIZE分别是叶子节点和内部节点的大小，必须是2的幂，范围是[BPLUSTREE_MIN_NODE_SIZE,
+// BPLUSTREE_MAX_NODE_SIZE]。节点越小，能保存的key的最大长度也越小，见MaxKeySize()。
+template <typename KeyType, typename ValueType, uint32_t LEAF_SIZE = BPLUSTREE_LEAFNODE_SIZE,
+          uint32_t INNER_SIZE = BPLUSTREE_INNERNODE_SIZE>
 class BPlusTree {
  public:
-  BPlusTree() : root_(new LNode) { }
+  // 每棵树有自己的GC线程，随着树的创建启动，随着树的析构停止。
+  BPlusTree() : root_(new LNode) { epoch_manager_.Start(); }
+
+  // 析构时不能再有其他线程访问这棵树。树中所有的节点都会被释放，已经被删除的节点由epoch_manager_释放。
+  ~BPlusTree() {
+    epoch_manager_.Stop();
+    FreeSubtree(root_.load());
+  }
 
   // 查找key对应的value，找到返回true，否则返回false。
   bool Lookup(const KeyType &key, ValueType *value) const {
-    for (;;) {
-      Node *node = root_.load();
-      bool need_restart = false;
-      EpochNode *epoch = epoch_manager_.JoinEpoch();
-      bool result = StartLookup(node, nullptr, INVALID_OLC_LOCK_VERSION, key, value, &need_restart);
-      epoch_manager_.LeaveEpoch(epoch);
-      if (need_restart) {
-        // 查找失败，需要重启整个流程。
-        continue;
-      }
-      return result;
+    epoch_manager_.JoinEpoch();
+    bool result = StartLookup(key, value);
+    epoch_manager_.LeaveEpoch();
+    return result;
+  }
+
+  // 批量查找num个key，结果保存在values和found中。
+  // 一组key按层同步下降，每下降一层之前先预取所有key的下一层节点，让多个独立查找的cache miss互相重叠。
+  // key之间没有顺序要求，在某一层验证失败的key会单独重新查找。
+  void MultiLookup(const KeyType *keys, size_t num, ValueType *values, bool *found) const {
+    epoch_manager_.JoinEpoch();
+    for (size_t start = 0; start < num; start += BPLUSTREE_MULTI_LOOKUP_BATCH) {
+      size_t batch = std::min(num - start, static_cast<size_t>(BPLUSTREE_MULTI_LOOKUP_BATCH));
+      StartMultiLookup(keys + start, batch, values + start, found + start);
     }
+    epoch_manager_.LeaveEpoch();
   }
 
   // 插入一对key value，要求key是唯一的。如果key已经存在则返回false，并将value设置为已经存在的值。
   // 插入成功返回true，不对value做任何改动。
   bool InsertUnique(const KeyType &key, const ValueType &value, ValueType *old_val) {
-    for (;;) {
-      Node *node = root_.load();
-      bool need_restart = false;
-      EpochNode *epoch = epoch_manager_.JoinEpoch();
-      bool result = StartInsertUnique(node, nullptr, INVALID_OLC_LOCK_VERSION, key, value, old_val, &need_restart);
-      epoch_manager_.LeaveEpoch(epoch);
-      if (need_restart) {
-        continue;
-      }
-      return result;
-    }
+    epoch_manager_.JoinEpoch();
+    bool result = StartInsertUnique(key, [&value] { return value; }, old_val);
+    epoch_manager_.LeaveEpoch();
+    return result;
+  }
+
+  // 删除key，删除成功返回true，key不存在则返回false。
+  // 节点的填充率低于BPLUSTREE_MERGE_THRESHOLD时会和兄弟节点合并或者从兄弟节点借数据，被合并掉的节点交给epoch回收。
+  bool Remove(const KeyType &key) {
+    epoch_manager_.JoinEpoch();
+    bool result = StartRemove(key);
+    epoch_manager_.LeaveEpoch();
+    return result;
   }
 
   // 查找key，如果找到，返回true并返回对应的Value值。如果没找到则返回false并构造一个新的value。
+  // creater只会在真正插入的时候调用一次，调用时持有叶子节点的写锁，所以它应该尽快返回并且不能再访问这棵树。
   bool CreateIfNotExist(const KeyType &key, ValueType *new_val, const std::function<ValueType(void)> &creater) {
-    for (;;) {
+    epoch_manager_.JoinEpoch();
+    bool inserted = StartInsertUnique(
+        key,
+        [&creater, new_val] {
+          *new_val = creater();
+          return *new_val;
+        },
+        new_val);
+    epoch_manager_.LeaveEpoch();
+    return !inserted;
+  }
+
+  // 用[begin, end)中按key严格递增的key value对自底向上构建B+树，元素是可以分别转换为KeyType和ValueType的pair，
+  // 例如std::pair<std::string, ValueType>。叶子节点按顺序填满之后再逐层构建内部节点，每个节点按fill_factor填充，
+  // 给之后的插入预留空间。只能在空树上调用，并且调用期间不能有其他线程访问这棵树。
+  template <typename ForwardIterator>
+  void BulkLoad(ForwardIterator begin, ForwardIterator end, double fill_factor = BPLUSTREE_BULKLOAD_FILL_FACTOR) {
+    BulkLevel leaves;
+    BuildLeaves(begin, end, nullptr, nullptr, fill_factor, &leaves);
+    FinishBulkLoad(&leaves, fill_factor);
+  }
+
+  // BulkLoad的并行版本，把输入平均切分成thread_num段，在线程池中各自构建一段连续的叶子节点。
+  // 相邻两段之间的分隔key只取决于边界两侧的key，所以每段可以独立地确定自己的fence key。
+  template <typename RandomIterator>
+  void ParallelBulkLoad(RandomIterator begin, RandomIterator end, int thread_num,
+                        double fill_factor = BPLUSTREE_BULKLOAD_FILL_FACTOR) {
+    size_t num = end - begin;
+    size_t run_num = std::max<size_t>(1, std::min<size_t>(thread_num, num));
+    std::vector<size_t> starts(run_num + 1);
+    std::vector<OwnedKey> boundaries(run_num + 1);
+    for (size_t r = 0; r <= run_num; r++) {
+      starts[r] = num * r / run_num;
+      if (r > 0 && r < run_num) {
+        boundaries[r] = LNode::Separator(KeyType(begin[starts[r] - 1].first), KeyType(begin[starts[r]].first));
+      }
+    }
+
+    std::vector<BulkLevel> runs(run_num);
+    ThreadPool tp(run_num);
+    tp.Start();
+    for (size_t r = 0; r < run_num; r++) {
+      tp.AddTask([&, r] {
+        const OwnedKey *lower = r > 0 ? &boundaries[r] : nullptr;
+        const OwnedKey *upper = r + 1 < run_num ? &boundaries[r + 1] : nullptr;
+        BuildLeaves(begin + starts[r], begin + starts[r + 1], lower, upper, fill_factor, &runs[r]);
+      });
+    }
+    tp.WaitUntilAllTasksFinished();
+    tp.Shutdown();
+
+    // 把每一段的叶子节点首尾相连
+    BulkLevel leaves = std::move(runs[0]);
+    for (size_t r = 1; r < run_num; r++) {
+      auto *last = static_cast<LNode *>(leaves.nodes.back());
+      auto *first = static_cast<LNode *>(runs[r].nodes.front());
+      last->next_ = first;
+      first->prev_ = last;
+      leaves.separators.push_back(std::move(boundaries[r]));
+      leaves.nodes.insert(leaves.nodes.end(), runs[r].nodes.begin(), runs[r].nodes.end());
+      std::move(runs[r].separators.begin(), runs[r].separators.end(), std::back_inserter(leaves.separators));
+    }
+    FinishBulkLoad(&leaves, fill_factor);
+  }
+
+  class Iterator;
+
+  // 按顺序扫描[start, end)范围内的key，最多扫描limit个，对每一对key value调用consumer，返回扫描到的key的数量。
+  // consumer中拿到的key并不持有内存，只在本次调用中有效。
+  size_t Scan(const KeyType &start, const KeyType &end, size_t limit,
+              const std::function<void(const KeyType &, const ValueType &)> &consumer) const {
+    size_t count = 0;
+    Iterator iter(this);
+    for (iter.Seek(start); iter.Valid() && count < limit; iter.Next()) {
+      KeyType key = iter.Key();
+      if (Traits::Compare(key, end) >= 0) {
+        break;
+      }
+      consumer(key, iter.Value());
+      count++;
     }
+    return count;
+  }
+
+  // 合并时被删除的节点占用的总字节数
+  uint64_t RetiredBytes() const { return epoch_manager_.RetiredBytes(); }
+
+  // 被删除的节点中已经回收的字节数
+  uint64_t FreedBytes() const { return epoch_manager_.FreedBytes(); }
+
+  // 被删除的节点中还在等待回收的字节数
+  uint64_t PendingBytes() const { return epoch_manager_.PendingBytes(); }
+
+  // 能够插入的key的最大长度，由MAX_KEY_SIZE和节点大小共同决定
+  static constexpr size_t MaxKeySize() { return KEY_SIZE_LIMIT; }
+
+  // OLC统计信息的快照，只有编译时定义了BPLUSTREE_STATS才会收集，否则都是0。
+  // 计数器是进程中所有B+树共享的，分析某一段操作时可以对前后两次快照求差值。
+  static OLCStats Stats() { return OLCStatsCollector::Collect(); }
+
+  // 插入操作从根节点重新开始的次数
+  uint64_t InsertRestartNum() const { return insert_restart_num_.load(std::memory_order_relaxed); }
+
+  // 插入操作从中间某个祖先节点恢复，而不必从根节点重新开始的次数
+  uint64_t InsertResumeNum() const { return insert_resume_num_.load(std::memory_order_relaxed); }
+
+  // 遍历整棵树，统计高度、每一层的节点数量和填充率、key的长度分布以及占用的内存。
+  // 遍历时只加乐观读锁，不会阻塞其他线程。有其他线程同时修改时结果只是一个近似值，
+  // 遍历期间被分裂出来或者被合并掉的节点可能被漏掉。遍历期间一直处于同一个epoch中，会推迟被删除节点的回收。
+  TreeStats Inspect() const {
+    TreeStats stats;
+    epoch_manager_.JoinEpoch();
+    InspectNode(root_.load(), &stats);
+    epoch_manager_.LeaveEpoch();
+    return stats;
   }
 
   // 只是测试用
@@ -190,8 +475,18 @@ class BPlusTree {
   }
 
  private:
-  using LNode = LeafNode<KeyType, ValueType>;
-  using INode = InnerNode<KeyType>;
+  using LNode = LeafNode<KeyType, ValueType, LEAF_SIZE>;
+  using INode = InnerNode<KeyType, INNER_SIZE>;
+  static_assert((LEAF_SIZE & (LEAF_SIZE - 1)) == 0 && LEAF_SIZE >= BPLUSTREE_MIN_NODE_SIZE &&
+                LEAF_SIZE <= BPLUSTREE_MAX_NODE_SIZE);
+  static_assert((INNER_SIZE & (INNER_SIZE - 1)) == 0 && INNER_SIZE >= BPLUSTREE_MIN_NODE_SIZE &&
+                INNER_SIZE <= BPLUSTREE_MAX_NODE_SIZE);
+  static_assert(sizeof(LNode) <= LEAF_SIZE && sizeof(INode) <= INNER_SIZE);
+  // 插入前检查节点空间时按照最长的key来预留，保证分裂之后一定能放下新的key
+  static constexpr size_t KEY_SIZE_LIMIT =
+      std::min(LNode::KeyMapType::MaxKeySize(), INode::KeyMapType::MaxKeySize());
+  using Traits = KeyTraits<KeyType>;
+  using OwnedKey = typename Traits::OwnedKey;
 
   class IDGenerator {
    public:
@@ -210,7 +505,7 @@ class BPlusTree {
       ofs << "node" << my_id_s << "[label = \"";
       for (uint16_t i = 0; i < inner->key_map_.size(); i++) {
         ofs << "<f" << std::to_string(i) << ">";
-        ofs << "|" << inner->key_map_.KeyAt(i).ToString() << "|";
+        ofs << "|" << inner->key_map_.KeyAt(i) << "|";
       }
       ofs << "<f" << inner->key_map_.size() << ">\"];\n";
 
@@ -237,200 +532,1049 @@ class BPlusTree {
       if (i > 0) {
         ofs << "|";
       }
-      ofs << leaf->key_map_.KeyAt(i).ToString();
+      ofs << leaf->key_map_.KeyAt(i);
     }
     ofs << "\"];\n";
   }
 
-  // 从node节点开始，向树中插入key value，插入失败返回false，否则返回true。
-  bool StartInsertUnique(Node *node, INode *parent, uint64_t parent_version, const KeyType &key, const ValueType &val,
-                         ValueType *old_val, bool *need_restart) {
+  // 从根节点下降到叶子节点，select决定在内部节点中沿着哪一个孩子继续下降。
+  // 返回的叶子节点已经加了读锁，版本号保存在version中，调用者必须已经加入了epoch。
+  template <typename ChildSelector>
+  const LNode *FindLeaf(ChildSelector select, uint64_t *version) const {
+    for (;;) {
+      const Node *node = root_.load();
+      if (!node->ReadLockOrRestart(version)) {
+        continue;
+      }
+      if (node != root_.load()) {
+        // 加读锁之前根节点已经分裂了
+        continue;
+      }
+      bool need_restart = false;
+      while (!node->IsLeaf()) {
+        const INode *inner = static_cast<const INode *>(node);
+        const Node *child = select(inner);
+        uint64_t child_version;
+        if (!inner->CheckOrRestart(*version) || !child->ReadLockOrRestart(&child_version) ||
+            !inner->ReadUnlockOrRestart(*version)) {
+          need_restart = true;
+          break;
+        }
+        node = child;
+        *version = child_version;
+      }
+      if (!need_restart) {
+        return static_cast<const LNode *>(node);
+      }
+    }
+  }
+
+  // 从根节点到当前节点的路径，保存了路径上的每个节点以及读取它时的版本号。
+  // 操作需要重启时，沿着路径回退到最近的一个版本号仍然有效的祖先节点，从那里继续下降，而不必每次都回到根节点。
+  // 节点的版本号没有变化，说明节点的内容以及它所负责的key范围都没有变化，所以从这个节点继续是安全的。
+  class Path {
+   public:
+    void Push(Node *node, uint64_t version) {
+      assert(depth_ < BPLUSTREE_MAX_HEIGHT);
+      entries_[depth_++] = {node, version};
+    }
+
+    bool Empty() const { return depth_ == 0; }
+
+    Node *Top() const { return entries_[depth_ - 1].node; }
+
+    uint64_t TopVersion() const { return entries_[depth_ - 1].version; }
+
+    // 当前节点的父节点，当前节点是根节点时返回nullptr
+    INode *Parent() const { return depth_ >= 2 ? static_cast<INode *>(entries_[depth_ - 2].node) : nullptr; }
+
+    uint64_t ParentVersion() const { return depth_ >= 2 ? entries_[depth_ - 2].version : INVALID_OLC_LOCK_VERSION; }
+
+    // 回退到最近的一个版本号仍然有效的节点，返回false表示没有这样的节点，需要从根节点重新开始。
+    // 父节点的版本号也必须有效，因为分裂时要用它对父节点加写锁。否则父节点被修改之后，当前节点不变，
+    // 每次从当前节点继续都会因为父节点加锁失败而重启，永远无法完成分裂。
+    bool Backtrack() {
+      while (depth_ > 0 && (!Top()->CheckOrRestart(TopVersion()) ||
+                            (depth_ >= 2 && !Parent()->CheckOrRestart(ParentVersion())))) {
+        depth_--;
+      }
+      return depth_ > 0;
+    }
+
+   private:
+    struct Entry {
+      Node *node;
+      uint64_t version;
+    };
+    Entry entries_[BPLUSTREE_MAX_HEIGHT];
+    int depth_{0};
+  };
+
+  // 路径为空时，从根节点开始。加读锁失败或者根节点已经变化时返回false。
+  bool PushRoot(Path *path) const {
+    Node *root = root_.load();
     uint64_t version;
-    if (!node->ReadLockOrRestart(&version)) {
-      *need_restart = true;
+    if (!root->ReadLockOrRestart(&version)) {
+      BPLUSTREE_STATS_ADD(READ_LOCK_RESTART, 1);
       return false;
     }
+    if (root != root_.load()) {
+      // 加读锁之前根节点已经分裂了，此时root只负责原来一部分的key，必须从新的根节点开始。
+      BPLUSTREE_STATS_ADD(ROOT_CHANGED_RESTART, 1);
+      return false;
+    }
+    path->Push(root, version);
+    return true;
+  }
 
-    if (!node->IsLeaf()) {
-      INode *inner = static_cast<INode *>(node);
-      if (!inner->EnoughSpaceFor(MAX_KEY_SIZE)) {
-        // 节点空间不足，要分裂。
-        if (parent) {
-          if (!parent->UpgradeToWriteLockOrRestart(parent_version)) {
-            *need_restart = true;
-            return false;
-          }
-        }
+  // 读取inner中key所对应的孩子节点并加入路径，失败返回false。
+  bool PushChild(Path *path, const INode *inner, uint64_t version, const KeyType &key) const {
+    Node *child = inner->FindChild(key);
+    // 这里需要先检查一次，以保证child指针的有效性。
+    if (!inner->CheckOrRestart(version)) {
+      BPLUSTREE_STATS_ADD(READ_LOCK_RESTART, 1);
+      return false;
+    }
+    uint64_t child_version;
+    if (!child->ReadLockOrRestart(&child_version) || !inner->ReadUnlockOrRestart(version)) {
+      BPLUSTREE_STATS_ADD(READ_LOCK_RESTART, 1);
+      return false;
+    }
+    path->Push(child, child_version);
+    return true;
+  }
 
-        if (!inner->UpgradeToWriteLockOrRestart(version)) {
-          if (parent) {
-            parent->WriteUnlock();
+  // 插入操作需要重启，回退到仍然有效的祖先节点。
+  void RestartInsert(Path *path) {
+    if (path->Backtrack()) {
+      insert_resume_num_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      insert_restart_num_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // 向树中插入key value，key已经存在时返回false，否则返回true。调用者必须已经加入了epoch。
+  // value只有在确定要插入的时候才通过make_value构造，key已经存在或者需要重启时都不会调用。
+  template <typename ValueMaker>
+  bool StartInsertUnique(const KeyType &key, const ValueMaker &make_value, ValueType *old_val) {
+    assert(Traits::Size(key) <= KEY_SIZE_LIMIT);
+    if (TryAppend(key, make_value)) {
+      return true;
+    }
+    Path path;
+    for (;;) {
+      if (path.Empty() && !PushRoot(&path)) {
+        insert_restart_num_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      Node *node = path.Top();
+      uint64_t version = path.TopVersion();
+      INode *parent = path.Parent();
+      uint64_t parent_version = path.ParentVersion();
+
+      if (!node->IsLeaf()) {
+        INode *inner = static_cast<INode *>(node);
+        if (!inner->EnoughSpaceFor(KEY_SIZE_LIMIT)) {
+          // 节点空间不足，要提前分裂。不管分裂是否成功，当前节点和父节点的版本号都已经失效了，要回退。
+          if (SplitInner(parent, parent_version, inner, version)) {
+            BPLUSTREE_STATS_ADD(SPLIT_RESTART, 1);
           }
-          *need_restart = true;
-          return false;
+          RestartInsert(&path);
+          continue;
+        }
+        if (!PushChild(&path, inner, version, key)) {
+          RestartInsert(&path);
         }
+        continue;
+      }
 
-        // TODO: 这个地方有疑问，到底应不应该判断。
-        if (parent == nullptr && (inner != root_.load())) {
-          // node原本是根节点，但是同时有其他线程在此线程对根节点加写锁之前已经将根节点分裂或删除了
-          // 此时虽然加写锁可以成功，但根节点已经是新的节点了，因此要重启。
-          inner->WriteUnlock();
-          *need_restart = true;
+      LNode *leaf = static_cast<LNode *>(node);
+      if (leaf->Exists(key, old_val)) {
+        if (leaf->ReadUnlockOrRestart(version)) {
           return false;
         }
+        BPLUSTREE_STATS_ADD(READ_LOCK_RESTART, 1);
+        RestartInsert(&path);
+        continue;
+      }
 
-        KeyType split_key;
-        INode *sibling = inner->Split(&split_key);
-        if (parent) {
-          bool result = parent->Insert(split_key, sibling);
-          assert(result);
-        } else {
-          root_ = new INode(inner->level() + 1, inner, sibling, split_key);
-        }
-        inner->WriteUnlock();
-        if (parent) {
-          parent->WriteUnlock();
+      if (!leaf->EnoughSpaceFor(KEY_SIZE_LIMIT)) {
+        if (SplitLeafAndInsert(parent, parent_version, leaf, version, key, make_value)) {
+          return true;
         }
-        // 分裂完毕，重新开始插入流程。
-        *need_restart = true;
+        RestartInsert(&path);
+        continue;
+      }
+
+      // leaf 节点空间足够，直接插入不需要再对父节点加写锁了
+      if (!leaf->UpgradeToWriteLockOrRestart(version)) {
+        BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
+        RestartInsert(&path);
+        continue;
+      }
+      if (leaf->next_ == nullptr && leaf->IsAppend(key)) {
+        // 插入到了最右叶子节点的末尾，可能是顺序插入，之后的插入先尝试快速路径
+        SetAppendHint(leaf);
+      }
+      leaf->Insert(key, make_value());
+      leaf->WriteUnlock();
+      return true;
+    }
+  }
+
+  // 顺序插入的快速路径：key大于append_hint_中所有的key时直接插入到它的末尾，不需要从根节点下降。
+  // 返回false表示不能走快速路径，需要正常插入。调用者必须已经加入了epoch。
+  template <typename ValueMaker>
+  bool TryAppend(const KeyType &key, const ValueMaker &make_value) {
+    LNode *leaf = append_hint_.load(std::memory_order_acquire);
+    if (leaf == nullptr) {
+      return false;
+    }
+    uint64_t version;
+    if (!leaf->ReadLockOrRestart(&version)) {
+      return false;
+    }
+    // 最右的叶子节点负责大于它的lower fence的所有key，所以key大于其中所有的key时一定属于这个节点
+    if (leaf->next_ != nullptr || !leaf->IsAppend(key)) {
+      if (leaf->CheckOrRestart(version)) {
+        // 已经不是顺序插入了，清除提示，之后的插入不再尝试快速路径
+        append_hint_.compare_exchange_strong(leaf, nullptr);
+      }
+      return false;
+    }
+    // 空间不足时由正常的插入路径来分裂
+    if (!leaf->EnoughSpaceFor(KEY_SIZE_LIMIT) || !leaf->UpgradeToWriteLockOrRestart(version)) {
+      return false;
+    }
+    leaf->Append(key, make_value());
+    leaf->WriteUnlock();
+    return true;
+  }
+
+  // 调用者要保证leaf在此期间不会被合并掉，也就是持有leaf或者它左边兄弟节点的写锁
+  void SetAppendHint(LNode *leaf) {
+    if (append_hint_.load(std::memory_order_relaxed) != leaf) {
+      append_hint_.store(leaf, std::memory_order_release);
+    }
+  }
+
+  // 将空间不足的内部节点inner分裂，parent为nullptr时inner是根节点。加锁失败返回false。
+  bool SplitInner(INode *parent, uint64_t parent_version, INode *inner, uint64_t version) {
+    if (parent) {
+      if (!parent->UpgradeToWriteLockOrRestart(parent_version)) {
+        BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
         return false;
       }
+    }
 
+    if (!inner->UpgradeToWriteLockOrRestart(version)) {
       if (parent) {
-        if (!parent->ReadUnlockOrRestart(parent_version)) {
-          *need_restart = true;
-          return false;
-        }
+        parent->WriteUnlock();
       }
+      BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
+      return false;
+    }
+
+    if (parent == nullptr && (inner != root_.load())) {
+      // node原本是根节点，但是同时有其他线程在此线程对根节点加写锁之前已经将根节点分裂或删除了
+      // 此时虽然加写锁可以成功，但根节点已经是新的节点了，因此要重启。
+      inner->WriteUnlock();
+      BPLUSTREE_STATS_ADD(ROOT_CHANGED_RESTART, 1);
+      return false;
+    }
 
-      Node *child = inner->FindChild(key);
-      if (!inner->CheckOrRestart(version)) {
-        *need_restart = true;
+    BPLUSTREE_STATS_SPLIT(inner->level());
+    OwnedKey split_key;
+    INode *sibling = inner->Split(&split_key);
+    KeyType separator = Traits::View(split_key);
+    if (parent) {
+      bool result = parent->Insert(separator, sibling);
+      assert(result);
+      (void)result;
+    } else {
+      root_ = new INode(inner->level() + 1, inner, sibling, separator);
+    }
+    inner->WriteUnlock();
+    if (parent) {
+      parent->WriteUnlock();
+    }
+    return true;
+  }
+
+  // 将空间不足的叶子节点leaf分裂，并将key插入到分裂后的节点中。parent为nullptr时leaf是根节点。加锁失败返回false。
+  template <typename ValueMaker>
+  bool SplitLeafAndInsert(INode *parent, uint64_t parent_version, LNode *leaf, uint64_t version, const KeyType &key,
+                          const ValueMaker &make_value) {
+    if (parent) {
+      // leaf节点要分裂，会向父节点插入key，要先拿到父节点的写锁。
+      // 之前访问父节点已经保证了父节点的空间足够，如果在访问后父节点发生了改动，那么这里会加锁失败。
+      if (!parent->UpgradeToWriteLockOrRestart(parent_version)) {
+        BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
         return false;
       }
-
-      return StartInsertUnique(child, inner, version, key, val, old_val, need_restart);
     }
 
-    LNode *leaf = static_cast<LNode *>(node);
-    if (leaf->Exists(key, old_val)) {
-      if (!leaf->ReadUnlockOrRestart(version)) {
-        *need_restart = true;
-      } else {
-        *need_restart = false;
+    if (!leaf->UpgradeToWriteLockOrRestart(version)) {
+      if (parent) {
+        parent->WriteUnlock();
       }
+      BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
       return false;
     }
 
-    if (!leaf->EnoughSpaceFor(MAX_KEY_SIZE)) {
-      if (parent) {
-        // leaf节点要分裂，会向父节点插入key，要先拿到父节点的写锁。
-        // 之前访问父节点已经保证了父节点的空间足够，如果在访问后父节点发生了改动，那么这里会加锁失败。
-        if (!parent->UpgradeToWriteLockOrRestart(parent_version)) {
-          *need_restart = true;
+    if (parent == nullptr && (leaf != root_.load())) {
+      leaf->WriteUnlock();
+      BPLUSTREE_STATS_ADD(ROOT_CHANGED_RESTART, 1);
+      return false;
+    }
+
+    BPLUSTREE_STATS_SPLIT(0);
+    // 分裂会修改右边兄弟节点的prev_指针，所以也要对它加写锁。加锁的顺序总是从左向右，不会死锁。
+    LNode *next = leaf->next_;
+    if (next != nullptr) {
+      bool locked = next->WriteLockOrRestart();
+      assert(locked);
+      (void)locked;
+    }
+
+    OwnedKey split_key;
+    // 最右的叶子节点在末尾插入时很可能是顺序插入，在插入点分裂，左边的节点保持满的状态，key插入到新节点中。
+    // 否则平分数据，左右两边各留一半的空间。
+    bool append = next == nullptr && leaf->IsAppend(key);
+    LNode *sibling = append ? leaf->SplitForAppend(key, &split_key) : nullptr;
+    if (sibling == nullptr) {
+      append = false;
+      sibling = leaf->Split(&split_key);
+    }
+    KeyType separator = Traits::View(split_key);
+    // 分裂完毕，此时还持有所有的写锁，直接将key插入到leaf或者sibling中，不需要再重启一次。
+    // 必须在sibling通过父节点或者next的prev_指针对其他线程可见之前插入，因为sibling本身并没有加锁。
+    if (Traits::Compare(key, separator) <= 0) {
+      leaf->Insert(key, make_value());
+    } else {
+      sibling->Insert(key, make_value());
+    }
+    if (append) {
+      // sibling没有加锁，插入完成之后才能让快速路径看到它。此时还持有leaf的写锁，sibling不会被合并掉。
+      SetAppendHint(sibling);
+    }
+    if (parent) {
+      bool result = parent->Insert(separator, sibling);
+      assert(result);
+      (void)result;
+    } else {
+      // 当前节点是leaf node，那么父节点的level必须是1
+      root_ = new INode(1, leaf, sibling, separator);
+    }
+    if (next != nullptr) {
+      next->WriteUnlock();
+    }
+    leaf->WriteUnlock();
+    if (parent) {
+      parent->WriteUnlock();
+    }
+    return true;
+  }
+
+  // 删除树中的key，key不存在返回false，否则返回true。调用者必须已经加入了epoch。
+  // 和插入一样沿着Path下降，需要重启时回退到仍然有效的祖先节点。
+  // 下降的过程中如果遇到填充率过低的内部节点，会先对它做一次合并或者借数据，和插入时提前分裂是一样的思路。
+  // 为了避免反复重启，每次删除操作最多只对内部节点尝试一次这样的调整。
+  bool StartRemove(const KeyType &key) {
+    bool rebalance_tried = false;
+    Path path;
+    for (;;) {
+      if (path.Empty() && !PushRoot(&path)) {
+        continue;
+      }
+
+      Node *node = path.Top();
+      uint64_t version = path.TopVersion();
+      INode *parent = path.Parent();
+      uint64_t parent_version = path.ParentVersion();
+
+      if (!node->IsLeaf()) {
+        INode *inner = static_cast<INode *>(node);
+        if (parent && !rebalance_tried && inner->NeedMerge()) {
+          rebalance_tried = true;
+          if (!parent->UpgradeToWriteLockOrRestart(parent_version)) {
+            BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
+            path.Backtrack();
+            continue;
+          }
+          if (!inner->UpgradeToWriteLockOrRestart(version)) {
+            parent->WriteUnlock();
+            BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
+            path.Backtrack();
+            continue;
+          }
+          Rebalance(parent, inner, parent->FindChildIndex(key));
+          // 调整完毕，当前节点和父节点的版本号都已经失效了，回退之后继续删除。
+          BPLUSTREE_STATS_ADD(SPLIT_RESTART, 1);
+          path.Backtrack();
+          continue;
+        }
+        if (!PushChild(&path, inner, version, key)) {
+          path.Backtrack();
+        }
+        continue;
+      }
+
+      LNode *leaf = static_cast<LNode *>(node);
+      if (!leaf->Exists(key)) {
+        if (leaf->ReadUnlockOrRestart(version)) {
           return false;
         }
+        BPLUSTREE_STATS_ADD(READ_LOCK_RESTART, 1);
+        path.Backtrack();
+        continue;
       }
 
       if (!leaf->UpgradeToWriteLockOrRestart(version)) {
-        *need_restart = true;
-        if (parent) {
-          parent->WriteUnlock();
-        }
-        return false;
+        BPLUSTREE_STATS_ADD(UPGRADE_RESTART, 1);
+        path.Backtrack();
+        continue;
       }
+      bool result = leaf->Remove(key);
+      assert(result);
+      (void)result;
 
-      // TODO: 这个地方有疑问，到底应不应该判断。
-      if (parent == nullptr && (node != root_)) {
-        // node原本是根节点，但是同时有其他线程在此线程对根节点加写锁之前已经将根节点分裂或删除了
-        // 此时虽然加写锁可以成功，但根节点已经是新的节点了，因此要重启。
+      // 节点填充率过低，尝试和兄弟节点调整。父节点加锁失败也没关系，key已经删除了，之后的删除操作还会再次尝试。
+      if (parent && leaf->NeedMerge() && parent->UpgradeToWriteLockOrRestart(parent_version)) {
+        Rebalance(parent, leaf, parent->FindChildIndex(key));
+      } else {
         leaf->WriteUnlock();
-        *need_restart = true;
-        return false;
       }
+      return true;
+    }
+  }
 
-      KeyType split_key;
-      LNode *sibling = leaf->Split(&split_key);
-      if (parent) {
-        bool result = parent->Insert(split_key, sibling);
-        assert(result);
-      } else {
-        // 当前节点是leaf node，那么父节点的level必须是1
-        root_ = new INode(1, leaf, sibling, split_key);
-      }
-      // TODO : 分裂完毕了，此时是否可以直接将key插入到leaf或者sibling节点了，还是需要再重启一次？
-      // if (key < split_key) {
-      //   leaf->Insert(key, val);
-      // } else {
-      //   sibling->Insert(key, val);
-      // }
-      leaf->WriteUnlock();
-      if (parent) {
+  // 将节点node和它的一个兄弟节点合并，或者从兄弟节点借一部分数据过来，node在parent中的下标为index。
+  // 调用者必须已经对parent和node加了写锁，函数返回时会释放这两个锁。
+  // 被合并掉的节点会被标记为删除并交给epoch回收，如果parent是根节点并且只剩下一个孩子，那么树的高度会降低一层。
+  void Rebalance(INode *parent, Node *node, uint16_t index) {
+    Node *left, *right;
+    uint16_t split_index;
+    if (index < parent->size()) {
+      left = node;
+      right = parent->ChildAt(index + 1);
+      split_index = index;
+      // 加锁的顺序总是从左向右，所以这里可以等待右边节点的锁。
+      if (!right->WriteLockOrRestart()) {
+        node->WriteUnlock();
+        parent->WriteUnlock();
+        return;
+      }
+    } else if (index > 0) {
+      left = parent->ChildAt(index - 1);
+      right = node;
+      split_index = index - 1;
+      // 从右向左加锁有可能死锁，所以不能等待，只尝试一次。
+      if (!left->TryWriteLock()) {
+        node->WriteUnlock();
         parent->WriteUnlock();
+        return;
       }
-      *need_restart = true;
-      return false;
     } else {
-      // leaf 节点空间足够，直接插入不需要再对父节点加写锁了
-      if (!leaf->UpgradeToWriteLockOrRestart(version)) {
-        *need_restart = true;
-        return false;
+      // parent只有一个孩子，没有兄弟节点可以调整
+      node->WriteUnlock();
+      parent->WriteUnlock();
+      return;
+    }
+
+    bool merged;
+    if (node->IsLeaf()) {
+      merged = RebalanceLeaf(parent, static_cast<LNode *>(left), static_cast<LNode *>(right), split_index);
+    } else {
+      merged = RebalanceInner(parent, static_cast<INode *>(left), static_cast<INode *>(right), split_index);
+    }
+
+    left->WriteUnlock();
+    if (merged) {
+      if (right->IsLeaf()) {
+        // 被合并掉的叶子节点不能再通过append_hint_访问到
+        auto *expected = static_cast<LNode *>(right);
+        append_hint_.compare_exchange_strong(expected, nullptr);
       }
-      if (parent) {
-        if (!parent->ReadUnlockOrRestart(parent_version)) {
-          *need_restart = true;
-          leaf->WriteUnlock();
-          return false;
-        }
+      right->WriteUnlockObsolete();
+      epoch_manager_.AddGarbageNode(right, NodeSize(right));
+    } else {
+      right->WriteUnlock();
+    }
+
+    if (parent->size() == 0 && parent == root_.load()) {
+      // 根节点只剩下一个孩子，这个孩子成为新的根节点。
+      root_.store(left);
+      parent->WriteUnlockObsolete();
+      epoch_manager_.AddGarbageNode(parent, sizeof(INode));
+      return;
+    }
+    parent->WriteUnlock();
+  }
+
+  // 调整两个相邻的叶子节点，right被合并到left中时返回true。
+  bool RebalanceLeaf(INode *parent, LNode *left, LNode *right, uint16_t split_index) {
+    if (left->CanMerge(right)) {
+      // 合并会修改right右边节点的prev_指针，也要加写锁。
+      LNode *next = right->next_;
+      if (next != nullptr) {
+        bool locked = next->WriteLockOrRestart();
+        assert(locked);
+        (void)locked;
       }
-      leaf->Insert(key, val);
-      leaf->WriteUnlock();
+      left->Merge(right);
+      if (next != nullptr) {
+        next->WriteUnlock();
+      }
+      parent->RemoveKeyAt(split_index);
       return true;
     }
+
+    // 借数据之后分隔key会改变，父节点要有足够的空间容纳新的分隔key。
+    if (!parent->EnoughSpaceFor(KEY_SIZE_LIMIT)) {
+      return false;
+    }
+    OwnedKey split_key;
+    if (left->Balance(right, &split_key)) {
+      parent->ReplaceKeyAt(split_index, Traits::View(split_key));
+    }
+    return false;
   }
 
-  // 从节点node开始查找key，没有找到则返回false
-  bool StartLookup(const Node *node, const Node *parent, const uint64_t parent_version, const KeyType &key,
-                   ValueType *val, bool *need_restart) const {
-    // a_.fetch_add(1);
-    uint64_t version;
-    if (!node->ReadLockOrRestart(&version)) {
-      *need_restart = true;
+  // 调整两个相邻的内部节点，right被合并到left中时返回true。
+  bool RebalanceInner(INode *parent, INode *left, INode *right, uint16_t split_index) {
+    OwnedKey split_key = parent->KeyAt(split_index);
+    KeyType separator = Traits::View(split_key);
+    if (left->CanMerge(separator, right)) {
+      left->Merge(separator, right);
+      parent->RemoveKeyAt(split_index);
+      return true;
+    }
+
+    if (!parent->EnoughSpaceFor(KEY_SIZE_LIMIT)) {
       return false;
     }
+    if (left->Balance(&split_key, right)) {
+      parent->ReplaceKeyAt(split_index, Traits::View(split_key));
+    }
+    return false;
+  }
 
-    if (parent) {
-      if (!parent->ReadUnlockOrRestart(parent_version)) {
-        *need_restart = true;
-        return false;
+  // 预取节点头部以及index部分开头的几个cache line
+  static void PrefetchNode(const Node *node) {
+    const char *addr = reinterpret_cast<const char *>(node);
+    for (int i = 0; i < BPLUSTREE_PREFETCH_LINES; i++) {
+      __builtin_prefetch(addr + i * CACHE_LINE_SIZE);
+    }
+  }
+
+  // 同时查找一组不超过BPLUSTREE_MULTI_LOOKUP_BATCH个key。调用者必须已经加入了epoch。
+  void StartMultiLookup(const KeyType *keys, size_t num, ValueType *values, bool *found) const {
+    const Node *nodes[BPLUSTREE_MULTI_LOOKUP_BATCH];
+    uint64_t versions[BPLUSTREE_MULTI_LOOKUP_BATCH];
+    bool pending[BPLUSTREE_MULTI_LOOKUP_BATCH];
+
+    Path path;
+    while (!PushRoot(&path)) {
+    }
+    for (size_t i = 0; i < num; i++) {
+      nodes[i] = path.Top();
+      versions[i] = path.TopVersion();
+      pending[i] = true;
+    }
+
+    // B+树是平衡的，所有key都从同一个根节点出发，所以会同时到达叶子节点。
+    // 某个key验证失败之后不再参与同步下降，最后单独查找。
+    for (uint16_t level = path.Top()->level(); level > 0; level--) {
+      const Node *children[BPLUSTREE_MULTI_LOOKUP_BATCH];
+      for (size_t i = 0; i < num; i++) {
+        if (!pending[i]) {
+          continue;
+        }
+        const INode *inner = static_cast<const INode *>(nodes[i]);
+        children[i] = inner->FindChild(keys[i]);
+        if (!inner->CheckOrRestart(versions[i])) {
+          pending[i] = false;
+          continue;
+        }
+        PrefetchNode(children[i]);
+      }
+
+      for (size_t i = 0; i < num; i++) {
+        if (!pending[i]) {
+          continue;
+        }
+        uint64_t child_version;
+        if (!children[i]->ReadLockOrRestart(&child_version) || !nodes[i]->ReadUnlockOrRestart(versions[i])) {
+          pending[i] = false;
+          continue;
+        }
+        nodes[i] = children[i];
+        versions[i] = child_version;
       }
     }
 
+    for (size_t i = 0; i < num; i++) {
+      if (pending[i]) {
+        const LNode *leaf = static_cast<const LNode *>(nodes[i]);
+        found[i] = leaf->FindValue(keys[i], &values[i]);
+        if (leaf->ReadUnlockOrRestart(versions[i])) {
+          continue;
+        }
+      }
+      found[i] = StartLookup(keys[i], &values[i]);
+    }
+  }
+
+  static uint32_t NodeSize(const Node *node) { return node->IsLeaf() ? sizeof(LNode) : sizeof(INode); }
+
+  // 统计以node为根的子树，调用者必须已经加入了epoch。
+  // 每个节点单独加读锁，读到的统计信息和孩子节点验证版本号之后才有效，节点已经被删除时直接跳过。
+  void InspectNode(const Node *node, TreeStats *stats) const {
+    KeyMapSpace space;
+    std::vector<const Node *> children;
+    for (;;) {
+      uint64_t version;
+      if (!node->ReadLockOrRestart(&version)) {
+        return;
+      }
+      bool readable;
+      children.clear();
+      if (node->IsLeaf()) {
+        readable = static_cast<const LNode *>(node)->key_map_.CollectSpace(&space);
+      } else {
+        const INode *inner = static_cast<const INode *>(node);
+        readable = inner->key_map_.CollectSpace(&space);
+        if (readable) {
+          children.push_back(inner->first_child_);
+          for (uint16_t i = 0; i < space.size; i++) {
+            children.push_back(inner->key_map_.ValueAt(i));
+          }
+        }
+      }
+      if (readable && node->ReadUnlockOrRestart(version)) {
+        break;
+      }
+    }
+
+    uint16_t level = node->level();
+    LevelStats &level_stats = stats->levels[level];
+    uint32_t capacity = node->IsLeaf() ? LNode::KeyMapType::Capacity() : INode::KeyMapType::Capacity();
+    stats->height = std::max<uint16_t>(stats->height, level + 1);
+    level_stats.node_count++;
+    level_stats.used_bytes += space.used;
+    level_stats.capacity_bytes += capacity;
+    level_stats.fragmented_bytes += space.used - space.live;
+    level_stats.memory_bytes += NodePool::SlotSize(NodeSize(node));
+    level_stats.min_fill_factor = std::min(level_stats.min_fill_factor, static_cast<double>(space.used) / capacity);
+    level_stats.key_count += space.size;
     if (node->IsLeaf()) {
-      const LNode *leaf = static_cast<const LNode *>(node);
-      bool result = leaf->FindValue(key, val);
-      if (!leaf->ReadUnlockOrRestart(version)) {
-        *need_restart = true;
-        return false;
+      stats->key_bytes += space.key_bytes;
+      stats->stored_key_bytes += space.stored_key_bytes;
+      stats->min_key_size = std::min(stats->min_key_size, space.min_key_size);
+      stats->max_key_size = std::max(stats->max_key_size, space.max_key_size);
+    }
+
+    for (const Node *child : children) {
+      InspectNode(child, stats);
+    }
+  }
+
+  // 释放以node为根的子树中的所有节点
+  static void FreeSubtree(Node *node) {
+    if (node->IsLeaf()) {
+      delete static_cast<LNode *>(node);
+      return;
+    }
+    auto *inner = static_cast<INode *>(node);
+    for (uint16_t i = 0; i <= inner->size(); i++) {
+      FreeSubtree(inner->ChildAt(i));
+    }
+    delete inner;
+  }
+
+  // 批量构建时的一层节点，separators[i]是nodes[i]和nodes[i + 1]之间的分隔key。
+  struct BulkLevel {
+    std::vector<Node *> nodes;
+    std::vector<OwnedKey> separators;
+  };
+
+  // 将[begin, end)中的数据按顺序装入一串相连的叶子节点，lower和upper是这一串叶子节点整体的fence key。
+  // 用完整的key估算空间，加入一个key之前要为可能的upper fence留出位置，upper fence不会比两侧的key更长。
+  template <typename ForwardIterator>
+  static void BuildLeaves(ForwardIterator begin, ForwardIterator end, const OwnedKey *lower, const OwnedKey *upper,
+                          double fill_factor, BulkLevel *level) {
+    using KeyMapType = typename LNode::KeyMapType;
+    const uint32_t budget = KeyMapType::Capacity() * fill_factor;
+    const size_t upper_size = upper == nullptr ? 0 : Traits::Size(Traits::View(*upper));
+    LNode *prev = nullptr;
+    auto iter = begin;
+    while (iter != end) {
+      const OwnedKey *leaf_lower = level->separators.empty() ? lower : &level->separators.back();
+      uint32_t used = leaf_lower == nullptr ? 0 : KeyMapType::FenceSpace(Traits::Size(Traits::View(*leaf_lower)));
+      auto leaf_begin = iter;
+      auto last = iter;
+      for (bool first = true; iter != end; first = false) {
+        KeyType key(iter->first);
+        auto next = std::next(iter);
+        size_t fence_size = next == end ? upper_size : std::max(Traits::Size(key), Traits::Size(KeyType(next->first)));
+        uint32_t space = KeyMapType::EntrySpace(Traits::Size(key));
+        if (!first && used + space + KeyMapType::FenceSpace(fence_size) > budget) {
+          break;
+        }
+        assert(first || Traits::Compare(KeyType(last->first), key) < 0);
+        used += space;
+        last = iter;
+        iter = next;
       }
-      *need_restart = false;
-      return result;
+
+      const OwnedKey *leaf_upper = upper;
+      if (iter != end) {
+        level->separators.push_back(LNode::Separator(KeyType(last->first), KeyType(iter->first)));
+        leaf_lower = level->separators.size() > 1 ? &level->separators[level->separators.size() - 2] : lower;
+        leaf_upper = &level->separators.back();
+      }
+      auto *leaf = new LNode();
+      KeyType lower_key = leaf_lower == nullptr ? KeyType() : Traits::View(*leaf_lower);
+      KeyType upper_key = leaf_upper == nullptr ? KeyType() : Traits::View(*leaf_upper);
+      leaf->key_map_.Reset(leaf_lower == nullptr ? nullptr : &lower_key, leaf_upper == nullptr ? nullptr : &upper_key);
+      for (auto it = leaf_begin; it != iter; ++it) {
+        leaf->key_map_.InsertKeyValue(leaf->key_map_.size(), KeyType(it->first), it->second);
+      }
+      leaf->prev_ = prev;
+      if (prev != nullptr) {
+        prev->next_ = leaf;
+      }
+      prev = leaf;
+      level->nodes.push_back(leaf);
     }
+  }
 
-    const INode *inner = static_cast<const INode *>(node);
-    const Node *child = inner->FindChild(key);
-    assert(child != nullptr);
-    // 这里需要再次检查，以保证child指针的有效性。
-    if (!inner->CheckOrRestart(version)) {
-      *need_restart = true;
-      return false;
+  // 在children之上构建一层内部节点。每个内部节点依次放入孩子节点以及它们之间的分隔key，
+  // 相邻两个内部节点之间的分隔key上移到更高一层，同时作为两边的fence key。
+  static void BuildInnerLevel(const BulkLevel &children, uint16_t level, double fill_factor, BulkLevel *parents) {
+    using KeyMapType = typename INode::KeyMapType;
+    const uint32_t budget = KeyMapType::Capacity() * fill_factor;
+    const std::vector<OwnedKey> &separators = children.separators;
+    size_t n = children.nodes.size();
+    size_t i = 0;
+    while (i < n) {
+      // 当前内部节点的孩子是[i, j]，分隔key是separators[i, j)
+      const OwnedKey *lower = i == 0 ? nullptr : &separators[i - 1];
+      uint32_t used = lower == nullptr ? 0 : KeyMapType::FenceSpace(Traits::Size(Traits::View(*lower)));
+      size_t j = i;
+      while (j + 1 < n) {
+        uint32_t space = KeyMapType::EntrySpace(Traits::Size(Traits::View(separators[j])));
+        size_t fence_size = j + 2 < n ? Traits::Size(Traits::View(separators[j + 1])) : 0;
+        if (j > i && used + space + KeyMapType::FenceSpace(fence_size) > budget) {
+          break;
+        }
+        used += space;
+        j++;
+      }
+      // 不能留下只有一个孩子的内部节点，把当前节点的最后一个孩子让给它
+      if (j + 2 == n && j > i + 1) {
+        j--;
+      }
+
+      const OwnedKey *upper = j + 1 < n ? &separators[j] : nullptr;
+      auto *inner = new INode(level);
+      KeyType lower_key = lower == nullptr ? KeyType() : Traits::View(*lower);
+      KeyType upper_key = upper == nullptr ? KeyType() : Traits::View(*upper);
+      inner->key_map_.Reset(lower == nullptr ? nullptr : &lower_key, upper == nullptr ? nullptr : &upper_key);
+      inner->first_child_ = children.nodes[i];
+      for (size_t k = i; k < j; k++) {
+        inner->key_map_.InsertKeyValue(inner->key_map_.size(), Traits::View(separators[k]), children.nodes[k + 1]);
+      }
+      parents->nodes.push_back(inner);
+      if (upper != nullptr) {
+        parents->separators.push_back(*upper);
+      }
+      i = j + 1;
+    }
+  }
+
+  // 从叶子节点开始逐层向上构建，直到只剩下一个根节点，然后替换掉原来的空树。
+  void FinishBulkLoad(BulkLevel *leaves, double fill_factor) {
+    Node *old_root = root_.load();
+    assert(old_root->IsLeaf() && static_cast<LNode *>(old_root)->size() == 0);
+    if (leaves->nodes.empty()) {
+      return;
+    }
+    BulkLevel level = std::move(*leaves);
+    for (uint16_t height = 1; level.nodes.size() > 1; height++) {
+      BulkLevel parents;
+      BuildInnerLevel(level, height, fill_factor, &parents);
+      level = std::move(parents);
+    }
+    root_.store(level.nodes.front());
+    append_hint_.store(nullptr);
+    delete static_cast<LNode *>(old_root);
+  }
+
+  // 查找key，没有找到则返回false。调用者必须已经加入了epoch。
+  bool StartLookup(const KeyType &key, ValueType *val) const {
+    Path path;
+    for (;;) {
+      if (path.Empty() && !PushRoot(&path)) {
+        continue;
+      }
+
+      const Node *node = path.Top();
+      uint64_t version = path.TopVersion();
+      if (node->IsLeaf()) {
+        const LNode *leaf = static_cast<const LNode *>(node);
+        bool result = leaf->FindValue(key, val);
+        if (leaf->ReadUnlockOrRestart(version)) {
+          return result;
+        }
+        BPLUSTREE_STATS_ADD(READ_LOCK_RESTART, 1);
+        path.Backtrack();
+        continue;
+      }
+
+      if (!PushChild(&path, static_cast<const INode *>(node), version, key)) {
+        path.Backtrack();
+      }
     }
-    return StartLookup(child, node, version, key, val, need_restart);
   }
 
- private:
   std::atomic<Node *> root_;
+  // 顺序插入的提示，指向最近一次有key插入到末尾的最右叶子节点。只有持有这个叶子节点的写锁时才能设置为它，
+  // 叶子节点被合并掉之前会先清除提示，所以读到的节点一定受epoch保护。
+  std::atomic<LNode *> append_hint_{nullptr};
   mutable EpochManager epoch_manager_;
+  // 重启只会发生在分裂或者冲突时，这两个计数器很少被修改，不会成为竞争的热点。
+  std::atomic<uint64_t> insert_restart_num_{0};
+  std::atomic<uint64_t> insert_resume_num_{0};
+};
+
+// BPlusTree的有序迭代器，支持正向和反向遍历。
+// 迭代器每次读取一个叶子节点的快照，快照在OLC版本号验证通过后才会生效。跨越叶子节点时通过prev_/next_指针移动，
+// 如果当前叶子节点在此期间发生了改变，只需要重新读取当前叶子节点，只有当前叶子节点被删除时才会从根节点重新查找。
+// 迭代器在整个生命周期内都处于epoch中，以保证快照中保存的兄弟节点指针有效，所以不要长时间持有迭代器。
+// 迭代器必须在创建它的线程中销毁。
+template <typename KeyType, typename ValueType, uint32_t LEAF_SIZE, uint32_t INNER_SIZE>
+class BPlusTree<KeyType, ValueType, LEAF_SIZE, INNER_SIZE>::Iterator {
+ public:
+  DISALLOW_COPY_AND_MOVE(Iterator);
+
+  explicit Iterator(const BPlusTree *tree) : tree_(tree) { tree_->epoch_manager_.JoinEpoch(); }
+
+  ~Iterator() { tree_->epoch_manager_.LeaveEpoch(); }
+
+  // 定位到第一个不小于key的位置
+  void Seek(const KeyType &key) {
+    SeekFromRoot(&key, true);
+    Advance(&key, true, true);
+  }
+
+  // 定位到最后一个不大于key的位置
+  void SeekForPrev(const KeyType &key) {
+    SeekFromRoot(&key, false);
+    Advance(&key, false, true);
+  }
+
+  // 定位到树中最小的key
+  void SeekToFirst() {
+    SeekFromRoot(nullptr, true);
+    Advance(nullptr, true, true);
+  }
+
+  // 定位到树中最大的key
+  void SeekToLast() {
+    SeekFromRoot(nullptr, false);
+    Advance(nullptr, false, true);
+  }
+
+  bool Valid() const { return valid_; }
+
+  void Next() {
+    assert(Valid());
+    if (pos_ + 1 < entries_.size()) {
+      pos_++;
+      return;
+    }
+    // 当前快照已经遍历完，要移动到右边的叶子节点。快照的内存会被覆盖，所以先把当前key拷贝出来。
+    cursor_key_.assign(key_buf_, entries_[pos_].key_offset, entries_[pos_].key_size);
+    KeyType key = Traits::Decode(cursor_key_.data(), cursor_key_.size());
+    Advance(&key, true, false);
+  }
+
+  void Prev() {
+    assert(Valid());
+    if (pos_ > 0) {
+      pos_--;
+      return;
+    }
+    cursor_key_.assign(key_buf_, entries_[pos_].key_offset, entries_[pos_].key_size);
+    KeyType key = Traits::Decode(cursor_key_.data(), cursor_key_.size());
+    Advance(&key, false, false);
+  }
+
+  // 返回的key并不持有内存，在迭代器下一次移动之前有效。
+  KeyType Key() const {
+    assert(Valid());
+    return Traits::Decode(&key_buf_[entries_[pos_].key_offset], entries_[pos_].key_size);
+  }
+
+  ValueType Value() const {
+    assert(Valid());
+    return entries_[pos_].value;
+  }
+
+ private:
+  struct Entry {
+    size_t key_offset;
+    size_t key_size;
+    ValueType value;
+  };
+
+  // 从根节点开始找到key所在的叶子节点并读取快照。key为nullptr时，forward为true找最左边的叶子节点，否则找最右边的。
+  void SeekFromRoot(const KeyType *key, bool forward) {
+    for (;;) {
+      uint64_t version;
+      const LNode *leaf = tree_->FindLeaf(
+          [key, forward](const INode *inner) -> const Node * {
+            if (key != nullptr) {
+              return inner->FindChild(*key);
+            }
+            if (forward || inner->size() == 0) {
+              return inner->first_child_;
+            }
+            return inner->key_map_.ValueAt(inner->size() - 1);
+          },
+          &version);
+      if (Snapshot(leaf, version)) {
+        return;
+      }
+    }
+  }
+
+  // 将迭代器定位到快照中满足条件的位置，找不到则沿着兄弟节点继续寻找。
+  // forward为true时寻找第一个大于key的位置，否则寻找最后一个小于key的位置。inclusive为true时也可以等于key。
+  // key为nullptr表示任何位置都满足条件。
+  void Advance(const KeyType *key, bool forward, bool inclusive) {
+    for (;;) {
+      if (PositionInSnapshot(key, forward, inclusive)) {
+        valid_ = true;
+        return;
+      }
+
+      const LNode *current = leaf_;
+      const LNode *sibling = forward ? next_leaf_ : prev_leaf_;
+      uint64_t version = 0;
+      bool sibling_locked = sibling != nullptr && sibling->ReadLockOrRestart(&version);
+      if (!current->CheckOrRestart(leaf_version_)) {
+        // 当前叶子节点在读取快照之后被修改了（比如发生了分裂），只要重新读取当前叶子节点即可。
+        if (!current->ReadLockOrRestart(&version)) {
+          // 当前叶子节点已经被删除，只能从根节点重新查找。
+          SeekFromRoot(key, forward);
+        } else {
+          Snapshot(current, version);
+        }
+        continue;
+      }
+
+      if (sibling == nullptr) {
+        // 已经到达了树的边界
+        valid_ = false;
+        return;
+      }
+
+      if (!sibling_locked) {
+        SeekFromRoot(key, forward);
+        continue;
+      }
+
+      if (!Snapshot(sibling, version)) {
+        continue;
+      }
+
+      if (!forward && next_leaf_ != current) {
+        // 左边的节点在这期间分裂了，读到的并不是紧挨着的兄弟节点。
+        SeekFromRoot(key, forward);
+      }
+    }
+  }
+
+  // 在当前快照中定位，成功返回true。
+  bool PositionInSnapshot(const KeyType *key, bool forward, bool inclusive) {
+    size_t size = entries_.size();
+    if (size == 0) {
+      return false;
+    }
+    if (key == nullptr) {
+      pos_ = forward ? 0 : size - 1;
+      return true;
+    }
+
+    // 找到第一个大于（或者不小于）key的位置
+    size_t lo = 0, hi = size;
+    while (lo < hi) {
+      size_t mid = (lo + hi) >> 1;
+      int result = Traits::Compare(Traits::Decode(&key_buf_[entries_[mid].key_offset], entries_[mid].key_size), *key);
+      if (result < 0 || (result == 0 && forward != inclusive)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    if (forward) {
+      pos_ = lo;
+      return lo < size;
+    }
+    if (lo == 0) {
+      return false;
+    }
+    pos_ = lo - 1;
+    return true;
+  }
+
+  // 读取叶子节点的快照。版本号验证通过时快照才会生效，并返回true。
+  bool Snapshot(const LNode *leaf, uint64_t version) {
+    snapshot_key_buf_.clear();
+    snapshot_entries_.clear();
+    const auto &key_map = leaf->key_map_;
+    uint16_t size = key_map.size();
+    for (uint16_t i = 0; i < size; i++) {
+      if (!key_map.Readable(i)) {
+        return false;
+      }
+      size_t key_offset = snapshot_key_buf_.size();
+      key_map.AppendKeyTo(i, &snapshot_key_buf_);
+      snapshot_entries_.push_back(Entry{key_offset, snapshot_key_buf_.size() - key_offset, key_map.ValueAt(i)});
+    }
+    const LNode *prev = leaf->prev_;
+    const LNode *next = leaf->next_;
+    if (!leaf->ReadUnlockOrRestart(version)) {
+      return false;
+    }
+
+    key_buf_.swap(snapshot_key_buf_);
+    entries_.swap(snapshot_entries_);
+    leaf_ = leaf;
+    leaf_version_ = version;
+    prev_leaf_ = prev;
+    next_leaf_ = next;
+    return true;
+  }
+
+  const BPlusTree *tree_;
+  const LNode *leaf_{nullptr};  // 当前快照对应的叶子节点
+  uint64_t leaf_version_{INVALID_OLC_LOCK_VERSION};
+  const LNode *prev_leaf_{nullptr};
+  const LNode *next_leaf_{nullptr};
+  std::string key_buf_;  // 快照中所有key的数据
+  std::vector<Entry> entries_;
+  size_t pos_{0};
+  bool valid_{false};
+  std::string cursor_key_;  // 跨越叶子节点时保存当前的key
+  // 读取快照时使用的临时缓冲区，快照生效时和key_buf_，entries_交换，避免反复分配内存
+  std::string snapshot_key_buf_;
+  std::vector<Entry> snapshot_entries_;
 };
 
 // 画出树的dot图，仅用于测试
@@ -3,13 +3,18 @@
 #include "container/bplustree/tree.h"
 #include "pidan/db.h"
 #include "storage/data_header.h"
+#include "transaction/garbage_collector.h"
 #include "transaction/transaction_manager.h"
 
 namespace pidan {
 
 class DBImpl : public PidanDB {
  public:
-  DBImpl() : txn_manager_(&ts_manager_) {}
+  DBImpl()
+      : txn_manager_(&ts_manager_),
+        gc_(&ts_manager_, &txn_manager_, [this](const Slice &key) { index_.Remove(key); }) {
+    gc_.Start();
+  }
 
   virtual ~DBImpl() = default;
 
@@ -17,7 +22,7 @@ class DBImpl : public PidanDB {
 
   virtual Status Get(const Slice &key, std::string *val) override;
 
-  virtual Status Delete(const Slice &key) override {}
+  virtual Status Delete(const Slice &key) override;
 
   virtual Status Begin() override {}
 
@@ -29,6 +34,7 @@ class DBImpl : public PidanDB {
   BPlusTree<Slice, DataHeader *> index_;
   TimestampManager ts_manager_;
   TransactionManager txn_manager_;
+  GarbageCollector gc_;
 };
 
 }  // namespace pidan
\ No newline at end of file
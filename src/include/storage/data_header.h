@@ -1,7 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <string>
+#include <vector>
 
+#include "common/config.h"
 #include "common/macros.h"
 #include "common/nowait_rw_latch.h"
 #include "common/type.h"
@@ -12,8 +15,11 @@
 namespace pidan {
 
 // DataHeader 中保存了一条数据所有的多版本信息。通过B+树索引。
-// DataHeader 不区分insert和update，这两种操作统一为put。
-class DataHeader {
+// DataHeader 不区分insert和update，这两种操作统一为put。删除操作写入一个墓碑版本，
+// 墓碑对所有事务都可见之后，GC线程将key从索引中删除，并在之后的GC周期释放DataHeader。
+// 最新的已提交版本不超过DATA_HEADER_INLINE_SIZE时，会在提交时复制一份到DataHeader中，读事务读最新版本时
+// 不需要访问version chain。内联的副本由inline_seq_保护，写事务在持有写锁时修改，读事务读完之后检查版本号。
+class alignas(CACHE_LINE_SIZE) DataHeader {
  public:
   DISALLOW_COPY_AND_MOVE(DataHeader);
 
@@ -25,21 +31,61 @@ class DataHeader {
   // 插入一个新的值，插入成功返回true，否则返回false
   bool Put(Transaction *txn, const Slice &val);
 
+  // 删除key对应的值，key保存在墓碑版本中。加锁失败返回false。
+  // 对当前事务来说值已经不存在时不写入墓碑，not_found为true。
+  bool Delete(Transaction *txn, const Slice &key, bool *not_found);
+
   // 查找到对当前事务可见的值，成功返回true，否则返回false
   // 读事务一定不会失败。如果找不到，则不会对val做任何改动，并且not_found为true
   bool Select(Transaction *txn, std::string *val, bool *not_found);
 
-  // 将此DataHeader标记为删除，只能由GC线程调用。
-  // GC线程标记为删除后，会在将来某个GC周期将其占有的内存全部释放。
-  // void SetDelete() { to_be_deleted_.store(1); }
+  // 删除version chain中对所有事务都不可见的旧版本，被删除的UndoRecord追加到garbage中，只能由GC线程调用。
+  // oldest不大于所有正在执行的事务的时间戳，时间戳不大于oldest的最新版本之后的版本都不会再被读到。
+  // 这个最新版本是墓碑时返回true，说明这个DataHeader可能可以删除了。
+  bool Truncate(timestamp_t oldest, std::vector<UndoRecord *> *garbage);
+
+  // 将此DataHeader标记为删除，只能由GC线程调用。只有version chain中只剩下一个时间戳不大于oldest的墓碑时才能标记，
+  // 标记成功返回这个墓碑，其中保存了被删除的key，否则返回nullptr。写锁被其他事务持有时*locked为true，
+  // 这时还不能确定能否删除，之后需要重试。
+  // 标记之后GC线程一直持有写锁，其他事务都无法再修改它。GC线程将key从索引中删除之后，会在将来某个GC周期
+  // 将其占有的内存全部释放。
+  UndoRecord *TryMarkDeleted(timestamp_t oldest, bool *locked);
 
-  // bool IsDelete() { return to_be_deleted_.load() == 1; }
+  bool IsDeleted() const { return deleted_.load(); }
 
  private:
   friend class Transaction;
+
+  // 为txn加写锁，已经加了读锁时升级为写锁，加锁失败返回false
+  bool WriteLock(Transaction *txn);
+
+  // 将undo插入到version chain的头部，调用者必须持有写锁
+  void Install(UndoRecord *undo);
+
+  // 事务提交时，在设置UndoRecord的时间戳之前调用，之后开始的内联读取都会失败，回到version chain上读取。
+  // 调用者必须持有写锁。
+  void BeginInlineUpdate();
+
+  // 事务提交时，在设置UndoRecord的时间戳之后调用，把最新的版本复制到DataHeader中。调用者必须持有写锁。
+  void EndInlineUpdate();
+
+  // 读事务读取内联的最新版本。内联的版本对时间戳为timestamp的事务可见并且读取时没有被修改时返回true，
+  // 否则返回false，需要在version chain上查找。
+  bool SelectInline(timestamp_t timestamp, std::string *val, bool *not_found);
+
   NoWaitRWLatch latch_;
-  // std::atomic<uint32_t> to_be_deleted_{0};
+  std::atomic<uint32_t> inline_seq_{0};  // 奇数表示正在修改内联的版本
   std::atomic<UndoRecord *> version_chain_{nullptr};
+  // 内联版本的时间戳，MAX_TIMESTAMP表示没有内联的版本
+  std::atomic<timestamp_t> inline_timestamp_{MAX_TIMESTAMP};
+  std::atomic<bool> deleted_{false};
+  std::atomic<UndoRecordType> inline_type_{UndoRecordType::PUT};
+  std::atomic<uint16_t> inline_size_{0};
+  char inline_data_[DATA_HEADER_INLINE_SIZE];
 };
 
+static_assert(sizeof(DataHeader) == CACHE_LINE_SIZE);
+// LockSet用指针的最低位保存锁的类型
+static_assert(alignof(DataHeader) > 1);
+
 }  // namespace pidan
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common/macros.h"
+#include "common/type.h"
+#include "pidan/slice.h"
+#include "transaction/timestamp_manager.h"
+#include "transaction/transaction_manager.h"
+
+namespace pidan {
+
+class DataHeader;
+class Transaction;
+class UndoRecord;
+
+/**
+ * GarbageCollector 负责回收MVCC中已经不会再被读到的旧版本，以及已经结束的写事务。
+ * 每一轮回收分为两步：
+ * 1. 对时间戳不大于所有正在执行的事务的已提交事务，截断它修改过的每个DataHeader的version chain，
+ *    回滚的事务创建的版本则已经从version chain中删除了。这一步只是把版本从version chain中摘下来。
+ * 2. 摘下来的版本可能还有读事务正在访问，先记下摘除时的时间戳，等到所有正在执行的事务都晚于这个时间戳开始，
+ *    也就是摘除时正在执行的事务都已经结束之后，才真正释放内存。
+ * 截断之后只剩下一个对所有事务都可见的墓碑的DataHeader，通过remove_key将key从索引中删除，
+ * 和被摘下的版本一样等待一段时间之后释放。还没有被GC线程处理的已提交事务也会引用DataHeader，
+ * 所以还要等删除时已经交给GC线程的事务都处理完之后才释放。
+ * 每个线程同一时间只能有一个正在执行的事务，否则TimestampManager无法知道最老的事务。
+ */
+class GarbageCollector {
+ public:
+  DISALLOW_COPY_AND_MOVE(GarbageCollector);
+
+  // remove_key用来将被删除的key从索引中删除，为空时不会删除DataHeader
+  GarbageCollector(TimestampManager *ts_manager, TransactionManager *txn_manager,
+                   std::function<void(const Slice &)> remove_key = nullptr)
+      : ts_manager_(ts_manager), txn_manager_(txn_manager), remove_key_(std::move(remove_key)) {}
+
+  // 析构时已经没有事务在执行，所有还没有释放的版本和事务都直接释放
+  ~GarbageCollector();
+
+  // 启动GC线程，每隔GC_INTERVAL毫秒执行一次PerformGC
+  void Start();
+
+  // 停止GC线程，可以重复调用
+  void Stop();
+
+  // 执行一轮回收，返回这一轮释放的UndoRecord数量。只能在GC线程中调用，或者在没有启动GC线程时调用。
+  uint64_t PerformGC();
+
+  // 已经释放的UndoRecord数量
+  uint64_t FreedRecordNum() const { return freed_record_num_.load(std::memory_order_relaxed); }
+
+  // 已经释放的事务数量
+  uint64_t FreedTxnNum() const { return freed_txn_num_.load(std::memory_order_relaxed); }
+
+  // 已经从索引中删除的key的数量
+  uint64_t RemovedKeyNum() const { return removed_key_num_.load(std::memory_order_relaxed); }
+
+ private:
+  // 已经从version chain中摘下的一批版本和已经从索引中删除的DataHeader，以及摘下之后的时间戳
+  struct GarbageBatch {
+    timestamp_t timestamp;
+    // 删除DataHeader时已经交给GC线程的事务数量，序号不大于它的事务可能还引用着这些DataHeader
+    uint64_t completed_seq{0};
+    std::vector<UndoRecord *> records;
+    std::vector<DataHeader *> data_headers;
+  };
+
+  // 所有正在执行的事务的时间戳的下界，没有正在执行的事务时返回MAX_TIMESTAMP
+  timestamp_t OldestActiveTimestamp();
+
+  // 尝试删除只剩下墓碑的DataHeader，被删除的DataHeader和它的墓碑追加到batch中。因为其他事务持有锁而无法判断的
+  // DataHeader放入locked_deleted_，下一轮重试。
+  void RemoveDeleted(const std::vector<DataHeader *> &candidates, timestamp_t visible, GarbageBatch *batch);
+
+  // 释放batch中所有的版本和DataHeader，返回释放的版本数量
+  uint64_t FreeBatch(GarbageBatch *batch);
+
+  TimestampManager *ts_manager_;
+  TransactionManager *txn_manager_;
+  std::function<void(const Slice &)> remove_key_;
+  std::vector<Transaction *> waiting_txns_;   // 已经提交，但还有更老的事务在执行的事务
+  std::vector<DataHeader *> locked_deleted_;  // 最新版本是墓碑，但上一轮被其他事务加了锁而没能删除的DataHeader
+  std::vector<GarbageBatch> pending_batches_;  // 已经摘下，等待释放的版本
+  uint64_t taken_seq_{0};                      // 已经从TransactionManager中取走的事务的最大序号
+  uint64_t processed_seq_{0};                  // 序号不大于它的事务都已经处理并释放了
+  std::atomic<uint64_t> freed_record_num_{0};
+  std::atomic<uint64_t> freed_txn_num_{0};
+  std::atomic<uint64_t> removed_key_num_{0};
+  std::mutex terminate_latch_;
+  std::condition_variable terminate_cv_;
+  bool terminate_{true};  // 被terminate_latch_保护
+  std::thread *thread_{nullptr};
+};
+
+}  // namespace pidan
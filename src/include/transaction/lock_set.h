@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+
+#include "common/config.h"
+#include "common/macros.h"
+#include "common/small_vector.h"
+
+namespace pidan {
+
+class DataHeader;
+
+enum class LockMode : uintptr_t { READ = 0, WRITE = 1 };
+
+// 事务在DataHeader上持有的锁的集合。DataHeader按cache line对齐，锁的类型保存在指针的最低位。
+// 元素按加锁的顺序保存在SmallVector中，大多数事务只会访问少量的key，不超过TRANSACTION_INLINE_SET_SIZE个时
+// 直接线性查找，不需要动态分配内存。超过之后额外建立一个开放寻址的哈希表，保存每个DataHeader在数组中的下标。
+// 提交和回滚时按加锁的顺序遍历数组，一遍就可以释放所有的锁。
+class LockSet {
+ public:
+  DISALLOW_COPY_AND_MOVE(LockSet);
+
+  LockSet() = default;
+
+  // data_header上是否加了mode类型的锁
+  bool Holds(DataHeader *data_header, LockMode mode) const {
+    int64_t i = IndexOf(data_header);
+    return i >= 0 && ModeOf(entries_[i]) == mode;
+  }
+
+  // 记录对data_header加的锁，调用者保证之前没有对它加过锁
+  void Insert(DataHeader *data_header, LockMode mode) {
+    assert(IndexOf(data_header) < 0);
+    entries_.push_back(reinterpret_cast<uintptr_t>(data_header) | static_cast<uintptr_t>(mode));
+    if (entries_.size() > TRANSACTION_INLINE_SET_SIZE) {
+      if (entries_.size() * 2 > capacity_) {
+        Rehash();
+      } else {
+        InsertIndex(entries_.size() - 1);
+      }
+    }
+  }
+
+  // 将data_header上的读锁记为写锁
+  void Upgrade(DataHeader *data_header) {
+    int64_t i = IndexOf(data_header);
+    assert(i >= 0 && ModeOf(entries_[i]) == LockMode::READ);
+    entries_[i] |= static_cast<uintptr_t>(LockMode::WRITE);
+  }
+
+  // 按加锁的顺序对每个DataHeader调用f(data_header, mode)
+  template <typename F>
+  void ForEach(F &&f) const {
+    for (uintptr_t entry : entries_) {
+      f(HeaderOf(entry), ModeOf(entry));
+    }
+  }
+
+ private:
+  static constexpr uintptr_t MODE_MASK = 1;
+
+  static DataHeader *HeaderOf(uintptr_t entry) { return reinterpret_cast<DataHeader *>(entry & ~MODE_MASK); }
+
+  static LockMode ModeOf(uintptr_t entry) { return static_cast<LockMode>(entry & MODE_MASK); }
+
+  // DataHeader按cache line对齐，地址的低位都是0
+  static uint32_t Hash(DataHeader *data_header) {
+    return static_cast<uint32_t>((reinterpret_cast<uintptr_t>(data_header) >> 6) * 0x9E3779B97F4A7C15ULL >> 32);
+  }
+
+  // data_header在entries_中的下标，不存在时返回-1
+  int64_t IndexOf(DataHeader *data_header) const {
+    if (entries_.size() <= TRANSACTION_INLINE_SET_SIZE) {
+      for (uint32_t i = 0; i < entries_.size(); i++) {
+        if (HeaderOf(entries_[i]) == data_header) {
+          return i;
+        }
+      }
+      return -1;
+    }
+    for (uint32_t slot = Hash(data_header) & (capacity_ - 1);; slot = (slot + 1) & (capacity_ - 1)) {
+      // 哈希表中保存的是下标加1，0表示空的slot
+      uint32_t index = index_[slot];
+      if (index == 0) {
+        return -1;
+      }
+      if (HeaderOf(entries_[index - 1]) == data_header) {
+        return index - 1;
+      }
+    }
+  }
+
+  void InsertIndex(uint32_t i) {
+    uint32_t slot = Hash(HeaderOf(entries_[i])) & (capacity_ - 1);
+    while (index_[slot] != 0) {
+      slot = (slot + 1) & (capacity_ - 1);
+    }
+    index_[slot] = i + 1;
+  }
+
+  // 哈希表的装载因子保持在1/2以下
+  void Rehash() {
+    capacity_ = capacity_ == 0 ? TRANSACTION_INLINE_SET_SIZE * 4 : capacity_ * 2;
+    index_ = std::make_unique<uint32_t[]>(capacity_);
+    for (uint32_t i = 0; i < entries_.size(); i++) {
+      InsertIndex(i);
+    }
+  }
+
+  static_assert((TRANSACTION_INLINE_SET_SIZE & (TRANSACTION_INLINE_SET_SIZE - 1)) == 0);
+
+  SmallVector<uintptr_t, TRANSACTION_INLINE_SET_SIZE> entries_;
+  std::unique_ptr<uint32_t[]> index_;  // 开放寻址的哈希表，元素超过TRANSACTION_INLINE_SET_SIZE个之后才会分配
+  uint32_t capacity_{0};               // 哈希表的slot数量，总是2的幂
+};
+
+}  // namespace pidan
@@ -1,9 +1,13 @@
 #pragma once
-#include <set>
-#include <vector>
 
+#include <atomic>
+
+#include "common/config.h"
+#include "common/small_vector.h"
 #include "common/type.h"
 #include "pidan/slice.h"
+#include "transaction/lock_set.h"
+#include "transaction/transaction_pool.h"
 #include "transaction/undo_record.h"
 
 namespace pidan {
@@ -20,10 +24,24 @@ class Transaction {
 
   Transaction(TransactionType type, timestamp_t t) : type_(type), timestamp_(t) {}
 
+  // 写事务从TransactionPool中分配，和它创建的UndoRecord一样由GC线程批量释放
+  static void *operator new(size_t size) { return TransactionPool::Instance()->Allocate(size); }
+
+  static void operator delete(void *ptr, size_t size) { TransactionPool::Instance()->Free(ptr, size); }
+
   timestamp_t Timestamp() const { return timestamp_; }
 
+  // 事务提交的时间戳，还没有提交完成或者已经回滚的事务是MAX_TIMESTAMP。
+  // 提交时间戳是提交过程中最后写入的，GC线程看到它之后提交的线程就不会再访问这个事务了。
+  timestamp_t CommitTimestamp() const { return commit_timestamp_.load(); }
+
+  bool Aborted() const { return aborted_; }
+
   UndoRecord *NewUndoRecordForPut(DataHeader *data_header, const Slice &val);
 
+  // 删除操作的UndoRecord，也就是一个墓碑版本。墓碑中保存的是被删除的key，GC线程用它把key从索引中删除。
+  UndoRecord *NewUndoRecordForDelete(DataHeader *data_header, const Slice &key);
+
   TransactionType Type() const { return type_; }
 
   void ReadLockOn(DataHeader *data_header);
@@ -38,24 +56,28 @@ class Transaction {
 
  private:
   friend class TransactionManager;
-  // 令写操作可见，用于事务提交。
+  friend class GarbageCollector;
+  // 令写操作可见并释放所有的锁，用于事务提交。
   void MakeWriteVisible(timestamp_t timestamp);
 
-  // 释放所有读锁，用于事务提交。
-  void RealseAllReadLock();
+  void Rollback();
 
-  void RelaseAllWriteLock();
+  UndoRecord *NewUndoRecord(UndoRecordType type, DataHeader *data_header, const Slice &data);
 
-  void Rollback();
+  // 为data_header上这个事务写入的版本设置提交时间戳
+  void CommitAllUndoRecord(DataHeader *data_header, timestamp_t timestamp);
 
   void RollbackAllUndoRecord(DataHeader *data_header);
 
-  std::vector<UndoRecord *> write_set_;  // 所有由此事务创建的UndoRecord集合,这里一定不会有重复元素
-  std::set<DataHeader *> write_lock_set_;  // 加了写锁的DataHeader集合
-  // 加了读锁的DataHeader集合。如果一个DataHeader存在于write_lock_set_中，那它必须不能存在于read_lock_set_
-  std::set<DataHeader *> read_lock_set_;
+  // 所有由此事务创建的UndoRecord集合,这里一定不会有重复元素
+  SmallVector<UndoRecord *, TRANSACTION_INLINE_SET_SIZE> write_set_;
+  // 加了锁的DataHeader集合，每个DataHeader上只会有一个读锁或者写锁
+  LockSet lock_set_;
   TransactionType type_;
   timestamp_t timestamp_;  // 表示事务开始的时间戳，不同事务可能开始于同一个时间戳
+  std::atomic<timestamp_t> commit_timestamp_{MAX_TIMESTAMP};
+  uint64_t completed_seq_{0};  // 交给GC线程时的序号，从1开始递增
+  bool aborted_{false};
   IsolationLevel iso_lv_{IsolationLevel::READ_COMMITTED};
 };
 
@@ -1,9 +1,9 @@
 #pragma once
 #include <mutex>
+#include <vector>
 
-#include "transaction/timestamp_manager.h"
 #include "common/spin_latch.h"
-#include <vector>
+#include "transaction/timestamp_manager.h"
 
 namespace pidan {
 class Transaction;
@@ -14,9 +14,10 @@ class TransactionManager {
  public:
   DISALLOW_COPY_AND_MOVE(TransactionManager);
 
-  TransactionManager(TimestampManager *ts_manager) : ts_manager_(ts_manager) {
-    completed_txn_.reserve(10000000);
-  }
+  TransactionManager(TimestampManager *ts_manager) : ts_manager_(ts_manager) {}
+
+  // 释放还没有被GC线程取走的已经结束的写事务
+  ~TransactionManager();
 
   // 开始一个写事务
   // 写事务需要动态分配内存方便GC
@@ -26,20 +27,30 @@ class TransactionManager {
   // 读事务不需要动态分配内存
   Transaction BeginReadTransaction();
 
-  // 提交一个事务
+  // 提交一个事务。写事务提交之后由GC线程负责释放，调用者不能再访问它。
   void Commit(Transaction *txn);
 
-  // 终止一个事务，会回滚它做出的所有改动。
+  // 终止一个事务，会回滚它做出的所有改动。和Commit一样，写事务之后由GC线程负责释放。
   void Abort(Transaction *txn);
 
+  // 取走所有已经提交或者回滚的写事务，按交给GC线程的顺序排列，只由GC线程调用
+  std::vector<Transaction *> TakeCompletedTransactions();
+
+  // 已经交给GC线程的写事务数量，也就是最后一个写事务的序号
+  uint64_t CompletedNum();
+
  private:
+  // 给事务分配一个序号，交给GC线程
+  void AddCompletedTransaction(Transaction *txn);
+
   TimestampManager *ts_manager_;
   // txn_id_t txn_auto_id_{INIT_TXN_ID};
   // std::mutex commit_lock_;  // 此锁保证同一时间只能有一个事务进行提交
   // tbb::spin_mutex commit_lock_;
   SpinLatch commit_lock_;
   SpinLatch completed_txn_lock_;
-  std::vector<Transaction *> completed_txn_;
+  std::vector<Transaction *> completed_txn_;  // 已经提交或者回滚的写事务，等待GC线程回收
+  uint64_t completed_num_{0};                 // 被completed_txn_lock_保护
 };
 
 }  // namespace pidan
\ No newline at end of file
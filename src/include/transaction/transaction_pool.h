@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+
+#include "common/config.h"
+#include "common/size_class_pool.h"
+
+namespace pidan {
+
+// 事务和UndoRecord的size class。UndoRecord的大小是头部加上value，分布比较零散：
+// 不超过128字节时每16字节一个size class，之后每个2的幂的区间分成4个size class，直到TRANSACTION_POOL_MAX_SLOT_SIZE，
+// 每个slot最多浪费25%的空间。
+struct TransactionSizeClasses {
+  static constexpr size_t MAX_SLOT_SIZE = TRANSACTION_POOL_MAX_SLOT_SIZE;
+  static constexpr size_t CHUNK_SIZE = TRANSACTION_POOL_CHUNK_SIZE;
+  static constexpr size_t BATCH_BYTES = TRANSACTION_POOL_BATCH_BYTES;
+
+  static constexpr size_t SMALL_STEP = 16;
+  static constexpr size_t SMALL_LIMIT = 128;
+  static constexpr int SMALL_SIZE_CLASS = SMALL_LIMIT / SMALL_STEP;
+  static constexpr int SMALL_LIMIT_BITS = __builtin_ctzll(SMALL_LIMIT);
+  static constexpr int NUM_SIZE_CLASS = SMALL_SIZE_CLASS + (__builtin_ctzll(MAX_SLOT_SIZE) - SMALL_LIMIT_BITS) * 4;
+
+  static constexpr int SizeClass(size_t size) {
+    if (size <= SMALL_LIMIT) {
+      return size == 0 ? 0 : static_cast<int>((size - 1) / SMALL_STEP);
+    }
+    // size - 1落在[2^bits, 2^(bits+1))中，这个区间按2^(bits-2)分成4份
+    int bits = 63 - __builtin_clzll(size - 1);
+    size_t sub = (size - 1 - (size_t{1} << bits)) >> (bits - 2);
+    return SMALL_SIZE_CLASS + (bits - SMALL_LIMIT_BITS) * 4 + static_cast<int>(sub);
+  }
+
+  static constexpr size_t SlotSizeOf(int size_class) {
+    if (size_class < SMALL_SIZE_CLASS) {
+      return (size_class + 1) * SMALL_STEP;
+    }
+    int bits = SMALL_LIMIT_BITS + (size_class - SMALL_SIZE_CLASS) / 4;
+    size_t sub = (size_class - SMALL_SIZE_CLASS) % 4;
+    return (size_t{1} << bits) + ((sub + 1) << (bits - 2));
+  }
+
+  static_assert((MAX_SLOT_SIZE & (MAX_SLOT_SIZE - 1)) == 0 && MAX_SLOT_SIZE > SMALL_LIMIT);
+};
+
+// Transaction以及UndoRecord的内存池。写事务在自己的线程中分配，GC线程回收时批量释放到自己的本地链表，
+// 攒够一批之后经过全局链表回到执行写事务的线程。
+using TransactionPool = SizeClassPool<TransactionSizeClasses>;
+
+}  // namespace pidan
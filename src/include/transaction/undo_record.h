@@ -6,6 +6,7 @@
 #include "common/macros.h"
 #include "common/type.h"
 #include "storage/data_entry.h"
+#include "transaction/transaction_pool.h"
 
 namespace pidan {
 
@@ -26,12 +27,21 @@ class UndoRecord {
 
   void GetData(std::string *val);
 
+  // 不复制数据，返回的Slice在UndoRecord被释放之前有效
+  Slice Data() const { return Slice(data_.data_, data_.size_); }
+
   DataHeader *GetDataHeader() { return header_; }
 
   void SetTimestamp(timestamp_t ts) { timestamp_.store(ts); }
 
   timestamp_t GetTimestamp() { return timestamp_.load(); }
 
+  // UndoRecord连同数据一起占用的字节数
+  static size_t SizeOf(size_t data_size) { return sizeof(UndoRecord) + data_size; }
+
+  // 释放由Transaction分配的UndoRecord，还给TransactionPool
+  static void Delete(UndoRecord *record) { TransactionPool::Instance()->Free(record, SizeOf(record->data_.size_)); }
+
  private:
   // 只能由Transaction类来初始化成员变量
   friend class Transaction;
@@ -1,6 +1,7 @@
 #include "storage/data_header.h"
 
 #include <cassert>
+#include <cstring>
 
 #include "transaction/transaction.h"
 
@@ -14,7 +15,28 @@ DataHeader::DataHeader(Transaction *txn) {
 
 bool DataHeader::Put(Transaction *txn, const Slice &val) {
   assert(txn->Type() == TransactionType::WRITE);
+  if (!WriteLock(txn)) {
+    return false;
+  }
+  Install(txn->NewUndoRecordForPut(this, val));
+  return true;
+}
+
+bool DataHeader::Delete(Transaction *txn, const Slice &key, bool *not_found) {
+  assert(txn->Type() == TransactionType::WRITE);
+  if (!WriteLock(txn)) {
+    return false;
+  }
+  // 加了写锁之后最新的版本就是当前事务能看到的版本
+  UndoRecord *undo = version_chain_.load();
+  *not_found = undo == nullptr || undo->Type() == UndoRecordType::DELETE;
+  if (!*not_found) {
+    Install(txn->NewUndoRecordForDelete(this, key));
+  }
+  return true;
+}
 
+bool DataHeader::WriteLock(Transaction *txn) {
   // txn如果没加写锁。分两种情况：1.已经加了读锁，那么尝试升级为写锁。
   // 2. 读锁也没加，那么尝试直接加写锁。
   if (!txn->AlreadyWriteLockOn(this)) {
@@ -32,8 +54,10 @@ bool DataHeader::Put(Transaction *txn, const Slice &val) {
       txn->WriteLockOn(this);
     }
   }
+  return true;
+}
 
-  auto undo = txn->NewUndoRecordForPut(this, val);
+void DataHeader::Install(UndoRecord *undo) {
   auto version_chain = version_chain_.load();
   // 这里不需要原子操作，因为没有其他线程知道undo的存在。
   undo->Next() = version_chain;
@@ -41,12 +65,94 @@ bool DataHeader::Put(Transaction *txn, const Slice &val) {
   auto result = version_chain_.compare_exchange_strong(version_chain, undo);
   // 这里一定不会失败，因为我们已经加了写锁
   assert(result == true);
+  (void)result;
+}
+
+void DataHeader::BeginInlineUpdate() {
+  // 只有持有写锁的线程会修改inline_seq_
+  inline_seq_.store(inline_seq_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void DataHeader::EndInlineUpdate() {
+  // 持有写锁时version chain的头部就是最新的已提交版本
+  UndoRecord *undo = version_chain_.load();
+  timestamp_t timestamp = MAX_TIMESTAMP;
+  if (undo != nullptr && undo->Data().size() <= DATA_HEADER_INLINE_SIZE) {
+    Slice data = undo->Data();
+    std::memcpy(inline_data_, data.data(), data.size());
+    inline_size_.store(data.size(), std::memory_order_relaxed);
+    inline_type_.store(undo->Type(), std::memory_order_relaxed);
+    timestamp = undo->GetTimestamp();
+  }
+  inline_timestamp_.store(timestamp, std::memory_order_relaxed);
+  inline_seq_.store(inline_seq_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool DataHeader::SelectInline(timestamp_t timestamp, std::string *val, bool *not_found) {
+  uint32_t seq = inline_seq_.load(std::memory_order_acquire);
+  if ((seq & 1) != 0) {
+    return false;
+  }
+  // 内联的是最新的已提交版本，时间戳不大于timestamp时就是对读事务可见的版本
+  if (inline_timestamp_.load(std::memory_order_relaxed) > timestamp) {
+    return false;
+  }
+  UndoRecordType type = inline_type_.load(std::memory_order_relaxed);
+  uint16_t size = inline_size_.load(std::memory_order_relaxed);
+  char data[DATA_HEADER_INLINE_SIZE];
+  std::memcpy(data, inline_data_, size);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (inline_seq_.load(std::memory_order_relaxed) != seq) {
+    return false;
+  }
+  *not_found = type == UndoRecordType::DELETE;
+  if (!*not_found) {
+    val->assign(data, size);
+  }
   return true;
 }
 
+bool DataHeader::Truncate(timestamp_t oldest, std::vector<UndoRecord *> *garbage) {
+  // 写事务只会修改version chain的头部，回滚也只会删除头部还没有提交的版本，所以这里不需要加锁。
+  UndoRecord *undo = version_chain_.load();
+  while (undo != nullptr && undo->NewerThan(oldest)) {
+    undo = undo->Next().load();
+  }
+  if (undo == nullptr) {
+    return false;
+  }
+  // undo是所有正在执行的事务都能看到的版本，读事务到这里就会停下，之后的版本可以删除。
+  UndoRecord *old = undo->Next().exchange(nullptr);
+  while (old != nullptr) {
+    garbage->push_back(old);
+    old = old->Next().load();
+  }
+  return undo->Type() == UndoRecordType::DELETE;
+}
+
+UndoRecord *DataHeader::TryMarkDeleted(timestamp_t oldest, bool *locked) {
+  *locked = !latch_.TryWriteLock();
+  if (*locked) {
+    return nullptr;
+  }
+  // 墓碑之后的版本已经被Truncate删除了，墓碑就是唯一的版本，时间戳不大于oldest说明所有事务都看不到这个key
+  UndoRecord *undo = version_chain_.load();
+  if (undo == nullptr || undo->Type() != UndoRecordType::DELETE || undo->NewerThan(oldest) ||
+      undo->Next().load() != nullptr) {
+    latch_.WriteUnlock();
+    return nullptr;
+  }
+  deleted_.store(true);
+  return undo;
+}
+
 bool DataHeader::Select(Transaction *txn, std::string *val, bool *not_found) {
   if (txn->Type() == TransactionType::READ) {
-    // 读事务不用加锁
+    // 读事务不用加锁，大多数读取的是最新版本，先尝试读取内联的副本
+    if (SelectInline(txn->Timestamp(), val, not_found)) {
+      return true;
+    }
     UndoRecord *undo = version_chain_.load();
     if (undo == nullptr) {
       *not_found = true;
@@ -86,7 +192,7 @@ bool DataHeader::Select(Transaction *txn, std::string *val, bool *not_found) {
 
   // 写事务的读操作直接读取最新内容。
   UndoRecord *undo = version_chain_.load();
-  if (undo == nullptr) {
+  if (undo == nullptr || undo->Type() == UndoRecordType::DELETE) {
     *not_found = true;
     return true;
   }
@@ -0,0 +1,167 @@
+#include "transaction/garbage_collector.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include "common/config.h"
+#include "storage/data_header.h"
+#include "transaction/transaction.h"
+#include "transaction/undo_record.h"
+
+namespace pidan {
+
+GarbageCollector::~GarbageCollector() {
+  Stop();
+  for (auto &batch : pending_batches_) {
+    FreeBatch(&batch);
+  }
+  for (auto *txn : waiting_txns_) {
+    delete txn;
+  }
+}
+
+void GarbageCollector::Start() {
+  terminate_ = false;
+  thread_ = new std::thread([this] {
+    std::unique_lock<std::mutex> lock(terminate_latch_);
+    while (!terminate_) {
+      this->PerformGC();
+      terminate_cv_.wait_for(lock, std::chrono::milliseconds(GC_INTERVAL), [this] { return terminate_; });
+    }
+  });
+}
+
+void GarbageCollector::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(terminate_latch_);
+    terminate_ = true;
+  }
+  terminate_cv_.notify_all();
+  if (thread_ != nullptr) {
+    thread_->join();
+    delete thread_;
+    thread_ = nullptr;
+  }
+}
+
+uint64_t GarbageCollector::PerformGC() {
+  // 先释放上一轮之前摘下的版本，摘下它们时正在执行的事务都已经结束了
+  timestamp_t oldest = OldestActiveTimestamp();
+  uint64_t freed = 0;
+  size_t remain = 0;
+  for (auto &batch : pending_batches_) {
+    if (batch.timestamp < oldest && batch.completed_seq <= processed_seq_) {
+      freed += FreeBatch(&batch);
+    } else {
+      // 自己给自己move赋值会清空batch中的vector
+      if (&pending_batches_[remain] != &batch) {
+        pending_batches_[remain] = std::move(batch);
+      }
+      remain++;
+    }
+  }
+  pending_batches_.resize(remain);
+
+  // 当前时间要在扫描正在执行的事务之前读取，见TimestampManager::BeginTransaction
+  timestamp_t visible = std::min(ts_manager_->CurrentTime(), OldestActiveTimestamp());
+  GarbageBatch garbage;
+  std::vector<DataHeader *> deleted;
+  std::vector<Transaction *> txns = txn_manager_->TakeCompletedTransactions();
+  if (!txns.empty()) {
+    taken_seq_ = txns.back()->completed_seq_;
+  }
+  txns.insert(txns.end(), waiting_txns_.begin(), waiting_txns_.end());
+  waiting_txns_.clear();
+  for (auto *txn : txns) {
+    if (txn->Aborted()) {
+      // 回滚时已经从version chain中删除了这些版本
+      garbage.records.insert(garbage.records.end(), txn->write_set_.begin(), txn->write_set_.end());
+    } else if (txn->CommitTimestamp() <= visible) {
+      // 事务写入的版本对所有正在执行的事务都可见，比它更旧的版本都可以删除
+      txn->lock_set_.ForEach([&](DataHeader *data_header, LockMode mode) {
+        if (mode == LockMode::WRITE && data_header->Truncate(visible, &garbage.records)) {
+          deleted.push_back(data_header);
+        }
+      });
+    } else {
+      waiting_txns_.push_back(txn);
+      continue;
+    }
+    delete txn;
+    freed_txn_num_.fetch_add(1, std::memory_order_relaxed);
+  }
+  processed_seq_ = taken_seq_;
+  for (auto *txn : waiting_txns_) {
+    processed_seq_ = std::min(processed_seq_, txn->completed_seq_ - 1);
+  }
+  // 只读了这个key的写事务，或者加锁之后回滚的事务不会再把它放回deleted，上一轮没能删除的要在这里重试。
+  // 同一个DataHeader可能被多个事务修改过，只需要检查一次。
+  deleted.insert(deleted.end(), locked_deleted_.begin(), locked_deleted_.end());
+  locked_deleted_.clear();
+  std::sort(deleted.begin(), deleted.end());
+  deleted.erase(std::unique(deleted.begin(), deleted.end()), deleted.end());
+  // 还没有释放锁的事务会让TryMarkDeleted失败。已经释放锁的事务都已经交给了GC线程，但可能还在等待处理，
+  // 被删除的DataHeader要等它们处理完之后才能释放。
+  RemoveDeleted(deleted, visible, &garbage);
+
+  if (!garbage.records.empty()) {
+    // 之后开始的事务的时间戳都大于这个时间戳，不会再访问到这些版本
+    garbage.timestamp = ts_manager_->CheckOutTimestamp();
+    pending_batches_.push_back(std::move(garbage));
+  }
+  return freed;
+}
+
+void GarbageCollector::RemoveDeleted(const std::vector<DataHeader *> &candidates, timestamp_t visible,
+                                     GarbageBatch *batch) {
+  if (remove_key_ == nullptr) {
+    return;
+  }
+  std::string key;
+  for (auto *data_header : candidates) {
+    if (data_header->IsDeleted()) {
+      continue;
+    }
+    bool locked;
+    UndoRecord *tombstone = data_header->TryMarkDeleted(visible, &locked);
+    if (tombstone == nullptr) {
+      if (locked) {
+        locked_deleted_.push_back(data_header);
+      }
+      continue;
+    }
+    tombstone->GetData(&key);
+    remove_key_(key);
+    removed_key_num_.fetch_add(1, std::memory_order_relaxed);
+    // 还有事务可能通过索引拿到了这个DataHeader，和摘下的版本一起等待之后释放
+    batch->records.push_back(tombstone);
+    batch->data_headers.push_back(data_header);
+  }
+  if (!batch->data_headers.empty()) {
+    // 标记删除之后才读取，修改过这些DataHeader的事务的序号都不大于它
+    batch->completed_seq = txn_manager_->CompletedNum();
+  }
+}
+
+timestamp_t GarbageCollector::OldestActiveTimestamp() {
+  timestamp_t oldest = ts_manager_->OldestTimestamp();
+  // 还没有任何线程开启过事务
+  return oldest == 0 ? MAX_TIMESTAMP : oldest;
+}
+
+uint64_t GarbageCollector::FreeBatch(GarbageBatch *batch) {
+  for (auto *record : batch->records) {
+    UndoRecord::Delete(record);
+  }
+  for (auto *data_header : batch->data_headers) {
+    delete data_header;
+  }
+  uint64_t num = batch->records.size();
+  freed_record_num_.fetch_add(num, std::memory_order_relaxed);
+  batch->records.clear();
+  batch->data_headers.clear();
+  return num;
+}
+
+}  // namespace pidan
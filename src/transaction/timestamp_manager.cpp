@@ -1,56 +1,41 @@
 #include "transaction/timestamp_manager.h"
 
 #include "common/config.h"
+#include "common/thread_registry.h"
 
 namespace pidan {
 
 namespace {
 
 // active_txn中的元素的值有三种含义
-// active_txn[index] == 0 表示该下标没有被占用，即系统中没有以index为id的线程存在。
+// active_txn[index] == 0 表示id为index的线程还没有开启过事务，或者这个id还没有被分配。
 // active_txn[index] == MAX_TIMESTAMP 表示线程id为index的线程当前没有正在执行的事务。
 // active_txn[index] == ts 表示线程id为index的线程当前所执行事务的启动时间为ts
 std::atomic<timestamp_t> active_txn[MAX_ACCESS_THREAD];
 
-int AssignThreadID() {
-  for (int i = 0; i < MAX_ACCESS_THREAD; i++) {
-    if (active_txn[i] == 0) {
-      active_txn[i] = MAX_TIMESTAMP;
-      return i;
-    }
-  }
-  throw std::runtime_error("no enough threads id to assign ");
-}
-
-void ThreadEnd(int id) { active_txn[id] = 0; }
-
-class ThreadLocalObject {
- public:
-  DISALLOW_COPY_AND_MOVE(ThreadLocalObject);
+// 线程退出后它的id会分配给其他线程，退出时要清除它公布的时间戳，否则一个没有结束事务就退出的线程会让GC一直
+// 无法回收它之后的版本
+void ResetActiveTxn(int id) { active_txn[id] = 0; }
 
-  ThreadLocalObject() : id_(AssignThreadID()){};
-
-  ~ThreadLocalObject() { ThreadEnd(id_); }
-
-  int ThreadID() { return id_; }
-
- private:
-  int id_;
-};
+[[maybe_unused]] const bool reset_active_txn_added = ThreadRegistry::AddExitHook(ResetActiveTxn);
 
 }  // namespace
 
-thread_local ThreadLocalObject local_obj;
-
+// 事务的时间戳就是公布的值。公布之后当前时间没有变化，说明GC线程扫描active_txn时如果没有看到公布的值，
+// 那么它在扫描之前读到的当前时间一定不大于事务的时间戳，不会回收这个事务需要读取的版本；变化了就重新读取。
 timestamp_t TimestampManager::BeginTransaction() {
-  auto ts = CurrentTime();
-  active_txn[local_obj.ThreadID()] = ts;
+  std::atomic<timestamp_t> *slot = &active_txn[ThreadRegistry::ThreadID()];
+  timestamp_t ts;
+  do {
+    ts = CurrentTime();
+    slot->store(ts);
+  } while (ts != CurrentTime());
   return ts;
 }
 
-int TimestampManager::ThreadID() { return local_obj.ThreadID(); }
+int TimestampManager::ThreadID() { return ThreadRegistry::ThreadID(); }
 
-void TimestampManager::EndTransaction() { active_txn[local_obj.ThreadID()] = MAX_TIMESTAMP; }
+void TimestampManager::EndTransaction() { active_txn[ThreadRegistry::ThreadID()] = MAX_TIMESTAMP; }
 
 timestamp_t TimestampManager::OldestTimestamp() {
   timestamp_t result = active_txn[0].load();
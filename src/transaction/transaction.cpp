@@ -9,70 +9,69 @@
 namespace pidan {
 
 UndoRecord *Transaction::NewUndoRecordForPut(DataHeader *data_header, const Slice &val) {
-  auto *buf = new char[sizeof(UndoRecord) + val.size()];
-  auto *record = reinterpret_cast<UndoRecord *>(buf);
-  record->type_ = UndoRecordType::PUT;
+  return NewUndoRecord(UndoRecordType::PUT, data_header, val);
+}
+
+UndoRecord *Transaction::NewUndoRecordForDelete(DataHeader *data_header, const Slice &key) {
+  return NewUndoRecord(UndoRecordType::DELETE, data_header, key);
+}
+
+UndoRecord *Transaction::NewUndoRecord(UndoRecordType type, DataHeader *data_header, const Slice &data) {
+  auto *record = static_cast<UndoRecord *>(TransactionPool::Instance()->Allocate(UndoRecord::SizeOf(data.size())));
+  record->type_ = type;
   record->timestamp_ = MAX_TIMESTAMP;
   record->next_ = nullptr;
   record->header_ = data_header;
-  record->data_.Init(val);
+  record->data_.Init(data);
   write_set_.push_back(record);
   return record;
 }
 
-void Transaction::ReadLockOn(DataHeader *data_header) {
-  auto result = read_lock_set_.insert(data_header);
-  assert(result.second);
-}
+void Transaction::ReadLockOn(DataHeader *data_header) { lock_set_.Insert(data_header, LockMode::READ); }
 
-void Transaction::WriteLockOn(DataHeader *data_header) {
-  auto result = write_lock_set_.insert(data_header);
-  assert(result.second);
-}
+void Transaction::WriteLockOn(DataHeader *data_header) { lock_set_.Insert(data_header, LockMode::WRITE); }
 
-bool Transaction::AlreadyWriteLockOn(DataHeader *data_header) {
-  return write_lock_set_.find(data_header) != write_lock_set_.cend();
-}
+bool Transaction::AlreadyWriteLockOn(DataHeader *data_header) { return lock_set_.Holds(data_header, LockMode::WRITE); }
 
-bool Transaction::AlreadyReadLockOn(DataHeader *data_header) {
-  return read_lock_set_.find(data_header) != read_lock_set_.cend();
-}
+bool Transaction::AlreadyReadLockOn(DataHeader *data_header) { return lock_set_.Holds(data_header, LockMode::READ); }
 
-void Transaction::UpgradeToWriteLock(DataHeader *data_header) {
-  auto size = read_lock_set_.erase(data_header);
-  assert(size == 1);
-  auto result = write_lock_set_.insert(data_header);
-  assert(result.second);
-}
+void Transaction::UpgradeToWriteLock(DataHeader *data_header) { lock_set_.Upgrade(data_header); }
 
 void Transaction::MakeWriteVisible(timestamp_t timestamp) {
-  for (auto *record : write_set_) {
-    record->SetTimestamp(timestamp);
-  }
-  RelaseAllWriteLock();
-}
-
-void Transaction::RealseAllReadLock() {
-  for (auto *dh : read_lock_set_) {
-    dh->latch_.ReadUnlock();
-  }
-}
-
-void Transaction::RelaseAllWriteLock() {
-  for (auto *dh : write_lock_set_) {
-    dh->latch_.WriteUnlock();
-  }
+  lock_set_.ForEach([this, timestamp](DataHeader *data_header, LockMode mode) {
+    if (mode == LockMode::READ) {
+      data_header->latch_.ReadUnlock();
+      return;
+    }
+    // 新版本可见之前先让内联的旧版本失效，否则读事务可能读到内联的旧版本，而version chain上已经有对它可见的新版本
+    data_header->BeginInlineUpdate();
+    CommitAllUndoRecord(data_header, timestamp);
+    data_header->EndInlineUpdate();
+    data_header->latch_.WriteUnlock();
+  });
 }
 
 void Transaction::Rollback() {
+  aborted_ = true;
   if (Type() == TransactionType::READ) {
     return;
   }
-  for (auto *data_header : write_lock_set_) {
+  lock_set_.ForEach([this](DataHeader *data_header, LockMode mode) {
+    if (mode == LockMode::READ) {
+      data_header->latch_.ReadUnlock();
+      return;
+    }
     RollbackAllUndoRecord(data_header);
     data_header->latch_.WriteUnlock();
+  });
+}
+
+void Transaction::CommitAllUndoRecord(DataHeader *data_header, timestamp_t timestamp) {
+  // 持有写锁时，version chain头部所有未提交的版本都是这个事务写入的
+  for (auto *undo = data_header->version_chain_.load(); undo != nullptr && undo->GetTimestamp() == MAX_TIMESTAMP;
+       undo = undo->Next()) {
+    undo->SetTimestamp(timestamp);
   }
-  RealseAllReadLock();
 }
 
 void Transaction::RollbackAllUndoRecord(DataHeader *data_header) {
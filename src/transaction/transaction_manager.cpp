@@ -18,38 +18,71 @@ Transaction TransactionManager::BeginReadTransaction() {
   return Transaction(TransactionType::READ, ts_manager_->BeginTransaction());
 }
 
+TransactionManager::~TransactionManager() {
+  for (auto *txn : completed_txn_) {
+    delete txn;
+  }
+}
+
 void TransactionManager::Commit(Transaction *txn) {
   if (txn->Type() == TransactionType::READ) {
+    ts_manager_->EndTransaction();
     return;
   }
 
+  // 释放锁之前先交给GC线程。GC线程看到一个DataHeader没有加锁时，修改过它的事务都已经在completed_txn_中，
+  // 否则GC线程可能在处理这些事务之前就释放了DataHeader。在提交时间戳公布之前GC线程不会处理这个事务。
+  AddCompletedTransaction(txn);
+
+  timestamp_t commit_ts;
   if (txn->iso_lv_ == IsolationLevel::READ_COMMITTED) {
     // 这里不用加锁，因为在MakeWriteVisible执行之前没有其他事务能读到txn的修改
     // 但如果其他事务重复读的话，可能会读到不同的值。所以隔离级别是读已提交。
-    timestamp_t now_ts = ts_manager_->CurrentTime();
-    txn->MakeWriteVisible(now_ts + 1);
+    commit_ts = ts_manager_->CurrentTime() + 1;
+    txn->MakeWriteVisible(commit_ts);
     ts_manager_->CheckOutTimestamp();
-    txn->RealseAllReadLock();
-    return;
+  } else {
+    assert(txn->iso_lv_ == IsolationLevel::SERIALIZABLE);
+    {
+      // 这里要加锁，因为同一时间只能有一个事务提交，不能有其他事务在此期间去修改全局的timestamp
+      SpinLatch::ScopedSpinLatch lock(&commit_lock_);
+      commit_ts = ts_manager_->CurrentTime() + 1;
+      txn->MakeWriteVisible(commit_ts);
+      ts_manager_->CheckOutTimestamp();
+    }
   }
+  ts_manager_->EndTransaction();
+  // 这是最后一次访问txn，之后GC线程随时可能释放它
+  txn->commit_timestamp_.store(commit_ts);
+}
 
-  assert(txn->iso_lv_ == IsolationLevel::SERIALIZABLE);
-  {
-    // 这里要加锁，因为同一时间只能有一个事务提交，不能有其他事务在此期间去修改全局的timestamp
-    SpinLatch::ScopedSpinLatch lock(&commit_lock_);
-    timestamp_t now_ts = ts_manager_->CurrentTime();
-    txn->MakeWriteVisible(now_ts + 1);
-    ts_manager_->CheckOutTimestamp();
+void TransactionManager::Abort(Transaction *txn) {
+  // 回滚事务，就是要删除所有此事务创建的新版本。
+  txn->Rollback();
+  ts_manager_->EndTransaction();
+  if (txn->Type() == TransactionType::READ) {
+    return;
   }
-  txn->RealseAllReadLock();
+  // 被删除的版本可能还有读事务正在访问，交给GC线程等它们结束之后再释放
+  AddCompletedTransaction(txn);
+}
 
+void TransactionManager::AddCompletedTransaction(Transaction *txn) {
   SpinLatch::ScopedSpinLatch lock(&completed_txn_lock_);
+  txn->completed_seq_ = ++completed_num_;
   completed_txn_.push_back(txn);
 }
 
-void TransactionManager::Abort(Transaction *txn) {
-  // 回滚事务，就是要删除所有此事务创建的新版本。
-  txn->Rollback();
+uint64_t TransactionManager::CompletedNum() {
+  SpinLatch::ScopedSpinLatch lock(&completed_txn_lock_);
+  return completed_num_;
+}
+
+std::vector<Transaction *> TransactionManager::TakeCompletedTransactions() {
+  std::vector<Transaction *> result;
+  SpinLatch::ScopedSpinLatch lock(&completed_txn_lock_);
+  result.swap(completed_txn_);
+  return result;
 }
 
 }  // namespace pidan
\ No newline at end of file
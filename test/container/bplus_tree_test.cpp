@@ -1,12 +1,15 @@
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <memory>
 #include <random>
 #include <set>
 #include <string>
+#include <thread>
 
 #include "container/bplustree/node.h"
 #include "container/bplustree/tree.h"
@@ -45,6 +48,56 @@ TEST(BPlusTreeKeyMapTest, KeyMapSplit) {
   ASSERT_EQ(new_key_map.ValueAt(0), 4);
 }
 
+TEST(BPlusTreeKeyMapTest, KeyMapSplitInPlace) {
+  // 顺序插入时被移走的数据在data部分的一端，左边的数据不需要重新排列；乱序插入和删除之后左边的数据中间有空洞，
+  // 需要重新紧凑地排列。fence key的公共前缀变长时两边的后缀都要截断。
+  using KeyMapType = KeyMap<Key, Value, 4096>;
+  std::vector<std::string> keys;
+  for (int i = 0; i < 120; i++) {
+    keys.push_back("prefix_" + std::to_string(1000 + i * 7));
+  }
+  std::mt19937 g(42);
+  for (int round = 0; round < 8; round++) {
+    std::vector<std::string> order = keys;
+    if (round % 2 == 1) {
+      std::shuffle(order.begin(), order.end(), g);
+    }
+    KeyMapType key_map;
+    Key lower(round < 4 ? "prefix_1" : "prefix_0"), upper(round < 4 ? "prefix_2" : "prefix_19");
+    key_map.Reset(&lower, &upper);
+    for (auto &k : order) {
+      key_map.InsertKeyValue(key_map.FindLower(k), k, std::stoi(k.substr(7)));
+    }
+
+    KeyMapType new_key_map;
+    std::string split_key;
+    if (round % 4 < 2) {
+      split_key = key_map.Split(&new_key_map);
+    } else {
+      split_key = key_map.SplitWithKey(&new_key_map).first;
+      ASSERT_EQ(key_map.size() + new_key_map.size() + 1, keys.size());
+    }
+    ASSERT_EQ(key_map.UpperFence(), Key(split_key));
+    ASSERT_EQ(new_key_map.LowerFence(), Key(split_key));
+    ASSERT_EQ(new_key_map.UpperFence(), upper);
+    for (auto &k : keys) {
+      int cmp = Key(k).compare(split_key);
+      if (round % 4 >= 2 && cmp == 0) {
+        continue;
+      }
+      KeyMapType *target = cmp <= 0 ? &key_map : &new_key_map;
+      uint16_t index = target->FindLower(k);
+      ASSERT_LT(index, target->size());
+      ASSERT_EQ(target->KeyAt(index), k);
+      ASSERT_EQ(target->ValueAt(index), static_cast<Value>(std::stoi(k.substr(7))));
+    }
+    // 分裂后的keymap可以继续插入
+    key_map.InsertKeyValue(0, "prefix_10", 1);
+    ASSERT_EQ(key_map.KeyAt(0), "prefix_10");
+    ASSERT_EQ(key_map.KeyAt(1), keys[0]);
+  }
+}
+
 TEST(BPlusTreeNodeTest, InnerNodeInsertAndFind) {
   Key key = "2";
   InnerNode<Key> node(1, reinterpret_cast<Node *>(1), reinterpret_cast<Node *>(2), key);
@@ -128,6 +181,38 @@ TEST(BPlusTreeNodeTest, LeafNodeSplitSimple) {
   ASSERT_EQ(temp_val, 3);
 }
 
+TEST(BPlusTreeNodeTest, LeafNodeSplitTruncateSeparator) {
+  LeafNode<Key, Value> leaf;
+
+  bool not_enough_space = false;
+  for (int i = 100; i <= 199; i++) {
+    std::string key = "user_" + std::to_string(i) + "_profile";
+    ASSERT_TRUE(leaf.InsertUnique(key, i, &not_enough_space));
+  }
+
+  std::string split_key;
+  LeafNode<Key, Value> *sibling = leaf.Split(&split_key);
+  // 分隔key只需要区分两边的key，不需要保存完整的key
+  ASSERT_EQ(split_key, "user_15");
+  ASSERT_EQ(leaf.size(), 50);
+  ASSERT_EQ(sibling->size(), 50);
+
+  Value temp_val = 0;
+  for (int i = 100; i <= 199; i++) {
+    std::string key = "user_" + std::to_string(i) + "_profile";
+    ASSERT_EQ(Key(key).compare(split_key) <= 0, i < 150);
+    ASSERT_TRUE((i < 150 ? &leaf : sibling)->FindValue(key, &temp_val));
+    ASSERT_EQ(temp_val, i);
+  }
+  delete sibling;
+
+  using KeyMapType = KeyMap<Key, Value, 4096>;
+  ASSERT_EQ(KeyMapType::ShortestSeparator("abc", "abd"), "abc");
+  ASSERT_EQ(KeyMapType::ShortestSeparator("abc", "abdx"), "abd");
+  ASSERT_EQ(KeyMapType::ShortestSeparator("ab", "abc"), "ab");
+  ASSERT_EQ(KeyMapType::ShortestSeparator("ab", "abcd"), "abc");
+}
+
 TEST(BPlusTreeNodeTest, LeafNodeSplit) {
   LeafNode<Key, Value> leaf;
 
@@ -164,7 +249,7 @@ TEST(BPlusTreeNodeTest, InnerNodeSplitSimple) {
   InnerNode<Key> node(1, reinterpret_cast<Node *>(1), reinterpret_cast<Node *>(2), key);
   ASSERT_TRUE(node.Insert("4", reinterpret_cast<Node *>(3)));
   ASSERT_TRUE(node.Insert("3", reinterpret_cast<Node *>(4)));
-  Key split_key;
+  std::string split_key;
   auto sibling = node.Split(&split_key);
   EXPECT_EQ(node.size(), 1);
   EXPECT_EQ(sibling->size(), 1);
@@ -198,7 +283,7 @@ TEST(BPlusTreeNodeTest, InnerNodeSplit) {
     ASSERT_TRUE(node.Insert(std::to_string(key), reinterpret_cast<Node *>(key)));
   }
 
-  Key split_key;
+  std::string split_key;
   auto sibling = node.Split(&split_key);
   EXPECT_EQ(node.size(), 49);
   EXPECT_EQ(sibling->size(), 50);
@@ -231,11 +316,112 @@ TEST(BPlusTreeNodeTest, InnerNodeNotEnoughSpace) {
     keys[s] = reinterpret_cast<Node *>(fake_child++);
   }
 
-  Slice split_key;
+  std::string split_key;
   auto sibling = node.Split(&split_key);
   ASSERT_EQ(keys.size() - 1, node.size() + sibling->size());
 }
 
+// 写锁持有的时间远超过自旋的上限，等待的线程会先让出CPU，再在futex上睡眠，释放写锁之后全部被唤醒
+TEST(BPlusTreeNodeTest, WaitForLongWriteLock) {
+  LeafNode<Key, Value> node;
+  ASSERT_TRUE(node.WriteLockOrRestart());
+  OLCStats before = OLCStatsCollector::Collect();
+
+  const int thread_num = 4;
+  std::vector<uint64_t> versions(thread_num);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thread_num; i++) {
+    threads.emplace_back([&node, &versions, i] { ASSERT_TRUE(node.ReadLockOrRestart(&versions[i])); });
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  node.WriteUnlock();
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  uint64_t version;
+  ASSERT_TRUE(node.ReadLockOrRestart(&version));
+  for (uint64_t v : versions) {
+    ASSERT_EQ(v, version);
+  }
+  OLCStats stats = OLCStatsCollector::Collect() - before;
+  if (OLCStatsCollector::ENABLED) {
+    ASSERT_GT(stats.sleeps, 0);
+  }
+
+  // 被标记为删除时同样会唤醒等待者，加读锁失败
+  ASSERT_TRUE(node.WriteLockOrRestart());
+  std::thread reader([&node] {
+    uint64_t v;
+    ASSERT_FALSE(node.ReadLockOrRestart(&v));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  node.WriteUnlockObsolete();
+  reader.join();
+}
+
+TEST(BPlusTreeNodeTest, TryWriteLock) {
+  LeafNode<Key, Value> node;
+  uint64_t version;
+  ASSERT_TRUE(node.ReadLockOrRestart(&version));
+  ASSERT_TRUE(node.TryWriteLock());
+  ASSERT_FALSE(node.CheckOrRestart(version));
+  // 已经加锁时立即返回，不会等待
+  ASSERT_FALSE(node.TryWriteLock());
+  node.WriteUnlock();
+  ASSERT_TRUE(node.TryWriteLock());
+  node.WriteUnlockObsolete();
+  ASSERT_FALSE(node.TryWriteLock());
+}
+
+TEST(BPlusTreeNodeTest, NodePoolAllocateAndFree) {
+  NodePool *pool = NodePool::Instance();
+  const size_t size = 4096;
+  std::set<void *> slots;
+  for (size_t i = 0; i < BPLUSTREE_NODE_POOL_BATCH_BYTES / size * 5; i++) {
+    void *slot = pool->Allocate(size);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(slot) % size, 0);
+    ASSERT_TRUE(slots.insert(slot).second);
+  }
+
+  // 刚释放的slot会被同一个线程优先重用
+  void *slot = *slots.begin();
+  pool->Free(slot, size);
+  ASSERT_EQ(pool->Allocate(size), slot);
+
+  // 在另一个线程中释放，线程退出后这些slot回到全局链表，可以被当前线程重新分配
+  std::thread t([&] {
+    for (void *s : slots) {
+      pool->Free(s, size);
+    }
+  });
+  t.join();
+  std::set<void *> reused;
+  for (size_t i = 0; i < slots.size(); i++) {
+    void *s = pool->Allocate(size);
+    ASSERT_TRUE(reused.insert(s).second);
+  }
+  for (void *s : reused) {
+    pool->Free(s, size);
+  }
+
+  // 不同的大小从不同的size class中分配，slot按自己的大小对齐
+  for (size_t s = BPLUSTREE_MIN_NODE_SIZE; s <= BPLUSTREE_MAX_NODE_SIZE; s *= 2) {
+    ASSERT_EQ(NodePool::SlotSize(s - 1), s);
+    void *p = pool->Allocate(s - 1);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % s, 0);
+    pool->Free(p, s - 1);
+  }
+
+  // 节点通过operator new从内存池中分配
+  auto *leaf = new LeafNode<Key, Value>();
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(leaf) % BPLUSTREE_LEAFNODE_SIZE, 0);
+  delete leaf;
+  auto *small_leaf = new LeafNode<Key, Value, 256>();
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(small_leaf) % 256, 0);
+  delete small_leaf;
+}
+
 TEST(BPlusTreeTest, RandomInteger) {
   BPlusTree<Key, Value> tree;
   Value temp_val;
@@ -258,15 +444,595 @@ TEST(BPlusTreeTest, RandomInteger) {
   }
 }
 
+TEST(BPlusTreeTest, MultiLookup) {
+  BPlusTree<Key, Value> tree;
+  Value temp_val;
+  for (int i = 0; i < 100000; i += 2) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(i), i, &temp_val));
+  }
+
+  // 一半存在一半不存在，数量不是批量大小的整数倍
+  std::vector<std::string> key_strs;
+  for (int i = 0; i < 10001; i++) {
+    key_strs.push_back(std::to_string((i * 7919) % 100000));
+  }
+  std::vector<Key> keys(key_strs.begin(), key_strs.end());
+  std::vector<Value> values(keys.size());
+  std::unique_ptr<bool[]> found(new bool[keys.size()]);
+  tree.MultiLookup(keys.data(), keys.size(), values.data(), found.get());
+  for (size_t i = 0; i < keys.size(); i++) {
+    int k = (i * 7919) % 100000;
+    ASSERT_EQ(found[i], k % 2 == 0);
+    if (found[i]) {
+      ASSERT_EQ(values[i], k);
+    }
+  }
+}
+
+TEST(BPlusTreeTest, CreateIfNotExist) {
+  BPlusTree<Key, Value> tree;
+  int create_count = 0;
+  auto creater = [&create_count]() -> Value { return ++create_count; };
+
+  for (int i = 0; i < 50000; i++) {
+    Value val = 0;
+    ASSERT_FALSE(tree.CreateIfNotExist(std::to_string(i), &val, creater));
+    ASSERT_EQ(val, i + 1);
+  }
+  ASSERT_EQ(create_count, 50000);
+
+  // key已经存在时不会再调用creater
+  for (int i = 0; i < 50000; i++) {
+    Value val = 0;
+    ASSERT_TRUE(tree.CreateIfNotExist(std::to_string(i), &val, creater));
+    ASSERT_EQ(val, i + 1);
+  }
+  ASSERT_EQ(create_count, 50000);
+}
+
+TEST(BPlusTreeTest, IteratorForwardAndReverse) {
+  BPlusTree<Key, Value> tree;
+  std::map<std::string, Value> kvs;
+  Value temp_val;
+  for (int i = 0; i < 20000; i++) {
+    std::string k = std::to_string(i * 2);
+    kvs[k] = i;
+    ASSERT_TRUE(tree.InsertUnique(k, i, &temp_val));
+  }
+
+  BPlusTree<Key, Value>::Iterator iter(&tree);
+  auto expected = kvs.begin();
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++expected) {
+    ASSERT_NE(expected, kvs.end());
+    ASSERT_EQ(iter.Key(), expected->first);
+    ASSERT_EQ(iter.Value(), expected->second);
+  }
+  ASSERT_EQ(expected, kvs.end());
+
+  auto rexpected = kvs.rbegin();
+  for (iter.SeekToLast(); iter.Valid(); iter.Prev(), ++rexpected) {
+    ASSERT_NE(rexpected, kvs.rend());
+    ASSERT_EQ(iter.Key(), rexpected->first);
+    ASSERT_EQ(iter.Value(), rexpected->second);
+  }
+  ASSERT_EQ(rexpected, kvs.rend());
+
+  // 存在和不存在的key分别定位
+  for (int i = 0; i < 1000; i++) {
+    std::string k = std::to_string(i * 37);
+    iter.Seek(k);
+    auto lower = kvs.lower_bound(k);
+    ASSERT_EQ(iter.Valid(), lower != kvs.end());
+    if (iter.Valid()) {
+      ASSERT_EQ(iter.Key(), lower->first);
+    }
+
+    iter.SeekForPrev(k);
+    auto upper = kvs.upper_bound(k);
+    ASSERT_EQ(iter.Valid(), upper != kvs.begin());
+    if (iter.Valid()) {
+      ASSERT_EQ(iter.Key(), std::prev(upper)->first);
+    }
+  }
+}
+
+TEST(BPlusTreeTest, Scan) {
+  BPlusTree<Key, Value> tree;
+  Value temp_val;
+  for (int i = 10000; i < 30000; i++) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(i), i, &temp_val));
+  }
+
+  std::vector<Value> result;
+  auto consumer = [&result](const Key &key, const Value &val) {
+    ASSERT_EQ(key, std::to_string(val));
+    result.push_back(val);
+  };
+  ASSERT_EQ(tree.Scan("12000", "13000", 100000, consumer), 1000);
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(result[i], 12000 + i);
+  }
+
+  result.clear();
+  ASSERT_EQ(tree.Scan("15000", "99999", 10, consumer), 10);
+  ASSERT_EQ(result.front(), 15000);
+  ASSERT_EQ(result.back(), 15009);
+
+  result.clear();
+  ASSERT_EQ(tree.Scan("5", "6", 10, consumer), 0);
+}
+
+TEST(BPlusTreeTest, ScanWhileInsert) {
+  // 测试场景：一个线程不断插入新的key，另一个线程不断扫描，扫描结果必须有序，并且包含所有预先插入的key。
+  BPlusTree<Key, Value> tree;
+  Value temp_val;
+  for (int i = 100000; i < 200000; i += 2) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(i), i, &temp_val));
+  }
+
+  std::thread writer([&] {
+    Value val;
+    for (int i = 100001; i < 200000; i += 2) {
+      tree.InsertUnique(std::to_string(i), i, &val);
+    }
+  });
+
+  for (int round = 0; round < 5; round++) {
+    Value last = 0;
+    size_t even_count = 0;
+    tree.Scan("100000", "200000", SIZE_MAX, [&](const Key &, const Value &val) {
+      ASSERT_GT(val, last);
+      last = val;
+      if (val % 2 == 0) {
+        even_count++;
+      }
+    });
+    ASSERT_EQ(even_count, 50000);
+  }
+  writer.join();
+}
+
+TEST(BPlusTreeTest, RandomRemove) {
+  BPlusTree<Key, Value> tree;
+  Value temp_val;
+
+  std::vector<int> keys;
+  for (int i = 0; i <= 99999; i++) {
+    keys.push_back(i);
+  }
+  std::random_device rd;
+  std::mt19937 g(rd());
+  std::shuffle(keys.begin(), keys.end(), g);
+  for (auto &v : keys) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(v), v, &temp_val));
+  }
+
+  // 先删除一半的key，另一半必须仍然可以找到
+  std::shuffle(keys.begin(), keys.end(), g);
+  size_t half = keys.size() / 2;
+  for (size_t i = 0; i < half; i++) {
+    std::string k = std::to_string(keys[i]);
+    ASSERT_TRUE(tree.Remove(k));
+    ASSERT_FALSE(tree.Remove(k));
+    ASSERT_FALSE(tree.Lookup(k, &temp_val));
+  }
+  for (size_t i = half; i < keys.size(); i++) {
+    ASSERT_TRUE(tree.Lookup(std::to_string(keys[i]), &temp_val));
+    ASSERT_EQ(temp_val, keys[i]);
+  }
+
+  std::set<std::string> remaining;
+  for (size_t i = half; i < keys.size(); i++) {
+    remaining.insert(std::to_string(keys[i]));
+  }
+  BPlusTree<Key, Value>::Iterator iter(&tree);
+  auto expected = remaining.begin();
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++expected) {
+    ASSERT_EQ(iter.Key(), *expected);
+  }
+  ASSERT_EQ(expected, remaining.end());
+
+  // 删除全部key之后再重新插入
+  for (size_t i = half; i < keys.size(); i++) {
+    ASSERT_TRUE(tree.Remove(std::to_string(keys[i])));
+  }
+  iter.SeekToFirst();
+  ASSERT_FALSE(iter.Valid());
+  for (auto &v : keys) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(v), v, &temp_val));
+    ASSERT_TRUE(tree.Lookup(std::to_string(v), &temp_val));
+  }
+}
+
+TEST(BPlusTreeTest, IntegerKey) {
+  // 整数key使用定长的KeyMap，key中包含最高位为1的值，检查无符号比较的正确性。
+  BPlusTree<uint64_t, Value> tree;
+  Value temp_val;
+
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < 100000; i++) {
+    keys.push_back(i * 0x9e3779b97f4a7c15ULL);
+  }
+  std::random_device rd;
+  std::mt19937 g(rd());
+  std::shuffle(keys.begin(), keys.end(), g);
+  for (auto k : keys) {
+    ASSERT_TRUE(tree.InsertUnique(k, k + 1, &temp_val));
+  }
+  for (auto k : keys) {
+    ASSERT_FALSE(tree.InsertUnique(k, 0, &temp_val));
+    ASSERT_EQ(temp_val, k + 1);
+    ASSERT_TRUE(tree.Lookup(k, &temp_val));
+    ASSERT_EQ(temp_val, k + 1);
+  }
+
+  // 删除一半的key，剩下的key按顺序遍历
+  size_t half = keys.size() / 2;
+  for (size_t i = 0; i < half; i++) {
+    ASSERT_TRUE(tree.Remove(keys[i]));
+    ASSERT_FALSE(tree.Lookup(keys[i], &temp_val));
+  }
+  std::vector<uint64_t> remaining(keys.begin() + half, keys.end());
+  std::sort(remaining.begin(), remaining.end());
+  BPlusTree<uint64_t, Value>::Iterator iter(&tree);
+  auto expected = remaining.begin();
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++expected) {
+    ASSERT_EQ(iter.Key(), *expected);
+    ASSERT_EQ(iter.Value(), *expected + 1);
+  }
+  ASSERT_EQ(expected, remaining.end());
+
+  iter.SeekForPrev(remaining[100] + 1);
+  ASSERT_TRUE(iter.Valid());
+  ASSERT_EQ(iter.Key(), remaining[100]);
+  iter.Prev();
+  ASSERT_EQ(iter.Key(), remaining[99]);
+}
+
+TEST(BPlusTreeTest, SequentialInsert) {
+  // 顺序插入走快速路径，并且在插入点分裂；中间穿插乱序的插入和删除，检查快速路径的提示会被正确地清除
+  BPlusTree<Key, Value> tree;
+  Value temp_val;
+  const int num = 100000;
+  for (int i = 0; i < num; i++) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(1000000 + i * 2), i, &temp_val));
+    if (i % 1000 == 999) {
+      ASSERT_TRUE(tree.InsertUnique(std::to_string(1000000 + (i - 500) * 2 + 1), i, &temp_val));
+      ASSERT_FALSE(tree.InsertUnique(std::to_string(1000000 + i * 2), 0, &temp_val));
+      ASSERT_EQ(temp_val, static_cast<Value>(i));
+    }
+  }
+  for (int i = num - 1; i >= num / 2; i--) {
+    ASSERT_TRUE(tree.Remove(std::to_string(1000000 + i * 2)));
+  }
+  for (int i = num / 2; i < num; i++) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(1000000 + i * 2), i, &temp_val));
+  }
+  for (int i = 0; i < num; i++) {
+    ASSERT_TRUE(tree.Lookup(std::to_string(1000000 + i * 2), &temp_val));
+    ASSERT_EQ(temp_val, static_cast<Value>(i));
+  }
+  BPlusTree<Key, Value>::Iterator iter(&tree);
+  std::string prev;
+  size_t count = 0;
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next(), count++) {
+    ASSERT_LT(prev, iter.Key().ToString());
+    prev = iter.Key().ToString();
+  }
+  ASSERT_EQ(count, num + num / 1000);
+
+  // 多个线程同时顺序插入整数key，都集中在最右的叶子节点上
+  BPlusTree<uint64_t, Value> int_tree;
+  std::atomic<uint64_t> next_key{0};
+  const uint64_t int_num = 200000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      Value val;
+      for (uint64_t k = next_key++; k < int_num; k = next_key++) {
+        ASSERT_TRUE(int_tree.InsertUnique(k, k, &val));
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  for (uint64_t k = 0; k < int_num; k++) {
+    ASSERT_TRUE(int_tree.Lookup(k, &temp_val));
+    ASSERT_EQ(temp_val, k);
+  }
+}
+
+// 用不同大小的节点构建树，检查插入、查找、遍历和删除。很小的节点会频繁地分裂与合并，很大的节点只有几层。
+template <typename KeyType, uint32_t LEAF_SIZE, uint32_t INNER_SIZE, typename KeyMaker>
+static void CheckNodeSize(KeyMaker make_key) {
+  BPlusTree<KeyType, Value, LEAF_SIZE, INNER_SIZE> tree;
+  Value temp_val;
+
+  std::vector<uint64_t> nums;
+  for (uint64_t i = 0; i < 20000; i++) {
+    nums.push_back(i);
+  }
+  std::mt19937 g(LEAF_SIZE);
+  std::shuffle(nums.begin(), nums.end(), g);
+  for (auto n : nums) {
+    ASSERT_TRUE(tree.InsertUnique(make_key(n), n, &temp_val));
+  }
+  for (auto n : nums) {
+    ASSERT_TRUE(tree.Lookup(make_key(n), &temp_val));
+    ASSERT_EQ(temp_val, n);
+  }
+
+  size_t half = nums.size() / 2;
+  for (size_t i = 0; i < half; i++) {
+    ASSERT_TRUE(tree.Remove(make_key(nums[i])));
+  }
+  std::vector<uint64_t> remaining(nums.begin() + half, nums.end());
+  std::sort(remaining.begin(), remaining.end(),
+            [&](uint64_t a, uint64_t b) { return KeyTraits<KeyType>::Compare(make_key(a), make_key(b)) < 0; });
+  typename BPlusTree<KeyType, Value, LEAF_SIZE, INNER_SIZE>::Iterator iter(&tree);
+  auto expected = remaining.begin();
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++expected) {
+    ASSERT_EQ(iter.Value(), *expected);
+  }
+  ASSERT_EQ(expected, remaining.end());
+}
+
+TEST(BPlusTreeTest, NodeSize) {
+  // 最小的节点只能放下很短的key
+  ASSERT_LT((BPlusTree<Key, Value, 256, 256>::MaxKeySize()), static_cast<size_t>(MAX_KEY_SIZE));
+  ASSERT_EQ((BPlusTree<Key, Value, 64 << 10, 64 << 10>::MaxKeySize()), static_cast<size_t>(MAX_KEY_SIZE));
+
+  std::vector<std::string> strs;
+  for (uint64_t i = 0; i < 20000; i++) {
+    strs.push_back(std::to_string(i * 7919));
+  }
+  auto make_str = [&strs](uint64_t n) { return Key(strs[n]); };
+  auto make_int = [](uint64_t n) { return n * 0x9e3779b97f4a7c15ULL; };
+  CheckNodeSize<Key, 256, 256>(make_str);
+  CheckNodeSize<Key, 1024, 512>(make_str);
+  CheckNodeSize<Key, 16 << 10, 4096>(make_str);
+  CheckNodeSize<Key, 64 << 10, 64 << 10>(make_str);
+  CheckNodeSize<uint64_t, 256, 256>(make_int);
+  CheckNodeSize<uint64_t, 64 << 10, 16 << 10>(make_int);
+}
+
+// 批量构建之后检查所有key都能找到并且有序，然后继续插入和删除，检查批量构建出的树可以正常地分裂与合并
+static void CheckBulkLoadedTree(BPlusTree<Key, Value> *tree, const std::vector<std::pair<std::string, Value>> &data) {
+  Value temp_val;
+  for (auto &kv : data) {
+    ASSERT_TRUE(tree->Lookup(kv.first, &temp_val));
+    ASSERT_EQ(temp_val, kv.second);
+  }
+  {
+    BPlusTree<Key, Value>::Iterator iter(tree);
+    auto expected = data.begin();
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next(), ++expected) {
+      ASSERT_EQ(iter.Key(), expected->first);
+    }
+    ASSERT_EQ(expected, data.end());
+    auto r_expected = data.rbegin();
+    for (iter.SeekToLast(); iter.Valid(); iter.Prev(), ++r_expected) {
+      ASSERT_EQ(iter.Key(), r_expected->first);
+    }
+    ASSERT_EQ(r_expected, data.rend());
+  }
+
+  // 在已有的key之间插入新key
+  for (size_t i = 0; i < data.size(); i++) {
+    ASSERT_TRUE(tree->InsertUnique(data[i].first + "_new", i, &temp_val));
+    ASSERT_FALSE(tree->InsertUnique(data[i].first, i, &temp_val));
+  }
+  for (size_t i = 0; i < data.size(); i += 2) {
+    ASSERT_TRUE(tree->Remove(data[i].first));
+    ASSERT_TRUE(tree->Remove(data[i].first + "_new"));
+  }
+  for (size_t i = 0; i < data.size(); i++) {
+    ASSERT_EQ(tree->Lookup(data[i].first, &temp_val), i % 2 == 1);
+    ASSERT_EQ(tree->Lookup(data[i].first + "_new", &temp_val), i % 2 == 1);
+  }
+}
+
+TEST(BPlusTreeTest, BulkLoad) {
+  std::vector<std::pair<std::string, Value>> data;
+  for (int i = 0; i < 100000; i++) {
+    data.emplace_back("user_" + std::to_string(i), i);
+  }
+  std::sort(data.begin(), data.end());
+
+  BPlusTree<Key, Value> tree;
+  tree.BulkLoad(data.begin(), data.end());
+  CheckBulkLoadedTree(&tree, data);
+
+  // 空的输入以及只能放进一个叶子节点的输入
+  BPlusTree<Key, Value> empty_tree;
+  empty_tree.BulkLoad(data.begin(), data.begin());
+  BPlusTree<Key, Value>::Iterator iter(&empty_tree);
+  iter.SeekToFirst();
+  ASSERT_FALSE(iter.Valid());
+  BPlusTree<Key, Value> small_tree;
+  std::vector<std::pair<std::string, Value>> small_data(data.begin(), data.begin() + 10);
+  small_tree.BulkLoad(small_data.begin(), small_data.end(), 1.0);
+  CheckBulkLoadedTree(&small_tree, small_data);
+
+  // 整数key
+  std::vector<std::pair<uint64_t, Value>> int_data;
+  for (uint64_t i = 0; i < 100000; i++) {
+    int_data.emplace_back(i * 3, i);
+  }
+  BPlusTree<uint64_t, Value> int_tree;
+  int_tree.BulkLoad(int_data.begin(), int_data.end(), 1.0);
+  Value temp_val;
+  for (auto &kv : int_data) {
+    ASSERT_TRUE(int_tree.Lookup(kv.first, &temp_val));
+    ASSERT_EQ(temp_val, kv.second);
+    ASSERT_FALSE(int_tree.Lookup(kv.first + 1, &temp_val));
+    ASSERT_TRUE(int_tree.InsertUnique(kv.first + 1, kv.second, &temp_val));
+  }
+}
+
+TEST(BPlusTreeTest, ParallelBulkLoad) {
+  std::vector<std::pair<std::string, Value>> data;
+  for (int i = 0; i < 100000; i++) {
+    data.emplace_back(std::to_string(i * 7), i);
+  }
+  std::sort(data.begin(), data.end());
+
+  for (int thread_num : {1, 3, 8}) {
+    BPlusTree<Key, Value> tree;
+    tree.ParallelBulkLoad(data.begin(), data.end(), thread_num);
+    CheckBulkLoadedTree(&tree, data);
+  }
+}
+
+TEST(BPlusTreeTest, Inspect) {
+  BPlusTree<Key, Value> tree;
+  TreeStats stats = tree.Inspect();
+  ASSERT_EQ(stats.height, 1);
+  ASSERT_EQ(stats.NodeCount(), 1);
+  ASSERT_EQ(stats.KeyCount(), 0);
+
+  // 遍历的同时有其他线程插入，结果是近似的，只要求不出错
+  Value temp_val;
+  std::vector<std::string> keys;
+  uint64_t key_bytes = 0;
+  for (int i = 0; i < 100000; i++) {
+    keys.push_back("user_" + std::to_string(i * 7));
+    key_bytes += keys.back().size();
+  }
+  std::thread inspector([&tree] {
+    for (int i = 0; i < 20; i++) {
+      TreeStats s = tree.Inspect();
+      ASSERT_GE(s.height, 1);
+    }
+  });
+  for (auto &k : keys) {
+    ASSERT_TRUE(tree.InsertUnique(k, 0, &temp_val));
+  }
+  inspector.join();
+
+  stats = tree.Inspect();
+  ASSERT_GT(stats.height, 1);
+  ASSERT_EQ(stats.KeyCount(), keys.size());
+  ASSERT_EQ(stats.key_bytes, key_bytes);
+  ASSERT_LT(stats.stored_key_bytes, stats.key_bytes);
+  ASSERT_EQ(stats.min_key_size, 6);
+  ASSERT_EQ(stats.max_key_size, 11);
+  ASSERT_EQ(stats.levels[stats.height - 1].node_count, 1);
+  for (int level = 1; level < stats.height; level++) {
+    // 每一层的key数量加上节点数量就是下一层的节点数量
+    ASSERT_EQ(stats.levels[level].key_count + stats.levels[level].node_count, stats.levels[level - 1].node_count);
+  }
+  ASSERT_EQ(stats.FragmentedBytes(), 0);
+  ASSERT_EQ(stats.MemoryBytes(), stats.NodeCount() * 4096);
+  ASSERT_GT(stats.levels[0].min_fill_factor, 0);
+  ASSERT_LE(stats.levels[0].min_fill_factor, stats.levels[0].FillFactor());
+  ASSERT_LE(stats.FillFactor(), 1.0);
+
+  // 删除大部分key之后节点被合并，节点数量减少
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (i % 10 != 0) {
+      ASSERT_TRUE(tree.Remove(keys[i]));
+    }
+  }
+  TreeStats after_remove = tree.Inspect();
+  ASSERT_EQ(after_remove.KeyCount(), keys.size() / 10);
+  ASSERT_LT(after_remove.NodeCount(), stats.NodeCount());
+  ASSERT_EQ(after_remove.FragmentedBytes(), 0);
+
+  BPlusTree<uint64_t, Value> int_tree;
+  for (uint64_t i = 0; i < 10000; i++) {
+    ASSERT_TRUE(int_tree.InsertUnique(i * 0x9e3779b97f4a7c15ULL, i, &temp_val));
+  }
+  TreeStats int_stats = int_tree.Inspect();
+  ASSERT_EQ(int_stats.KeyCount(), 10000);
+  ASSERT_EQ(int_stats.key_bytes, 10000 * sizeof(uint64_t));
+  ASSERT_EQ(int_stats.min_key_size, sizeof(uint64_t));
+  ASSERT_EQ(int_stats.max_key_size, sizeof(uint64_t));
+}
+
+TEST(BPlusTreeTest, MultiThreadInsertAndLookup) {
+  // 测试场景：多个线程交错地插入key，每个线程插入后立即查找自己插入的key。
+  BPlusTree<Key, Value> tree;
+  const int thread_num = 8;
+  const int keys_per_thread = 50000;
+  ThreadPool tp(thread_num);
+  auto task = [&](int thread_id) {
+    Value val;
+    for (int i = 0; i < keys_per_thread; i++) {
+      int k = i * thread_num + thread_id;
+      ASSERT_TRUE(tree.InsertUnique(std::to_string(k), k, &val));
+      ASSERT_TRUE(tree.Lookup(std::to_string(k), &val));
+      ASSERT_EQ(val, k);
+    }
+  };
+  ThreadPoolRunWorkloadUntilFinish(&tp, task);
+
+  Value temp_val;
+  for (int k = 0; k < thread_num * keys_per_thread; k++) {
+    ASSERT_TRUE(tree.Lookup(std::to_string(k), &temp_val));
+    ASSERT_EQ(temp_val, k);
+  }
+}
+
+TEST(BPlusTreeTest, MultiThreadInsertAndRemove) {
+  // 测试场景：每个线程在自己的key范围内反复插入和删除，最后只保留偶数key。
+  BPlusTree<Key, Value> tree;
+  const int thread_num = 8;
+  const int keys_per_thread = 20000;
+  ThreadPool tp(thread_num);
+  auto task = [&](int thread_id) {
+    Value val;
+    int start = 1000000 + thread_id * keys_per_thread;
+    for (int round = 0; round < 2; round++) {
+      for (int i = start; i < start + keys_per_thread; i++) {
+        ASSERT_TRUE(tree.InsertUnique(std::to_string(i), i, &val));
+      }
+      for (int i = start; i < start + keys_per_thread; i++) {
+        if (round == 0 || i % 2 == 1) {
+          ASSERT_TRUE(tree.Remove(std::to_string(i)));
+        }
+      }
+    }
+  };
+  ThreadPoolRunWorkloadUntilFinish(&tp, task);
+
+  Value temp_val;
+  for (int i = 1000000; i < 1000000 + thread_num * keys_per_thread; i++) {
+    ASSERT_EQ(tree.Lookup(std::to_string(i), &temp_val), i % 2 == 0);
+  }
+}
+
+TEST(BPlusTreeTest, OLCStats) {
+  BPlusTree<Key, Value> tree;
+  Value temp_val;
+  OLCStats before = tree.Stats();
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(i), i, &temp_val));
+    ASSERT_TRUE(tree.Lookup(std::to_string(i), &temp_val));
+  }
+  OLCStats stats = tree.Stats() - before;
+  if (!OLCStatsCollector::ENABLED) {
+    // 没有打开统计时不会有任何计数
+    ASSERT_EQ(stats.epoch_joins, 0);
+    ASSERT_EQ(stats.splits[0], 0);
+    return;
+  }
+  ASSERT_EQ(stats.epoch_joins, 20000);
+  ASSERT_EQ(stats.epoch_leaves, 20000);
+  ASSERT_GT(stats.splits[0], 0);
+  ASSERT_EQ(stats.Restarts(), stats.split_restarts);
+}
+
 TEST(BPlusTreeTest, EpochManagerTest) {
   EpochManager epoch_manager_;
   epoch_manager_.Start();
 
   std::thread t([&] {
     for (int i = 0; i < 5; i++) {
-      auto epoch = epoch_manager_.JoinEpoch();
-      epoch_manager_.AddGarbageNode(new Node());
-      epoch_manager_.LeaveEpoch(epoch);
+      epoch_manager_.JoinEpoch();
+      epoch_manager_.AddGarbageNode(new Node(), sizeof(Node));
+      epoch_manager_.LeaveEpoch();
       std::this_thread::sleep_for(std::chrono::milliseconds(50));
     }
   });
@@ -276,6 +1042,53 @@ TEST(BPlusTreeTest, EpochManagerTest) {
   ASSERT_EQ(epoch_manager_.GarbageNodeDelNum(), 5);
 }
 
+TEST(BPlusTreeTest, EpochManagerProtectsActiveThread) {
+  // 不启动GC线程，手动推进epoch并回收
+  EpochManager epoch_manager;
+  epoch_manager.JoinEpoch();
+
+  std::thread t([&] {
+    epoch_manager.JoinEpoch();
+    epoch_manager.AddGarbageNode(new Node(), sizeof(Node));
+    epoch_manager.LeaveEpoch();
+  });
+  t.join();
+
+  // 主线程在节点被删除之前就加入了epoch，可能还持有指向它的指针，嵌套加入不会改变主线程的epoch
+  epoch_manager.CreateNewEpoch();
+  epoch_manager.PerformGC();
+  ASSERT_EQ(epoch_manager.GarbageNodeDelNum(), 0);
+  epoch_manager.JoinEpoch();
+  epoch_manager.LeaveEpoch();
+  epoch_manager.CreateNewEpoch();
+  epoch_manager.PerformGC();
+  ASSERT_EQ(epoch_manager.GarbageNodeDelNum(), 0);
+
+  epoch_manager.LeaveEpoch();
+  epoch_manager.PerformGC();
+  ASSERT_EQ(epoch_manager.GarbageNodeDelNum(), 1);
+}
+
+TEST(BPlusTreeTest, GarbageCollection) {
+  BPlusTree<Key, Value> tree;
+  Value temp_val;
+  for (int i = 0; i < 100000; i++) {
+    ASSERT_TRUE(tree.InsertUnique(std::to_string(i), i, &temp_val));
+  }
+  for (int i = 0; i < 100000; i++) {
+    ASSERT_TRUE(tree.Remove(std::to_string(i)));
+  }
+
+  // 合并产生的节点由树自己的GC线程回收，不需要手动启动
+  ASSERT_GT(tree.RetiredBytes(), 0);
+  for (int i = 0; i < 50 && tree.PendingBytes() > 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(BPLUSTREE_EPOCH_INTERVAL));
+  }
+  ASSERT_EQ(tree.PendingBytes(), 0);
+  ASSERT_EQ(tree.FreedBytes(), tree.RetiredBytes());
+  ASSERT_EQ(tree.RetiredBytes() % BPLUSTREE_LEAFNODE_SIZE, 0);
+}
+
 // TEST(BPlusTreeTest, RandomString) {
 //   std::set<std::string> kvs;
 //   BPlusTree<Key, Value> tree;
@@ -2,6 +2,12 @@
 
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
 namespace pidan {
 
 TEST(DBTest, SimplePutAndGet) {
@@ -17,4 +23,85 @@ TEST(DBTest, SimplePutAndGet) {
   ASSERT_EQ(Status::KEY_NOT_EXIST, db->Get("not_key", &temp_val));
 }
 
+TEST(DBTest, Delete) {
+  PidanDB *db = nullptr;
+  ASSERT_EQ(Status::SUCCESS, PidanDB::Open("test.db", &db));
+  std::string temp_val;
+  ASSERT_EQ(Status::KEY_NOT_EXIST, db->Delete("abc"));
+  ASSERT_EQ(Status::SUCCESS, db->Put("abc", "123"));
+  ASSERT_EQ(Status::SUCCESS, db->Delete("abc"));
+  ASSERT_EQ(Status::KEY_NOT_EXIST, db->Get("abc", &temp_val));
+  ASSERT_EQ(Status::KEY_NOT_EXIST, db->Delete("abc"));
+
+  // 被删除的key由GC线程从索引中删除之后，还可以重新写入
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 1000; i++) {
+      ASSERT_EQ(Status::SUCCESS, db->Put(std::to_string(i), std::to_string(i + round)));
+    }
+    for (int i = 0; i < 1000; i += 2) {
+      ASSERT_EQ(Status::SUCCESS, db->Delete(std::to_string(i)));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (int i = 0; i < 1000; i++) {
+      Status status = db->Get(std::to_string(i), &temp_val);
+      if (i % 2 == 0) {
+        ASSERT_EQ(Status::KEY_NOT_EXIST, status);
+      } else {
+        ASSERT_EQ(Status::SUCCESS, status);
+        ASSERT_EQ(temp_val, std::to_string(i + round));
+      }
+    }
+  }
+  delete db;
+}
+
+TEST(DBTest, ConcurrentPutDeleteWithGC) {
+  PidanDB *db = nullptr;
+  ASSERT_EQ(Status::SUCCESS, PidanDB::Open("test.db", &db));
+  const int thread_num = 4;
+  const int key_num = 16;
+  const int ops = 20000;
+
+  // 多个线程在少量的key上交替写入和删除，GC线程同时截断版本、删除key并释放DataHeader
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; t++) {
+    threads.emplace_back([db, t] {
+      std::mt19937 rng(t);
+      std::string val;
+      for (int i = 0; i < ops; i++) {
+        std::string key = std::to_string(rng() % key_num);
+        Status status;
+        switch (rng() % 3) {
+          case 0:
+            status = db->Put(key, key);
+            ASSERT_TRUE(status == Status::SUCCESS || status == Status::FAIL_BY_ACTIVE_TXN);
+            break;
+          case 1:
+            status = db->Delete(key);
+            ASSERT_TRUE(status == Status::SUCCESS || status == Status::KEY_NOT_EXIST ||
+                        status == Status::FAIL_BY_ACTIVE_TXN);
+            break;
+          default:
+            status = db->Get(key, &val);
+            if (status == Status::SUCCESS) {
+              ASSERT_EQ(val, key);
+            }
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::string val;
+  for (int i = 0; i < key_num; i++) {
+    std::string key = std::to_string(i);
+    ASSERT_EQ(Status::SUCCESS, db->Put(key, key + "x"));
+    ASSERT_EQ(Status::SUCCESS, db->Get(key, &val));
+    ASSERT_EQ(val, key + "x");
+  }
+  delete db;
+}
+
 }  // namespace pidan
@@ -2,6 +2,13 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "transaction/timestamp_manager.h"
+#include "transaction/transaction_manager.h"
+
 namespace pidan {
 
 TEST(DataHeaderTest, SingleThreadWriteConflict) {
@@ -28,4 +35,76 @@ TEST(DataHeaderTest, SingleThreadWriteConflict) {
   ASSERT_EQ(val, "3");
 }
 
+static timestamp_t PutAndCommit(TransactionManager *txn_manager, DataHeader *header, const std::string &val) {
+  Transaction *txn = txn_manager->BeginWriteTransaction();
+  EXPECT_TRUE(header->Put(txn, val));
+  txn_manager->Commit(txn);
+  return txn->CommitTimestamp();
+}
+
+static std::string SelectAt(DataHeader *header, timestamp_t ts) {
+  Transaction txn(TransactionType::READ, ts);
+  std::string val;
+  bool not_found;
+  EXPECT_TRUE(header->Select(&txn, &val, &not_found));
+  return not_found ? "<not found>" : val;
+}
+
+TEST(DataHeaderTest, InlineNewestVersion) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  DataHeader header;
+  std::string large(DATA_HEADER_INLINE_SIZE + 1, 'x');
+  timestamp_t t1 = PutAndCommit(&txn_manager, &header, "v1");
+  timestamp_t t2 = PutAndCommit(&txn_manager, &header, large);
+  timestamp_t t3 = PutAndCommit(&txn_manager, &header, "v3");
+  Transaction *txn = txn_manager.BeginWriteTransaction();
+  bool not_found;
+  ASSERT_TRUE(header.Delete(txn, "key", &not_found));
+  ASSERT_FALSE(not_found);
+  txn_manager.Commit(txn);
+  timestamp_t t4 = txn->CommitTimestamp();
+
+  // 最新版本从内联的副本中读取，更早的读事务仍然从version chain中读到旧版本
+  ASSERT_EQ(SelectAt(&header, t1 - 1), "<not found>");
+  ASSERT_EQ(SelectAt(&header, t1), "v1");
+  ASSERT_EQ(SelectAt(&header, t2), large);
+  ASSERT_EQ(SelectAt(&header, t3), "v3");
+  ASSERT_EQ(SelectAt(&header, t4), "<not found>");
+
+  // 没有提交和回滚的版本不会被内联
+  txn = txn_manager.BeginWriteTransaction();
+  ASSERT_TRUE(header.Put(txn, "v5"));
+  ASSERT_EQ(SelectAt(&header, t4 + 1), "<not found>");
+  txn_manager.Abort(txn);
+  ASSERT_EQ(SelectAt(&header, t4 + 1), "<not found>");
+  PutAndCommit(&txn_manager, &header, "v6");
+  ASSERT_EQ(SelectAt(&header, ts_manager.CurrentTime()), "v6");
+  PutAndCommit(&txn_manager, &header, large + large);
+  ASSERT_EQ(SelectAt(&header, ts_manager.CurrentTime()), large + large);
+}
+
+TEST(DataHeaderTest, ConcurrentInlineRead) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  DataHeader header;
+  PutAndCommit(&txn_manager, &header, std::string(8, 'a'));
+
+  // 写入的值的所有字符都相同，长度在内联和不内联之间交替，读到不完整的内联副本时字符或者长度会不一致
+  std::atomic<bool> stop{false};
+  std::thread reader([&] {
+    while (!stop.load()) {
+      std::string val = SelectAt(&header, ts_manager.CurrentTime());
+      ASSERT_TRUE(val.size() == 8 || val.size() == DATA_HEADER_INLINE_SIZE * 2) << val;
+      ASSERT_EQ(val, std::string(val.size(), val[0]));
+    }
+  });
+  for (int i = 0; i < 20000; i++) {
+    size_t size = i % 3 == 0 ? DATA_HEADER_INLINE_SIZE * 2 : 8;
+    PutAndCommit(&txn_manager, &header, std::string(size, 'a' + i % 26));
+  }
+  stop.store(true);
+  reader.join();
+}
+
 }  // namespace pidan
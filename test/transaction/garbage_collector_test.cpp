@@ -0,0 +1,384 @@
+#include "transaction/garbage_collector.h"
+
+#include <gtest/gtest.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "storage/data_header.h"
+#include "transaction/transaction.h"
+
+namespace pidan {
+
+// 在data_header上用一个写事务写入val并提交
+static void PutAndCommit(TransactionManager *txn_manager, DataHeader *data_header, const std::string &val) {
+  Transaction *txn = txn_manager->BeginWriteTransaction();
+  ASSERT_TRUE(data_header->Put(txn, val));
+  txn_manager->Commit(txn);
+}
+
+static std::string SelectLatest(TransactionManager *txn_manager, DataHeader *data_header) {
+  Transaction txn = txn_manager->BeginReadTransaction();
+  std::string val;
+  bool not_found;
+  EXPECT_TRUE(data_header->Select(&txn, &val, &not_found));
+  EXPECT_FALSE(not_found);
+  txn_manager->Commit(&txn);
+  return val;
+}
+
+TEST(GarbageCollectorTest, TruncateVersionChain) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  GarbageCollector gc(&ts_manager, &txn_manager);
+  DataHeader data_header;
+  for (int i = 0; i < 100; i++) {
+    PutAndCommit(&txn_manager, &data_header, std::to_string(i));
+  }
+
+  // 第一轮只是把旧版本摘下来，第二轮才释放
+  ASSERT_EQ(gc.PerformGC(), 0);
+  ASSERT_EQ(gc.FreedTxnNum(), 100);
+  ASSERT_EQ(SelectLatest(&txn_manager, &data_header), "99");
+  ASSERT_EQ(gc.PerformGC(), 99);
+  ASSERT_EQ(gc.FreedRecordNum(), 99);
+  ASSERT_EQ(SelectLatest(&txn_manager, &data_header), "99");
+
+  // 没有新的版本时不会再回收
+  ASSERT_EQ(gc.PerformGC(), 0);
+  PutAndCommit(&txn_manager, &data_header, "100");
+  gc.PerformGC();
+  ASSERT_EQ(gc.PerformGC(), 1);
+  ASSERT_EQ(SelectLatest(&txn_manager, &data_header), "100");
+}
+
+TEST(GarbageCollectorTest, ActiveReaderKeepsVersion) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  GarbageCollector gc(&ts_manager, &txn_manager);
+  DataHeader data_header;
+  PutAndCommit(&txn_manager, &data_header, "old");
+
+  // 读事务在另一个线程中执行，每个线程同一时间只能有一个事务
+  std::mutex latch;
+  std::condition_variable cv;
+  int step = 0;
+  std::string reader_val;
+  std::thread reader([&] {
+    Transaction txn = txn_manager.BeginReadTransaction();
+    std::unique_lock<std::mutex> lock(latch);
+    step = 1;
+    cv.notify_all();
+    cv.wait(lock, [&] { return step == 2; });
+    bool not_found;
+    EXPECT_TRUE(data_header.Select(&txn, &reader_val, &not_found));
+    txn_manager.Commit(&txn);
+  });
+  {
+    std::unique_lock<std::mutex> lock(latch);
+    cv.wait(lock, [&] { return step == 1; });
+  }
+
+  for (int i = 0; i < 10; i++) {
+    PutAndCommit(&txn_manager, &data_header, std::to_string(i));
+  }
+  gc.PerformGC();
+  gc.PerformGC();
+  // 读事务开始之后的版本都不能删除，读事务还能读到开始时的版本
+  ASSERT_EQ(gc.FreedRecordNum(), 0);
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    step = 2;
+  }
+  cv.notify_all();
+  reader.join();
+  ASSERT_EQ(reader_val, "old");
+
+  gc.PerformGC();
+  gc.PerformGC();
+  ASSERT_EQ(gc.FreedRecordNum(), 10);
+  ASSERT_EQ(gc.FreedTxnNum(), 11);
+  ASSERT_EQ(SelectLatest(&txn_manager, &data_header), "9");
+}
+
+TEST(GarbageCollectorTest, PendingBatchSurvivesRounds) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  GarbageCollector gc(&ts_manager, &txn_manager);
+  DataHeader data_header;
+  for (int i = 0; i < 3; i++) {
+    PutAndCommit(&txn_manager, &data_header, std::to_string(i));
+  }
+
+  std::mutex latch;
+  std::condition_variable cv;
+  int step = 0;
+  std::thread reader([&] {
+    Transaction txn = txn_manager.BeginReadTransaction();
+    std::unique_lock<std::mutex> lock(latch);
+    step = 1;
+    cv.notify_all();
+    cv.wait(lock, [&] { return step == 2; });
+    txn_manager.Commit(&txn);
+  });
+  {
+    std::unique_lock<std::mutex> lock(latch);
+    cv.wait(lock, [&] { return step == 1; });
+  }
+
+  // 摘下的两个旧版本要等读事务结束才能释放，在此之前的每一轮都要保留它们
+  gc.PerformGC();
+  ASSERT_EQ(gc.PerformGC(), 0);
+  ASSERT_EQ(gc.PerformGC(), 0);
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    step = 2;
+  }
+  cv.notify_all();
+  reader.join();
+  ASSERT_EQ(gc.PerformGC(), 2);
+  ASSERT_EQ(SelectLatest(&txn_manager, &data_header), "2");
+}
+
+TEST(GarbageCollectorTest, FreeAbortedTransaction) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  GarbageCollector gc(&ts_manager, &txn_manager);
+  DataHeader data_header;
+  PutAndCommit(&txn_manager, &data_header, "committed");
+
+  Transaction *txn = txn_manager.BeginWriteTransaction();
+  ASSERT_TRUE(data_header.Put(txn, "aborted1"));
+  ASSERT_TRUE(data_header.Put(txn, "aborted2"));
+  txn_manager.Abort(txn);
+
+  gc.PerformGC();
+  ASSERT_EQ(gc.PerformGC(), 2);
+  ASSERT_EQ(gc.FreedTxnNum(), 2);
+  ASSERT_EQ(SelectLatest(&txn_manager, &data_header), "committed");
+}
+
+TEST(GarbageCollectorTest, RemoveDeletedKey) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  std::vector<std::string> removed_keys;
+  GarbageCollector gc(&ts_manager, &txn_manager, [&removed_keys](const Slice &key) {
+    removed_keys.emplace_back(key.data(), key.size());
+  });
+  // 被删除的DataHeader由GC释放，必须在堆上分配
+  auto *deleted = new DataHeader();
+  auto *alive = new DataHeader();
+  PutAndCommit(&txn_manager, deleted, "v1");
+  PutAndCommit(&txn_manager, deleted, "v2");
+  PutAndCommit(&txn_manager, alive, "v1");
+
+  Transaction *txn = txn_manager.BeginWriteTransaction();
+  bool not_found;
+  ASSERT_TRUE(deleted->Delete(txn, "deleted", &not_found));
+  ASSERT_FALSE(not_found);
+  // 同一个事务中删除之后就读不到了，再删除一次不会写入新的墓碑
+  std::string val;
+  ASSERT_TRUE(deleted->Select(txn, &val, &not_found));
+  ASSERT_TRUE(not_found);
+  ASSERT_TRUE(deleted->Delete(txn, "deleted", &not_found));
+  ASSERT_TRUE(not_found);
+  txn_manager.Commit(txn);
+
+  Transaction reader = txn_manager.BeginReadTransaction();
+  ASSERT_TRUE(deleted->Select(&reader, &val, &not_found));
+  ASSERT_TRUE(not_found);
+  txn_manager.Commit(&reader);
+
+  // 第一轮截断墓碑之前的版本并从索引中删除key，第二轮释放两个旧版本、墓碑以及DataHeader
+  gc.PerformGC();
+  ASSERT_EQ(gc.RemovedKeyNum(), 1);
+  ASSERT_EQ(removed_keys, std::vector<std::string>{"deleted"});
+  ASSERT_TRUE(deleted->IsDeleted());
+  ASSERT_EQ(gc.PerformGC(), 3);
+  ASSERT_FALSE(alive->IsDeleted());
+  ASSERT_EQ(SelectLatest(&txn_manager, alive), "v1");
+  delete alive;
+}
+
+TEST(GarbageCollectorTest, DeletedKeyWaitsForUnprocessedWriter) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  GarbageCollector gc(&ts_manager, &txn_manager, [](const Slice &key) {});
+  auto *deleted = new DataHeader();
+  PutAndCommit(&txn_manager, deleted, "v1");
+  Transaction *txn = txn_manager.BeginWriteTransaction();
+  bool not_found;
+  ASSERT_TRUE(deleted->Delete(txn, "deleted", &not_found));
+  txn_manager.Commit(txn);
+
+  // 读事务让之后提交的事务进入等待
+  std::mutex latch;
+  std::condition_variable cv;
+  int step = 0;
+  std::thread reader([&] {
+    Transaction txn = txn_manager.BeginReadTransaction();
+    std::unique_lock<std::mutex> lock(latch);
+    step = 1;
+    cv.notify_all();
+    cv.wait(lock, [&] { return step == 2; });
+    txn_manager.Commit(&txn);
+  });
+  {
+    std::unique_lock<std::mutex> lock(latch);
+    cv.wait(lock, [&] { return step == 1; });
+  }
+
+  // 这个事务只加了写锁，没有写入墓碑，提交之后DataHeader上没有锁，墓碑仍然是最新的版本
+  txn = txn_manager.BeginWriteTransaction();
+  ASSERT_TRUE(deleted->Delete(txn, "deleted", &not_found));
+  ASSERT_TRUE(not_found);
+  txn_manager.Commit(txn);
+
+  // 第一轮删除key，但还在等待的事务引用着DataHeader，读事务结束之后的一轮也不能释放它
+  gc.PerformGC();
+  ASSERT_EQ(gc.RemovedKeyNum(), 1);
+  {
+    std::lock_guard<std::mutex> guard(latch);
+    step = 2;
+  }
+  cv.notify_all();
+  reader.join();
+  ASSERT_EQ(gc.PerformGC(), 0);
+  ASSERT_EQ(gc.FreedTxnNum(), 3);
+  ASSERT_EQ(gc.PerformGC(), 2);
+}
+
+TEST(GarbageCollectorTest, RetryDeletedKeyAfterReadLock) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  std::vector<std::string> removed_keys;
+  GarbageCollector gc(&ts_manager, &txn_manager, [&removed_keys](const Slice &key) {
+    removed_keys.emplace_back(key.data(), key.size());
+  });
+  auto *deleted = new DataHeader();
+  PutAndCommit(&txn_manager, deleted, "v1");
+  Transaction *txn = txn_manager.BeginWriteTransaction();
+  bool not_found;
+  ASSERT_TRUE(deleted->Delete(txn, "deleted", &not_found));
+  txn_manager.Commit(txn);
+
+  // 写事务只读取了这个key，持有读锁，之后不会再有事务把它交给GC
+  Transaction *reader = txn_manager.BeginWriteTransaction();
+  std::string val;
+  ASSERT_TRUE(deleted->Select(reader, &val, &not_found));
+  ASSERT_TRUE(not_found);
+  gc.PerformGC();
+  ASSERT_EQ(gc.RemovedKeyNum(), 0);
+
+  // 读锁释放之后，下一轮重试时删除
+  txn_manager.Commit(reader);
+  gc.PerformGC();
+  ASSERT_EQ(gc.RemovedKeyNum(), 1);
+  ASSERT_EQ(removed_keys, std::vector<std::string>{"deleted"});
+  // 墓碑和DataHeader在下一轮释放
+  ASSERT_EQ(gc.PerformGC(), 1);
+  ASSERT_EQ(gc.PerformGC(), 0);
+}
+
+TEST(GarbageCollectorTest, ConcurrentDelete) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  // 模拟索引，key是下标，被GC删除的key对应的DataHeader被置为空，之后的写入会创建新的DataHeader
+  const int key_num = 8;
+  std::atomic<DataHeader *> index[key_num];
+  for (auto &dh : index) {
+    dh = nullptr;
+  }
+  GarbageCollector gc(&ts_manager, &txn_manager, [&index](const Slice &key) {
+    index[std::stoi(std::string(key.data(), key.size()))].store(nullptr);
+  });
+  gc.Start();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 20000; i++) {
+        int k = (i * 7 + t) % key_num;
+        Transaction *txn = txn_manager.BeginWriteTransaction();
+        DataHeader *dh = index[k].load();
+        bool not_found, success;
+        if (dh == nullptr) {
+          // 新的DataHeader创建时已经被txn加了写锁
+          auto *created = new DataHeader(txn);
+          ASSERT_TRUE(created->Put(txn, "v"));
+          if (!index[k].compare_exchange_strong(dh, created)) {
+            // 其他线程已经创建了，回滚之后没有其他人能访问到这个DataHeader
+            txn_manager.Abort(txn);
+            delete created;
+            continue;
+          }
+          success = true;
+        } else if (i % 1000 < 500) {
+          success = dh->Put(txn, "v");
+        } else {
+          success = dh->Delete(txn, std::to_string(k), &not_found);
+        }
+        if (success) {
+          txn_manager.Commit(txn);
+        } else {
+          txn_manager.Abort(txn);
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // 删除所有的key之后，GC最终会把它们全部从索引中删除
+  for (int k = 0; k < key_num; k++) {
+    Transaction *txn = txn_manager.BeginWriteTransaction();
+    DataHeader *dh = index[k].load();
+    bool not_found;
+    if (dh != nullptr && dh->Delete(txn, std::to_string(k), &not_found)) {
+      txn_manager.Commit(txn);
+    } else {
+      txn_manager.Abort(txn);
+    }
+  }
+  // 停止GC线程之后同步执行GC，直到不再有key被删除，不依赖GC线程的执行速度
+  gc.Stop();
+  uint64_t removed;
+  do {
+    removed = gc.RemovedKeyNum();
+  } while (gc.PerformGC() > 0 || gc.RemovedKeyNum() != removed);
+  for (auto &dh : index) {
+    ASSERT_EQ(dh.load(), nullptr);
+  }
+  ASSERT_GT(gc.RemovedKeyNum(), 0);
+}
+
+TEST(GarbageCollectorTest, BackgroundThread) {
+  TimestampManager ts_manager;
+  TransactionManager txn_manager(&ts_manager);
+  GarbageCollector gc(&ts_manager, &txn_manager);
+  gc.Start();
+  DataHeader data_header;
+  const int writes = 10000;
+  PutAndCommit(&txn_manager, &data_header, "0");
+  // 读事务和GC线程同时执行，读事务总是能读到一个已经提交的版本
+  std::thread reader([&] {
+    for (int i = 0; i < writes; i++) {
+      SelectLatest(&txn_manager, &data_header);
+    }
+  });
+  for (int i = 1; i < writes; i++) {
+    PutAndCommit(&txn_manager, &data_header, std::to_string(i));
+  }
+  reader.join();
+  gc.Stop();
+  gc.PerformGC();
+  gc.PerformGC();
+  ASSERT_EQ(gc.FreedRecordNum(), writes - 1);
+  ASSERT_EQ(gc.FreedTxnNum(), writes);
+}
+
+}  // namespace pidan
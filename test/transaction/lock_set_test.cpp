@@ -0,0 +1,43 @@
+#include "transaction/lock_set.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include "storage/data_header.h"
+
+namespace pidan {
+
+TEST(LockSetTest, FindAndUpgrade) {
+  // 分别测试只用数组线性查找和建立了哈希表的情况
+  for (int n : {TRANSACTION_INLINE_SET_SIZE, 1000U}) {
+    LockSet lock_set;
+    std::unique_ptr<DataHeader[]> headers(new DataHeader[n + 1]);
+    for (int i = 0; i < n; i++) {
+      lock_set.Insert(&headers[i], i % 2 == 0 ? LockMode::READ : LockMode::WRITE);
+    }
+    for (int i = 0; i < n; i++) {
+      ASSERT_TRUE(lock_set.Holds(&headers[i], i % 2 == 0 ? LockMode::READ : LockMode::WRITE));
+      ASSERT_FALSE(lock_set.Holds(&headers[i], i % 2 == 0 ? LockMode::WRITE : LockMode::READ));
+    }
+    ASSERT_FALSE(lock_set.Holds(&headers[n], LockMode::READ));
+    ASSERT_FALSE(lock_set.Holds(&headers[n], LockMode::WRITE));
+
+    for (int i = 0; i < n; i += 4) {
+      lock_set.Upgrade(&headers[i]);
+    }
+
+    // 按加锁的顺序遍历
+    std::vector<DataHeader *> read, write;
+    lock_set.ForEach([&](DataHeader *dh, LockMode mode) { (mode == LockMode::READ ? read : write).push_back(dh); });
+    std::vector<DataHeader *> expect_read, expect_write;
+    for (int i = 0; i < n; i++) {
+      (i % 2 == 0 && i % 4 != 0 ? expect_read : expect_write).push_back(&headers[i]);
+    }
+    ASSERT_EQ(read, expect_read);
+    ASSERT_EQ(write, expect_write);
+  }
+}
+
+}  // namespace pidan
@@ -37,6 +37,18 @@ TEST(TimestampManagerTest, OldestTimestamp) {
 
   // 当子线程事务都结束时，主线程事务成为了最老的事务
   ASSERT_EQ(tm.OldestTimestamp(), start_ts + 1);
+  tm.EndTransaction();
+}
+
+TEST(TimestampManagerTest, ThreadExitResetsSlot) {
+  TimestampManager tm;
+
+  // 子线程没有结束事务就退出了，它的id回收之后不应该再影响最老的时间戳
+  std::thread([&tm] { tm.BeginTransaction(); }).join();
+  tm.CheckOutTimestamp();
+  timestamp_t ts = tm.BeginTransaction();
+  ASSERT_EQ(tm.OldestTimestamp(), ts);
+  tm.EndTransaction();
 }
 
 }  // namespace pidan
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "transaction/transaction_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <set>
+#include <thread>
+
+#include "transaction/transaction.h"
+#include "transaction/undo_record.h"
+
+namespace pidan {
+
+TEST(TransactionPoolTest, SizeClass) {
+  // size class的slot大小严格递增，并且是能放下对应大小的最小的slot
+  size_t prev = 0;
+  for (int i = 0; i < TransactionSizeClasses::NUM_SIZE_CLASS; i++) {
+    size_t slot_size = TransactionSizeClasses::SlotSizeOf(i);
+    ASSERT_GT(slot_size, prev);
+    ASSERT_EQ(slot_size % sizeof(void *), 0);
+    ASSERT_EQ(TransactionSizeClasses::SizeClass(slot_size), i);
+    ASSERT_EQ(TransactionSizeClasses::SizeClass(prev + 1), i);
+    prev = slot_size;
+  }
+  ASSERT_EQ(prev, TRANSACTION_POOL_MAX_SLOT_SIZE);
+
+  ASSERT_EQ(TransactionPool::SlotSize(1), 16);
+  ASSERT_EQ(TransactionPool::SlotSize(72), 80);
+  ASSERT_EQ(TransactionPool::SlotSize(129), 160);
+  ASSERT_EQ(TransactionPool::SlotSize(257), 320);
+  // 超过最大slot的对象不经过size class
+  ASSERT_EQ(TransactionPool::SlotSize(TRANSACTION_POOL_MAX_SLOT_SIZE + 1), TRANSACTION_POOL_MAX_SLOT_SIZE + 1);
+}
+
+TEST(TransactionPoolTest, AllocateAndFree) {
+  TransactionPool *pool = TransactionPool::Instance();
+  const size_t size = 72;
+  std::set<void *> slots;
+  for (size_t i = 0; i < TRANSACTION_POOL_BATCH_BYTES / TransactionPool::SlotSize(size) * 5; i++) {
+    void *slot = pool->Allocate(size);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(slot) % 16, 0);
+    ASSERT_TRUE(slots.insert(slot).second);
+  }
+
+  // 在另一个线程中释放，就像GC线程回收UndoRecord一样，线程退出后这些slot可以被当前线程重新分配
+  std::thread gc([&] {
+    for (void *s : slots) {
+      pool->Free(s, size);
+    }
+  });
+  gc.join();
+  std::set<void *> reused;
+  for (size_t i = 0; i < slots.size(); i++) {
+    void *s = pool->Allocate(size);
+    ASSERT_TRUE(slots.count(s));
+    ASSERT_TRUE(reused.insert(s).second);
+  }
+  for (void *s : reused) {
+    pool->Free(s, size);
+  }
+
+  // 大对象直接从operator new分配
+  void *large = pool->Allocate(TRANSACTION_POOL_MAX_SLOT_SIZE * 2);
+  pool->Free(large, TRANSACTION_POOL_MAX_SLOT_SIZE * 2);
+}
+
+TEST(TransactionPoolTest, UndoRecordAndTransaction) {
+  auto *txn = new Transaction(TransactionType::WRITE, 1);
+  std::string small(16, 'a'), large(TRANSACTION_POOL_MAX_SLOT_SIZE, 'b');
+  UndoRecord *r1 = txn->NewUndoRecordForPut(nullptr, small);
+  UndoRecord *r2 = txn->NewUndoRecordForPut(nullptr, large);
+  std::string val;
+  r1->GetData(&val);
+  ASSERT_EQ(val, small);
+  r2->GetData(&val);
+  ASSERT_EQ(val, large);
+  UndoRecord::Delete(r1);
+  UndoRecord::Delete(r2);
+  delete txn;
+
+  // 刚释放的slot会被同一个线程优先重用
+  auto *reused = new Transaction(TransactionType::WRITE, 2);
+  ASSERT_EQ(reinterpret_cast<void *>(reused), reinterpret_cast<void *>(txn));
+  delete reused;
+}
+
+}  // namespace pidan